@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <bare.h>
+#include <errno.h>
 #include <js.h>
 #include <sqlite3.h>
 #include <stdbool.h>
@@ -11,14 +12,313 @@
 
 typedef utf8_t sqlite3_native_path_t[4096];
 
+typedef struct {
+  int type;
+
+  union {
+    int64_t integer;
+    double real;
+  };
+
+  void *data;
+  size_t len;
+} sqlite3_native_value_t;
+
+typedef struct sqlite3_native_function_s sqlite3_native_function_t;
+typedef struct sqlite3_native_table_s sqlite3_native_table_t;
+typedef struct sqlite3_native_query_s sqlite3_native_query_t;
+
+typedef struct {
+  sqlite3_stmt *handle;
+
+  // Offset of the end of the statement within the query.
+  size_t end;
+} sqlite3_native_statement_t;
+
+struct sqlite3_native_query_s {
+  uint64_t hash;
+
+  char *sql;
+  size_t len;
+
+  // The statements of the query prepared so far, in order. Later statements
+  // are only prepared once the earlier ones have run, as they may depend on
+  // the schema changes those make.
+  uint32_t statements_len;
+  uint32_t statements_capacity;
+  sqlite3_native_statement_t *statements;
+
+  sqlite3_native_query_t *prev;
+  sqlite3_native_query_t *next;
+
+  // The next query in the same hash bucket.
+  sqlite3_native_query_t *bucket;
+};
+
+typedef struct {
+  size_t capacity;
+  size_t len;
+
+  uint64_t hits;
+  uint64_t misses;
+
+  size_t queries;
+  size_t buckets_len;
+  sqlite3_native_query_t **buckets;
+
+  sqlite3_native_query_t lru;
+} sqlite3_native_statements_t;
+
+typedef struct {
+  uv_mutex_t lock;
+
+  int page_size;
+
+  uint32_t version;
+  bool pending;
+
+  size_t len;
+  uint32_t *versions;
+  uint8_t *dirty;
+} sqlite3_native_changes_t;
+
+// Stored size of each page of the main database when pages are compressed, or
+// 0 for pages that haven't been read or written yet.
+typedef struct {
+  uv_mutex_t lock;
+
+  bool enabled;
+
+  int page_size;
+
+  size_t len;
+  uint32_t *pages;
+
+  uint64_t known;
+  uint64_t compressed;
+  uint64_t stored;
+} sqlite3_native_compression_t;
+
+typedef struct {
+  uint8_t op;
+  uint32_t table;
+  int64_t rowid;
+} sqlite3_native_update_t;
+
+typedef struct {
+  size_t len;
+  size_t capacity;
+  sqlite3_native_update_t *entries;
+
+  // Table names, stored once per batch.
+  uint32_t tables_len;
+  uint32_t tables_capacity;
+  char **tables;
+} sqlite3_native_updates_t;
+
+typedef struct {
+  char *name;
+
+  // Number of row changes recorded when the savepoint was opened.
+  size_t changes;
+} sqlite3_native_savepoint_t;
+
 typedef struct {
   sqlite3 *handle;
 
   js_env_t *env;
 
+  uv_mutex_t lock;
+
+  sqlite3_native_statements_t statements;
+
+  // Bumped whenever the connection commits or its contents are replaced, and
+  // combined with the commit generation of the VFS to version query results.
+  uint64_t version;
+  sqlite3_native_changes_t *changes;
+
+  // Whether the open transaction has uncommitted changes, which may still be
+  // rolled back.
+  bool dirty;
+
+  // Row changes of the open transaction, delivered to JavaScript in a single
+  // batch when it commits. Committing may still fail after the commit hook
+  // has run, so the batch is held in `committed` until the commit is known to
+  // have gone through.
+  bool watching;
+  sqlite3_native_updates_t *updates;
+  sqlite3_native_updates_t *committed;
+
+  // Savepoints of the open transaction, innermost last, so that the changes
+  // undone by rolling back to one of them can be dropped from the batch.
+  uint32_t savepoints_len;
+  uint32_t savepoints_capacity;
+  sqlite3_native_savepoint_t *savepoints;
+
+  js_ref_t *ctx;
+  js_ref_t *memory;
+
+  sqlite3_native_function_t *functions;
+  sqlite3_native_table_t *tables;
+
+  // Created on first use, as most connections never need all of them.
   js_threadsafe_function_t *on_result;
+  js_threadsafe_function_t *on_call;
+  js_threadsafe_function_t *on_change;
 } sqlite3_native_t;
 
+typedef struct sqlite3_native_memo_s sqlite3_native_memo_t;
+
+struct sqlite3_native_memo_s {
+  uint64_t hash;
+
+  uint8_t *key;
+  size_t len;
+
+  sqlite3_native_value_t result;
+
+  sqlite3_native_memo_t *next;
+};
+
+struct sqlite3_native_function_s {
+  sqlite3_native_t *db;
+
+  js_ref_t *fn;
+
+  bool aggregate;
+  bool deterministic;
+  bool vectorized;
+  int batch;
+
+  sqlite3_native_memo_t *memo[256];
+  size_t memo_len;
+
+  sqlite3_native_function_t *next;
+};
+
+typedef struct {
+  js_ref_t *state;
+
+  int argc;
+  int rows;
+  sqlite3_native_value_t *values;
+} sqlite3_native_aggregate_t;
+
+typedef enum {
+  sqlite3_native_call_scalar,
+  sqlite3_native_call_step,
+  sqlite3_native_call_final,
+} sqlite3_native_call_type_t;
+
+typedef struct {
+  sqlite3_native_call_type_t type;
+
+  sqlite3_native_function_t *function;
+  sqlite3_native_aggregate_t *aggregate;
+
+  int argc;
+  sqlite3_native_value_t *argv;
+
+  sqlite3_native_value_t result;
+
+  char *error;
+
+  uv_sem_t done;
+} sqlite3_native_call_t;
+
+typedef struct {
+  char *name;
+
+  js_typedarray_type_t type;
+  void *data;
+  bool sorted;
+
+  js_ref_t *array;
+} sqlite3_native_column_t;
+
+struct sqlite3_native_table_s {
+  char *name;
+
+  size_t len;
+
+  int columns_len;
+  sqlite3_native_column_t *columns;
+
+  sqlite3_native_table_t *next;
+};
+
+typedef struct {
+  sqlite3_vtab handle;
+
+  sqlite3_native_table_t *table;
+} sqlite3_native_vtab_t;
+
+typedef struct {
+  sqlite3_vtab_cursor handle;
+
+  sqlite3_native_table_t *table;
+
+  size_t row;
+  size_t end;
+} sqlite3_native_vtab_cursor_t;
+
+typedef struct {
+  uv_work_t handle;
+
+  sqlite3_native_t *db;
+
+  js_deferred_t *deferred;
+
+  sqlite3_native_table_t *table;
+
+  int status;
+} sqlite3_native_register_table_t;
+
+typedef struct {
+  uv_work_t handle;
+
+  sqlite3_native_t *db;
+
+  js_deferred_t *deferred;
+
+  sqlite3_native_function_t *function;
+
+  char *name;
+
+  int status;
+} sqlite3_native_create_function_t;
+
+enum {
+  sqlite3_native_vfs_access = 0,
+  sqlite3_native_vfs_size = 1,
+  sqlite3_native_vfs_read = 2,
+  sqlite3_native_vfs_write = 3,
+  sqlite3_native_vfs_delete = 4,
+  sqlite3_native_vfs_truncate = 5,
+  sqlite3_native_vfs_sync = 6,
+};
+
+typedef struct sqlite3_native_request_s sqlite3_native_request_t;
+
+// A VFS operation waiting for JavaScript. Requests live on the stack of the
+// thread that submitted them until their own semaphore is posted.
+struct sqlite3_native_request_s {
+  int op;
+  void *data;
+
+  uv_sem_t done;
+
+  sqlite3_native_request_t *next;
+};
+
+// Drains the request queues of every VFS created by the same JavaScript
+// environment. The function is created when the first VFS is registered and
+// released again once the last one is destroyed.
+typedef struct {
+  js_threadsafe_function_t *function;
+  uint32_t refs;
+} sqlite3_native_dispatcher_t;
+
 typedef struct {
   sqlite3_vfs handle;
 
@@ -27,21 +327,81 @@ typedef struct {
   js_env_t *env;
   js_ref_t *ctx;
 
-  js_threadsafe_function_t *on_access;
-  js_threadsafe_function_t *on_size;
-  js_threadsafe_function_t *on_read;
-  js_threadsafe_function_t *on_write;
-  js_threadsafe_function_t *on_delete;
-
-  uv_sem_t done;
+  js_ref_t *on_access;
+  js_ref_t *on_size;
+  js_ref_t *on_read;
+  js_ref_t *on_write;
+  js_ref_t *on_delete;
+  js_ref_t *on_truncate;
+  js_ref_t *on_sync;
+
+  // Requests are queued natively and drained in bulk by a single dispatch
+  // call, which is only scheduled when the queue goes from idle to pending.
+  sqlite3_native_dispatcher_t *dispatcher;
+  js_ref_t *dispatcher_ref;
+  bool registered;
+
+  uv_mutex_t lock;
+
+  struct {
+    sqlite3_native_request_t *head;
+    sqlite3_native_request_t *tail;
+    bool scheduled;
+  } queue;
+
+  sqlite3_native_changes_t changes;
+  sqlite3_native_compression_t compression;
+
+  // Locks held on the main database by the connections using the VFS, guarded
+  // by `lock`. All of them share the same files, so they're coordinated here
+  // rather than by the files themselves.
+  struct {
+    int shared;
+    bool reserved;
+    bool pending;
+  } locks;
+
+  // Bumped, also under `lock`, whenever the main database changes, so that
+  // connections can tell whether what they preloaded of it is still current.
+  uint64_t writes;
+
+  int read_ahead;
+
+  // Whether files implement sync() and truncate(), as calls to those that
+  // would do nothing are skipped without a round trip to JavaScript.
+  bool sync;
+  bool truncate;
 } sqlite3_native_vfs_t;
 
 typedef struct {
   sqlite3_file handle;
 
   int type;
+  int lock;
 
   sqlite3_native_vfs_t *vfs;
+
+  int64_t last;
+  int sequential;
+
+  struct {
+    void *data;
+    size_t capacity;
+    size_t len;
+    int64_t offset;
+  } ahead;
+
+  uint8_t *scratch;
+  size_t scratch_len;
+
+  // The leading bytes of the main database, or all of them if `complete`,
+  // read in bulk when the connection was opened.
+  struct {
+    uint8_t *data;
+    size_t len;
+    bool complete;
+    uint64_t writes;
+  } preload;
 } sqlite3_native_file_t;
 
 typedef struct {
@@ -50,6 +410,10 @@ typedef struct {
   void *buf;
   int len;
   int64_t offset;
+
+  int32_t read;
+
+  sqlite3_native_request_t request;
 } sqlite3_native_read_t;
 
 typedef struct {
@@ -58,20 +422,42 @@ typedef struct {
   const void *buf;
   int len;
   int64_t offset;
+
+  sqlite3_native_request_t request;
 } sqlite3_native_write_t;
 
 typedef struct {
   sqlite3_native_file_t *file;
 
   int64_t size;
+
+  sqlite3_native_request_t request;
 } sqlite3_native_size_t;
 
+typedef struct {
+  sqlite3_native_file_t *file;
+
+  int64_t size;
+
+  sqlite3_native_request_t request;
+} sqlite3_native_truncate_t;
+
+typedef struct {
+  sqlite3_native_file_t *file;
+
+  int flags;
+
+  sqlite3_native_request_t request;
+} sqlite3_native_sync_t;
+
 typedef struct {
   sqlite3_native_vfs_t *vfs;
 
   const char *name;
   int flags;
   bool exists;
+
+  sqlite3_native_request_t request;
 } sqlite3_native_access_t;
 
 typedef struct {
@@ -79,6 +465,8 @@ typedef struct {
 
   const char *name;
   bool sync;
+
+  sqlite3_native_request_t request;
 } sqlite3_native_delete_t;
 
 typedef struct {
@@ -90,6 +478,11 @@ typedef struct {
 
   sqlite3_native_path_t name;
   sqlite3_native_vfs_t *vfs;
+
+  int64_t preload;
+
+  char *error;
+  int code;
 } sqlite3_native_open_t;
 
 typedef struct {
@@ -100,6 +493,16 @@ typedef struct {
   js_deferred_t *deferred;
 } sqlite3_native_close_t;
 
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+
+  uint32_t *rows;
+  size_t rows_len;
+  size_t rows_capacity;
+} sqlite3_native_packed_t;
+
 typedef struct {
   uv_work_t handle;
 
@@ -108,6 +511,21 @@ typedef struct {
   js_deferred_t *deferred;
 
   utf8_t *query;
+  size_t query_len;
+
+  int params_len;
+  sqlite3_native_value_t *params;
+
+  char *begin;
+
+  bool packed;
+  sqlite3_native_packed_t rows_packed;
+
+  js_ref_t *info;
+  bool readonly;
+  bool wrote;
+  bool busy;
+  uint64_t version;
 
   js_ref_t *result;
   uint32_t i;
@@ -117,853 +535,7643 @@ typedef struct {
   char **columns;
 
   char *error;
+  int code;
 
   uv_sem_t done;
 } sqlite3_native_exec_t;
 
-static const size_t sqlite3_native__queue_limit = 64;
+typedef struct sqlite3_native_parallel_s sqlite3_native_parallel_t;
 
-static bool
-sqlite3_native__ends_with(const char *string, const char *suffix) {
-  size_t string_len = strlen(string);
-  size_t suffix_len = strlen(suffix);
+typedef struct {
+  sqlite3_native_exec_t exec;
 
-  if (suffix_len > string_len) return false;
+  sqlite3_native_parallel_t *parallel;
+} sqlite3_native_shard_t;
 
-  return strncmp(string + string_len - suffix_len, suffix, suffix_len) == 0;
-}
+struct sqlite3_native_parallel_s {
+  uv_work_t handle;
 
-static int
-sqlite3_native__get_file_type(int flags) {
-  if (flags & SQLITE_OPEN_MAIN_DB) return 0;
-  if (flags & SQLITE_OPEN_MAIN_JOURNAL) return 1;
-  if (flags & SQLITE_OPEN_WAL) return 2;
+  uv_loop_t *loop;
+  js_env_t *env;
 
-  return -1;
-}
+  js_deferred_t *deferred;
 
-static int
-sqlite3_native__get_file_type_from_name(const char *name) {
-  if (sqlite3_native__ends_with(name, "-journal")) return 1;
-  if (sqlite3_native__ends_with(name, "-wal")) return 2;
+  utf8_t *query;
+  size_t query_len;
 
-  return 0;
-}
+  int params_len;
+  sqlite3_native_value_t *params;
 
-static int
-sqlite3_native__on_vfs_close(sqlite3_file *handle) {
-  return SQLITE_OK;
-}
+  int merge;
+  int keys;
+  int order;
+  char *order_name;
+  bool descending;
 
-static js_value_t *
-sqlite3_native__on_vfs_read_done(js_env_t *env, js_callback_info_t *info) {
-  int err;
+  uint32_t len;
+  uint32_t pending;
+  sqlite3_native_shard_t *shards;
 
-  sqlite3_native_read_t *data;
+  sqlite3_native_packed_t result;
 
-  size_t argc = 1;
-  js_value_t *argv[1];
+  char *error;
+  int code;
+};
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
-  assert(err == 0);
+typedef struct {
+  uv_work_t handle;
 
-  assert(argc == 1);
+  sqlite3_native_t *db;
 
-  uv_sem_post(&data->file->vfs->done);
+  js_deferred_t *deferred;
 
-  return NULL;
-}
+  unsigned char *data;
+  sqlite3_int64 len;
+} sqlite3_native_serialize_t;
 
-static void
-sqlite3_native__on_vfs_read_call(js_env_t *env, js_value_t *on_read, void *context, void *arg) {
-  int err;
+typedef struct {
+  uv_work_t handle;
 
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+  sqlite3_native_t *db;
 
-  sqlite3_native_read_t *data = (sqlite3_native_read_t *) arg;
+  js_deferred_t *deferred;
 
-  js_value_t *ctx;
-  err = js_get_reference_value(env, vfs->ctx, &ctx);
-  assert(err == 0);
+  js_ref_t *buffer;
 
-  js_value_t *args[4];
+  unsigned char *data;
+  sqlite3_int64 len;
+  unsigned int flags;
+  bool copy;
 
-  err = js_create_uint32(env, data->file->type, &args[0]);
-  assert(err == 0);
+  int status;
+} sqlite3_native_deserialize_t;
 
-  err = js_create_external_arraybuffer(env, data->buf, data->len, NULL, NULL, &args[1]);
-  assert(err == 0);
+typedef struct {
+  uv_work_t handle;
 
-  err = js_create_int64(env, data->offset, &args[2]);
-  assert(err == 0);
+  sqlite3_native_t *src;
+  sqlite3_native_t *dest;
 
-  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_read_done, (void *) data, &args[3]);
-  assert(err == 0);
+  sqlite3_backup *backup;
 
-  err = js_call_function(env, ctx, on_read, 4, args, NULL);
-  assert(err == 0);
-}
+  js_deferred_t *deferred;
 
-static int
-sqlite3_native__on_vfs_read(sqlite3_file *handle, void *buf, int len, sqlite3_int64 offset) {
-  int err;
+  int pages;
+  int status;
+  int remaining;
+  int total;
 
-  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+  char *error;
+} sqlite3_native_backup_t;
 
-  sqlite3_native_vfs_t *vfs = file->vfs;
+typedef struct {
+  int type;
 
-  sqlite3_native_read_t data = {
-    file,
-    buf,
-    len,
-    offset
-  };
+  int64_t integer;
+  double real;
 
-  err = js_call_threadsafe_function(vfs->on_read, (void *) &data, js_threadsafe_function_blocking);
-  assert(err == 0);
+  // Text either points into the input or, when it had to be unescaped, at
+  // `offset` within the scratch buffer.
+  const uint8_t *data;
+  size_t offset;
+  size_t len;
 
-  uv_sem_wait(&vfs->done);
+  const uint8_t *key;
+  size_t key_offset;
+  size_t key_len;
+} sqlite3_native_import_field_t;
 
-  return SQLITE_OK;
-}
+typedef struct {
+  uv_work_t handle;
 
-static js_value_t *
-sqlite3_native__on_vfs_write_done(js_env_t *env, js_callback_info_t *info) {
-  int err;
+  sqlite3_native_t *db;
 
-  sqlite3_native_write_t *data;
+  js_deferred_t *deferred;
+  js_ref_t *buffer;
 
-  size_t argc = 1;
-  js_value_t *argv[1];
+  int format;
+  int batch;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
-  assert(err == 0);
+  char *table;
+  char *sql;
 
-  assert(argc == 1);
+  char **columns;
+  size_t *columns_lens;
+  int columns_len;
 
-  uv_sem_post(&data->file->vfs->done);
+  sqlite3_native_import_field_t *fields;
+  int fields_len;
+  int fields_capacity;
 
-  return NULL;
-}
+  uint8_t *scratch;
+  size_t scratch_len;
+  size_t scratch_capacity;
 
-static void
-sqlite3_native__on_vfs_write_call(js_env_t *env, js_value_t *on_write, void *context, void *arg) {
-  int err;
+  bool header;
+  bool began;
+  bool done;
+  int64_t pending;
+  int64_t records;
 
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+  const uint8_t *data;
+  size_t len;
+  bool final;
+  bool abort;
 
-  sqlite3_native_write_t *data = (sqlite3_native_write_t *) arg;
+  size_t consumed;
+  int64_t rows;
 
-  js_value_t *ctx;
-  err = js_get_reference_value(env, vfs->ctx, &ctx);
-  assert(err == 0);
+  char *error;
+} sqlite3_native_import_t;
 
-  js_value_t *args[4];
+typedef struct sqlite3_native_pcache_s sqlite3_native_pcache_t;
+typedef struct sqlite3_native_pcache_page_s sqlite3_native_pcache_page_t;
 
-  err = js_create_uint32(env, data->file->type, &args[0]);
-  assert(err == 0);
+struct sqlite3_native_pcache_page_s {
+  sqlite3_pcache_page handle;
 
-  err = js_create_external_arraybuffer(env, (void *) data->buf, data->len, NULL, NULL, &args[1]);
-  assert(err == 0);
+  unsigned int key;
+  bool pinned;
 
-  err = js_create_int64(env, data->offset, &args[2]);
-  assert(err == 0);
+  sqlite3_native_pcache_t *cache;
 
-  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_write_done, (void *) data, &args[3]);
-  assert(err == 0);
+  sqlite3_native_pcache_page_t *next;
 
-  err = js_call_function(env, ctx, on_write, 4, args, NULL);
-  assert(err == 0);
-}
+  sqlite3_native_pcache_page_t *lru_prev;
+  sqlite3_native_pcache_page_t *lru_next;
+};
 
-static int
-sqlite3_native__on_vfs_write(sqlite3_file *handle, const void *buf, int len, sqlite_int64 offset) {
-  int err;
+struct sqlite3_native_pcache_s {
+  int page_size;
+  int extra_size;
+  bool purgeable;
 
-  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+  unsigned int len;
 
-  sqlite3_native_vfs_t *vfs = file->vfs;
+  unsigned int buckets_len;
+  sqlite3_native_pcache_page_t **buckets;
+};
 
-  sqlite3_native_write_t data = {
-    file,
-    buf,
-    len,
-    offset
-  };
+static struct {
+  bool installed;
 
-  err = js_call_threadsafe_function(vfs->on_write, (void *) &data, js_threadsafe_function_blocking);
-  assert(err == 0);
+  uv_mutex_t lock;
 
-  uv_sem_wait(&vfs->done);
+  size_t budget;
+  size_t used;
 
-  return SQLITE_OK;
-}
+  uint64_t pages;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
 
-static int
-sqlite3_native__on_vfs_truncate(sqlite3_file *handle, sqlite_int64 size) {
-  return SQLITE_OK;
+  sqlite3_native_pcache_page_t lru;
+} sqlite3_native__pcache;
+
+static const size_t sqlite3_native__queue_limit = 64;
+
+static bool
+sqlite3_native__ends_with(const char *string, const char *suffix) {
+  size_t string_len = strlen(string);
+  size_t suffix_len = strlen(suffix);
+
+  if (suffix_len > string_len) return false;
+
+  return strncmp(string + string_len - suffix_len, suffix, suffix_len) == 0;
 }
 
 static int
-sqlite3_native__on_vfs_sync(sqlite3_file *handle, int flags) {
-  return SQLITE_OK;
+sqlite3_native__get_file_type(int flags) {
+  if (flags & SQLITE_OPEN_MAIN_DB) return 0;
+  if (flags & SQLITE_OPEN_MAIN_JOURNAL) return 1;
+  if (flags & SQLITE_OPEN_WAL) return 2;
+
+  return -1;
 }
 
-static js_value_t *
-sqlite3_native__on_vfs_size_done(js_env_t *env, js_callback_info_t *info) {
-  int err;
+static int
+sqlite3_native__get_file_type_from_name(const char *name) {
+  if (sqlite3_native__ends_with(name, "-journal")) return 1;
+  if (sqlite3_native__ends_with(name, "-wal")) return 2;
 
-  sqlite3_native_size_t *data;
+  return 0;
+}
 
-  size_t argc = 2;
-  js_value_t *argv[2];
+static void
+sqlite3_native__changes_reserve(sqlite3_native_changes_t *changes, size_t len) {
+  if (len <= changes->len) return;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
-  assert(err == 0);
+  size_t capacity = changes->len ? changes->len : 64;
 
-  assert(argc == 2);
+  while (capacity < len) capacity *= 2;
 
-  err = js_get_value_int64(env, argv[1], &data->size);
-  assert(err == 0);
+  changes->versions = realloc(changes->versions, capacity * sizeof(uint32_t));
+  changes->dirty = realloc(changes->dirty, capacity / 8);
 
-  uv_sem_post(&data->file->vfs->done);
+  memset(&changes->versions[changes->len], 0, (capacity - changes->len) * sizeof(uint32_t));
+  memset(&changes->dirty[changes->len / 8], 0, (capacity - changes->len) / 8);
 
-  return NULL;
+  changes->len = capacity;
 }
 
+// Record the pages touched by a write to the main database. The page size is
+// inferred from the writes themselves as SQLite always writes whole pages.
 static void
-sqlite3_native__on_vfs_size_call(js_env_t *env, js_value_t *on_size, void *context, void *arg) {
-  int err;
-
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+sqlite3_native__changes_write(sqlite3_native_changes_t *changes, int len, int64_t offset) {
+  if (len <= 0) return;
 
-  sqlite3_native_size_t *data = (sqlite3_native_size_t *) arg;
+  uv_mutex_lock(&changes->lock);
 
-  js_value_t *ctx;
-  err = js_get_reference_value(env, vfs->ctx, &ctx);
-  assert(err == 0);
+  if (len >= 512 && (len & (len - 1)) == 0 && offset % len == 0 && len != changes->page_size) {
+    if (changes->page_size) {
+      changes->pending = true;
 
-  js_value_t *args[2];
+      for (size_t i = 0; i < changes->len; i++) changes->versions[i] = changes->version + 1;
+    }
 
-  err = js_create_uint32(env, data->file->type, &args[0]);
-  assert(err == 0);
+    changes->page_size = len;
+  }
 
-  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_size_done, (void *) data, &args[1]);
-  assert(err == 0);
+  if (changes->page_size) {
+    size_t start = offset / changes->page_size;
+    size_t end = (offset + len - 1) / changes->page_size + 1;
 
-  err = js_call_function(env, ctx, on_size, 2, args, NULL);
-  assert(err == 0);
-}
+    sqlite3_native__changes_reserve(changes, end);
 
-static int
-sqlite3_native__on_vfs_size(sqlite3_file *handle, sqlite_int64 *size) {
-  int err;
+    for (size_t i = start; i < end; i++) changes->dirty[i / 8] |= 1 << (i % 8);
 
-  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+    changes->pending = true;
+  }
 
-  sqlite3_native_vfs_t *vfs = file->vfs;
+  uv_mutex_unlock(&changes->lock);
+}
 
-  sqlite3_native_size_t data = {
-    file,
-  };
+// Fold the pages written since the last commit into the committed versions.
+static void
+sqlite3_native__changes_commit(sqlite3_native_changes_t *changes) {
+  uv_mutex_lock(&changes->lock);
 
-  err = js_call_threadsafe_function(vfs->on_size, (void *) &data, js_threadsafe_function_blocking);
-  assert(err == 0);
+  if (changes->pending) {
+    changes->version++;
+    changes->pending = false;
 
-  uv_sem_wait(&vfs->done);
+    for (size_t i = 0; i < changes->len; i++) {
+      if (changes->dirty[i / 8] & (1 << (i % 8))) changes->versions[i] = changes->version;
+    }
 
-  *size = data.size;
+    memset(changes->dirty, 0, changes->len / 8);
+  }
 
-  return SQLITE_OK;
+  uv_mutex_unlock(&changes->lock);
 }
 
-static int
-sqlite3_native__on_vfs_lock(sqlite3_file *handle, int eLock) {
-  return SQLITE_OK;
-}
+// Forget the pages past the end of a truncated main database.
+static void
+sqlite3_native__changes_truncate(sqlite3_native_changes_t *changes, int64_t size) {
+  uv_mutex_lock(&changes->lock);
 
-static int
-sqlite3_native__on_vfs_unlock(sqlite3_file *sql_file, int eLock) {
-  return SQLITE_OK;
-}
+  if (changes->page_size) {
+    size_t len = (size + changes->page_size - 1) / changes->page_size;
 
-static int
-sqlite3_native__on_vfs_check_reserved_lock(sqlite3_file *sql_file, int *pResOut) {
-  *pResOut = 0;
-  return SQLITE_OK;
-}
+    for (size_t i = len; i < changes->len; i++) {
+      changes->versions[i] = 0;
+      changes->dirty[i / 8] &= ~(1 << (i % 8));
+    }
+  }
 
-static int
-sqlite3_native__on_vfs_control(sqlite3_file *sql_file, int op, void *pArg) {
-  return SQLITE_OK;
+  uv_mutex_unlock(&changes->lock);
 }
 
-static int
-sqlite3_native__on_vfs_sector_size(sqlite3_file *sql_file) {
-  return 0;
+static inline uint32_t
+sqlite3_native__lz4_read_uint32(const uint8_t *data) {
+  uint32_t value;
+  memcpy(&value, data, 4);
+  return value;
 }
 
-static int
-sqlite3_native__on_vfs_device_characteristics(sqlite3_file *sql_file) {
-  return 0;
+// Write the remainder of a literal or match length that didn't fit in its
+// token, returning the new output position or -1 if out of space.
+static inline int
+sqlite3_native__lz4_write_length(uint8_t *dst, int i, int capacity, int len) {
+  for (; len >= 255; len -= 255) {
+    if (i >= capacity) return -1;
+    dst[i++] = 255;
+  }
+
+  if (i >= capacity) return -1;
+  dst[i++] = (uint8_t) len;
+
+  return i;
 }
 
+// Compress a block of at most 64 KiB in the LZ4 block format, returning the
+// compressed length or 0 if it doesn't fit in `capacity` bytes.
 static int
-sqlite3_native__on_vfs_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *handle, int flags, int *pflags) {
-  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+sqlite3_native__lz4_compress(const uint8_t *src, int len, uint8_t *dst, int capacity) {
+  uint16_t table[4096];
+  memset(table, 0, sizeof(table));
 
-  file->type = sqlite3_native__get_file_type(flags);
+  int i = 0, anchor = 0, j = 0;
 
-  file->vfs = (sqlite3_native_vfs_t *) vfs;
+  // The last match must start at least 12 bytes before the end of the block
+  // and the last 5 bytes are always literals.
+  int limit = len - 12;
 
-  static const sqlite3_io_methods methods = {
-    1, // Version
-    sqlite3_native__on_vfs_close,
-    sqlite3_native__on_vfs_read,
-    sqlite3_native__on_vfs_write,
-    sqlite3_native__on_vfs_truncate,
-    sqlite3_native__on_vfs_sync,
-    sqlite3_native__on_vfs_size,
-    sqlite3_native__on_vfs_lock,
-    sqlite3_native__on_vfs_unlock,
-    sqlite3_native__on_vfs_check_reserved_lock,
-    sqlite3_native__on_vfs_control,
-    sqlite3_native__on_vfs_sector_size,
-    sqlite3_native__on_vfs_device_characteristics
-  };
+  while (i < limit) {
+    uint32_t sequence = sqlite3_native__lz4_read_uint32(&src[i]);
+    uint32_t hash = (sequence * 2654435761U) >> 20;
 
-  file->handle.pMethods = &methods;
+    int match = table[hash];
 
-  return SQLITE_OK;
-}
+    table[hash] = (uint16_t) i;
 
-static js_value_t *
-sqlite3_native__on_vfs_delete_done(js_env_t *env, js_callback_info_t *info) {
-  int err;
+    if (match >= i || sqlite3_native__lz4_read_uint32(&src[match]) != sequence) {
+      // Skip ahead faster the longer we go without finding a match.
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
 
-  sqlite3_native_delete_t *data;
+    while (i > anchor && match > 0 && src[i - 1] == src[match - 1]) {
+      i--;
+      match--;
+    }
 
-  size_t argc = 1;
-  js_value_t *argv[1];
+    int n = 4;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
-  assert(err == 0);
+    while (i + n < len - 5 && src[i + n] == src[match + n]) n++;
 
-  assert(argc == 1);
+    int literals = i - anchor;
 
-  uv_sem_post(&data->vfs->done);
+    if (j >= capacity) return 0;
 
-  return NULL;
-}
+    int token = j++;
 
-static void
-sqlite3_native__on_vfs_delete_call(js_env_t *env, js_value_t *on_delete, void *context, void *arg) {
-  int err;
+    dst[token] = (literals >= 15 ? 15 : literals) << 4;
 
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+    if (literals >= 15) {
+      j = sqlite3_native__lz4_write_length(dst, j, capacity, literals - 15);
+      if (j < 0) return 0;
+    }
 
-  sqlite3_native_delete_t *data = (sqlite3_native_delete_t *) arg;
+    if (j + literals + 2 > capacity) return 0;
 
-  js_value_t *ctx;
-  err = js_get_reference_value(env, vfs->ctx, &ctx);
-  assert(err == 0);
+    memcpy(&dst[j], &src[anchor], literals);
+    j += literals;
 
-  int type = sqlite3_native__get_file_type_from_name(data->name);
+    dst[j++] = (uint8_t) (i - match);
+    dst[j++] = (uint8_t) ((i - match) >> 8);
 
-  js_value_t *args[2];
+    dst[token] |= n - 4 >= 15 ? 15 : n - 4;
 
-  err = js_create_uint32(env, type, &args[0]);
-  assert(err == 0);
+    if (n - 4 >= 15) {
+      j = sqlite3_native__lz4_write_length(dst, j, capacity, n - 4 - 15);
+      if (j < 0) return 0;
+    }
 
-  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_delete_done, (void *) data, &args[1]);
-  assert(err == 0);
+    i += n;
+    anchor = i;
+  }
 
-  err = js_call_function(env, ctx, on_delete, 2, args, NULL);
-  assert(err == 0);
-}
+  int literals = len - anchor;
 
-static int
-sqlite3_native__on_vfs_delete(sqlite3_vfs *handle, const char *name, int sync) {
-  int err;
+  if (j >= capacity) return 0;
 
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) handle;
+  dst[j++] = (literals >= 15 ? 15 : literals) << 4;
 
-  sqlite3_native_delete_t data = {
-    vfs,
-    name,
-    sync
-  };
+  if (literals >= 15) {
+    j = sqlite3_native__lz4_write_length(dst, j, capacity, literals - 15);
+    if (j < 0) return 0;
+  }
 
-  err = js_call_threadsafe_function(vfs->on_delete, (void *) &data, js_threadsafe_function_blocking);
-  assert(err == 0);
+  if (j + literals > capacity) return 0;
 
-  uv_sem_wait(&vfs->done);
+  memcpy(&dst[j], &src[anchor], literals);
+  j += literals;
 
-  return SQLITE_OK;
+  return j;
 }
 
-static js_value_t *
-sqlite3_native__on_vfs_access_done(js_env_t *env, js_callback_info_t *info) {
-  int err;
+// Decompress a block in the LZ4 block format, returning the decompressed
+// length or -1 if the block is malformed or doesn't fit in `capacity` bytes.
+static int
+sqlite3_native__lz4_decompress(const uint8_t *src, int len, uint8_t *dst, int capacity) {
+  int i = 0, j = 0;
 
-  sqlite3_native_access_t *data;
+  while (i < len) {
+    uint8_t token = src[i++];
 
-  size_t argc = 2;
-  js_value_t *argv[2];
+    int literals = token >> 4;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
-  assert(err == 0);
+    if (literals == 15) {
+      uint8_t next;
 
-  assert(argc == 2);
+      do {
+        if (i >= len) return -1;
+        next = src[i++];
+        literals += next;
+      } while (next == 255);
+    }
 
-  err = js_get_value_bool(env, argv[1], &data->exists);
-  assert(err == 0);
+    if (literals > len - i || literals > capacity - j) return -1;
 
-  uv_sem_post(&data->vfs->done);
+    memcpy(&dst[j], &src[i], literals);
+    i += literals;
+    j += literals;
 
-  return NULL;
-}
+    // The last sequence only holds literals.
+    if (i == len) break;
 
-static void
-sqlite3_native__on_vfs_access_call(js_env_t *env, js_value_t *on_access, void *context, void *arg) {
-  int err;
+    if (len - i < 2) return -1;
 
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+    int offset = src[i] | (src[i + 1] << 8);
+    i += 2;
 
-  sqlite3_native_access_t *data = (sqlite3_native_access_t *) arg;
+    if (offset == 0 || offset > j) return -1;
 
-  js_value_t *ctx;
-  err = js_get_reference_value(env, vfs->ctx, &ctx);
-  assert(err == 0);
+    int n = token & 15;
 
-  int type = sqlite3_native__get_file_type_from_name(data->name);
+    if (n == 15) {
+      uint8_t next;
 
-  js_value_t *args[2];
+      do {
+        if (i >= len) return -1;
+        next = src[i++];
+        n += next;
+      } while (next == 255);
+    }
 
-  err = js_create_uint32(env, type, &args[0]);
-  assert(err == 0);
+    n += 4;
 
-  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_access_done, (void *) data, &args[1]);
-  assert(err == 0);
+    if (n > capacity - j) return -1;
 
-  err = js_call_function(env, ctx, on_access, 2, args, NULL);
-  assert(err == 0);
+    // Matches may overlap the bytes they produce, so copy byte by byte.
+    for (int k = 0; k < n; k++, j++) dst[j] = dst[j - offset];
+  }
+
+  return j;
 }
 
-static int
-sqlite3_native__on_vfs_access(sqlite3_vfs *handle, const char *name, int flags, int *exists) {
-  int err;
+// Compressed pages are stored as a short write at the offset of the page,
+// starting with this magic followed by the compressed length. A raw page
+// starting with the same bytes would have to hold a page number past four
+// billion, which no database of a practical size has.
+static const uint8_t sqlite3_native__compressed_magic[4] = {0xff, 'L', 'Z', '4'};
 
-  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) handle;
+enum {
+  sqlite3_native_compressed_header = 8,
+};
 
-  sqlite3_native_access_t data = {
-    vfs,
-    name,
-    flags
-  };
+static void
+sqlite3_native__compression_reserve(sqlite3_native_compression_t *compression, size_t len) {
+  if (len <= compression->len) return;
 
-  err = js_call_threadsafe_function(vfs->on_access, (void *) &data, js_threadsafe_function_blocking);
-  assert(err == 0);
+  size_t capacity = compression->len ? compression->len : 64;
 
-  uv_sem_wait(&vfs->done);
+  while (capacity < len) capacity *= 2;
 
-  *exists = data.exists;
+  compression->pages = realloc(compression->pages, capacity * sizeof(uint32_t));
 
-  return SQLITE_OK;
+  memset(&compression->pages[compression->len], 0, (capacity - compression->len) * sizeof(uint32_t));
+
+  compression->len = capacity;
 }
 
-static int
-sqlite3_native__on_vfs_fullpathname(sqlite3_vfs *vfs, const char *name, int len, char *out) {
-  if (strlen(name) >= len) return SQLITE_ERROR;
+// Record the stored size of a page, keeping the totals up to date. Must be
+// called with the lock held.
+static void
+sqlite3_native__compression_update(sqlite3_native_compression_t *compression, size_t page, uint32_t stored) {
+  sqlite3_native__compression_reserve(compression, page + 1);
 
-  strcpy(out, name);
+  uint32_t previous = compression->pages[page];
 
-  return SQLITE_OK;
-}
+  if (previous) {
+    compression->known--;
+    compression->stored -= previous;
 
-static void *
-sqlite3_native__on_vfs_dlopen(sqlite3_vfs *vfs, const char *zPath) {
-  return 0;
+    if (previous < (uint32_t) compression->page_size) compression->compressed--;
+  }
+
+  compression->pages[page] = stored;
+
+  if (stored) {
+    compression->known++;
+    compression->stored += stored;
+
+    if (stored < (uint32_t) compression->page_size) compression->compressed++;
+  }
 }
 
 static void
-sqlite3_native__on_vfs_dlerror(sqlite3_vfs *vfs, int nByte, char *zErrMsg) {
-  zErrMsg[nByte - 1] = '\0';
+sqlite3_native__compression_set(sqlite3_native_compression_t *compression, int64_t page, uint32_t stored) {
+  uv_mutex_lock(&compression->lock);
+
+  sqlite3_native__compression_update(compression, page, stored);
+
+  uv_mutex_unlock(&compression->lock);
 }
 
-static void (*(sqlite3_native__on_vfs_dlsym) (sqlite3_vfs *vfs, void *pH, const char *z))(void) {
-  return 0;
+static uint32_t
+sqlite3_native__compression_get(sqlite3_native_compression_t *compression, int64_t page) {
+  uv_mutex_lock(&compression->lock);
+
+  uint32_t stored = (size_t) page < compression->len ? compression->pages[page] : 0;
+
+  uv_mutex_unlock(&compression->lock);
+
+  return stored;
 }
 
+// Must be called with the lock held.
 static void
-sqlite3_native__on_vfs_dlclose(sqlite3_vfs *vfs, void *pHandle) {
-  return;
+sqlite3_native__compression_clear(sqlite3_native_compression_t *compression) {
+  if (compression->len) memset(compression->pages, 0, compression->len * sizeof(uint32_t));
+
+  compression->known = 0;
+  compression->compressed = 0;
+  compression->stored = 0;
 }
 
-static int
-sqlite3_native__on_vfs_randomness(sqlite3_vfs *vfs, int bytes, char *buf) {
-  memset(buf, 0, bytes);
+// Learn the page size of the main database from its header, which is always
+// stored as is on the first page.
+static void
+sqlite3_native__compression_header(sqlite3_native_compression_t *compression, const uint8_t *data, int len) {
+  if (len < 18 || memcmp(data, "SQLite format 3", 16) != 0) return;
 
-  return SQLITE_OK;
+  int page_size = (data[16] << 8) | data[17];
+
+  if (page_size == 1) page_size = 65536;
+
+  if (page_size < 512 || (page_size & (page_size - 1)) != 0) return;
+
+  uv_mutex_lock(&compression->lock);
+
+  if (page_size != compression->page_size) {
+    compression->page_size = page_size;
+
+    sqlite3_native__compression_clear(compression);
+  }
+
+  uv_mutex_unlock(&compression->lock);
 }
 
-static int
-sqlite3_native__on_vfs_sleep(sqlite3_vfs *vfs, int nMicro) {
-  return 0;
+// Get the page covered by a read or write of the main database if it may be
+// stored compressed, or -1 if it isn't a whole page past the first.
+static int64_t
+sqlite3_native__compression_page(sqlite3_native_file_t *file, int len, int64_t offset) {
+  sqlite3_native_compression_t *compression = &file->vfs->compression;
+
+  if (!compression->enabled || file->type != 0 || offset == 0) return -1;
+
+  uv_mutex_lock(&compression->lock);
+
+  int page_size = compression->page_size;
+
+  uv_mutex_unlock(&compression->lock);
+
+  if (page_size == 0 || len != page_size || offset % page_size != 0) return -1;
+
+  return offset / page_size;
+}
+
+// Forget the pages past the end of a truncated main database.
+static void
+sqlite3_native__compression_truncate(sqlite3_native_compression_t *compression, int64_t size) {
+  uv_mutex_lock(&compression->lock);
+
+  if (compression->page_size) {
+    size_t len = (size + compression->page_size - 1) / compression->page_size;
+
+    for (size_t i = len; i < compression->len; i++) {
+      if (compression->pages[i]) sqlite3_native__compression_update(compression, i, 0);
+    }
+  }
+
+  uv_mutex_unlock(&compression->lock);
+}
+
+static uint8_t *
+sqlite3_native__compression_scratch(sqlite3_native_file_t *file, size_t len) {
+  if (len > file->scratch_len) {
+    free(file->scratch);
+
+    file->scratch = malloc(len);
+    file->scratch_len = len;
+  }
+
+  return file->scratch;
+}
+
+// Decompress a page stored compressed, returning its stored size or 0 if it
+// was stored as is.
+static uint32_t
+sqlite3_native__compression_decode(const uint8_t *data, int read, void *buf, int len) {
+  if (read < sqlite3_native_compressed_header) return 0;
+
+  if (memcmp(data, sqlite3_native__compressed_magic, 4) != 0) return 0;
+
+  uint32_t stored = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t) data[7] << 24);
+
+  if (stored > (uint32_t) (read - sqlite3_native_compressed_header)) return 0;
+
+  if (sqlite3_native__lz4_decompress(&data[sqlite3_native_compressed_header], (int) stored, buf, len) != len) return 0;
+
+  return sqlite3_native_compressed_header + stored;
+}
+
+static void
+sqlite3_native__unlock(sqlite3_native_file_t *file, int lock) {
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  if (file->lock <= lock) return;
+
+  uv_mutex_lock(&vfs->lock);
+
+  if (file->lock >= SQLITE_LOCK_RESERVED) {
+    vfs->locks.reserved = false;
+    vfs->locks.pending = false;
+  }
+
+  if (lock == SQLITE_LOCK_NONE) vfs->locks.shared--;
+
+  file->lock = lock;
+
+  uv_mutex_unlock(&vfs->lock);
 }
 
 static int
-sqlite3_native__on_vfs_current_time(sqlite3_vfs *vfs, double *time) {
-  int err;
+sqlite3_native__on_vfs_close(sqlite3_file *handle) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
 
-  uv_timespec64_t ts;
-  err = uv_clock_gettime(UV_CLOCK_REALTIME, &ts);
-  assert(err == 0);
+  sqlite3_native__unlock(file, SQLITE_LOCK_NONE);
 
-  *time = ts.tv_sec / 86400.0 + 2440587.5;
+  free(file->ahead.data);
+  free(file->scratch);
+  free(file->preload.data);
+
+  file->ahead.data = NULL;
+  file->scratch = NULL;
+  file->preload.data = NULL;
 
   return SQLITE_OK;
 }
 
-static js_value_t *
-sqlite3_native_vfs_init(js_env_t *env, js_callback_info_t *info) {
+// Queue a request for JavaScript and wait for it to complete. Only the request
+// that finds the queue idle wakes up the event loop; the rest are picked up by
+// the same dispatch.
+static void
+sqlite3_native__vfs_submit(sqlite3_native_vfs_t *vfs, sqlite3_native_request_t *req, int op, void *data) {
   int err;
 
-  size_t argc = 6;
-  js_value_t *argv[6];
+  req->op = op;
+  req->data = data;
+  req->next = NULL;
 
-  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  err = uv_sem_init(&req->done, 0);
   assert(err == 0);
 
-  assert(argc == 6);
+  uv_mutex_lock(&vfs->lock);
 
-  uv_loop_t *loop;
-  err = js_get_env_loop(env, &loop);
-  assert(err == 0);
+  if (vfs->queue.tail) vfs->queue.tail->next = req;
+  else vfs->queue.head = req;
 
-  js_value_t *handle;
+  vfs->queue.tail = req;
 
-  sqlite3_native_vfs_t *vfs;
-  err = js_create_arraybuffer(env, sizeof(sqlite3_native_vfs_t), (void **) &vfs, &handle);
-  assert(err == 0);
+  bool schedule = !vfs->queue.scheduled;
 
-  err = uv_sem_init(&vfs->done, 0);
-  assert(err == 0);
+  vfs->queue.scheduled = true;
 
-  uv_random_t req;
-  err = uv_random(loop, &req, vfs->name, sizeof(vfs->name), 0, NULL);
-  assert(err == 0);
+  uv_mutex_unlock(&vfs->lock);
 
-  vfs->name[sizeof(vfs->name) - 1] = '\0';
+  if (schedule) {
+    err = js_call_threadsafe_function(vfs->dispatcher->function, (void *) vfs, js_threadsafe_function_blocking);
+    assert(err == 0);
+  }
 
-  vfs->env = env;
+  uv_sem_wait(&req->done);
 
-  err = js_create_reference(env, argv[0], 1, &vfs->ctx);
-  assert(err == 0);
+  uv_sem_destroy(&req->done);
+}
 
-  err = js_create_threadsafe_function(env, argv[1], sqlite3_native__queue_limit, 1, NULL, NULL, (void *) vfs, sqlite3_native__on_vfs_access_call, &vfs->on_access);
-  assert(err == 0);
+static js_value_t *
+sqlite3_native__on_vfs_read_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
 
-  err = js_create_threadsafe_function(env, argv[2], sqlite3_native__queue_limit, 1, NULL, NULL, (void *) vfs, sqlite3_native__on_vfs_size_call, &vfs->on_size);
-  assert(err == 0);
+  sqlite3_native_read_t *data;
 
-  err = js_create_threadsafe_function(env, argv[3], sqlite3_native__queue_limit, 1, NULL, NULL, (void *) vfs, sqlite3_native__on_vfs_read_call, &vfs->on_read);
-  assert(err == 0);
+  size_t argc = 2;
+  js_value_t *argv[2];
 
-  err = js_create_threadsafe_function(env, argv[4], sqlite3_native__queue_limit, 1, NULL, NULL, (void *) vfs, sqlite3_native__on_vfs_write_call, &vfs->on_write);
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
   assert(err == 0);
 
-  err = js_create_threadsafe_function(env, argv[5], sqlite3_native__queue_limit, 1, NULL, NULL, (void *) vfs, sqlite3_native__on_vfs_delete_call, &vfs->on_delete);
-  assert(err == 0);
+  assert(argc >= 1);
 
-  vfs->handle = (sqlite3_vfs) {
-    1, // Version
-    sizeof(sqlite3_native_file_t),
-    sizeof(sqlite3_native_path_t),
-    NULL,
-    vfs->name,
-    NULL,
-    sqlite3_native__on_vfs_open,
-    sqlite3_native__on_vfs_delete,
-    sqlite3_native__on_vfs_access,
-    sqlite3_native__on_vfs_fullpathname,
-    sqlite3_native__on_vfs_dlopen,
-    sqlite3_native__on_vfs_dlerror,
-    sqlite3_native__on_vfs_dlsym,
-    sqlite3_native__on_vfs_dlclose,
-    sqlite3_native__on_vfs_randomness,
-    sqlite3_native__on_vfs_sleep,
-    sqlite3_native__on_vfs_current_time,
-  };
+  data->read = data->len;
 
-  err = sqlite3_vfs_register(&vfs->handle, false);
-  assert(err == 0);
+  if (argc == 2) {
+    js_value_type_t type;
+    err = js_typeof(env, argv[1], &type);
+    assert(err == 0);
 
-  return handle;
+    if (type == js_number) {
+      err = js_get_value_int32(env, argv[1], &data->read);
+      assert(err == 0);
+
+      if (data->read < 0) data->read = 0;
+      if (data->read > data->len) data->read = data->len;
+    }
+  }
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
 }
 
-static js_value_t *
-sqlite3_native_vfs_destroy(js_env_t *env, js_callback_info_t *info) {
+static void
+sqlite3_native__on_vfs_read_call(js_env_t *env, js_value_t *on_read, void *context, void *arg) {
   int err;
 
-  size_t argc = 1;
-  js_value_t *argv[1];
-
-  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
-  assert(err == 0);
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
 
-  assert(argc == 1);
+  sqlite3_native_read_t *data = (sqlite3_native_read_t *) arg;
 
-  sqlite3_native_vfs_t *vfs;
-  err = js_get_arraybuffer_info(env, argv[0], (void **) &vfs, NULL);
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
   assert(err == 0);
 
-  uv_sem_destroy(&vfs->done);
+  js_value_t *args[4];
 
-  err = sqlite3_vfs_unregister(&vfs->handle);
+  err = js_create_uint32(env, data->file->type, &args[0]);
   assert(err == 0);
 
-  err = js_release_threadsafe_function(vfs->on_access, js_threadsafe_function_release);
+  err = js_create_external_arraybuffer(env, data->buf, data->len, NULL, NULL, &args[1]);
   assert(err == 0);
 
-  err = js_release_threadsafe_function(vfs->on_size, js_threadsafe_function_release);
+  err = js_create_int64(env, data->offset, &args[2]);
   assert(err == 0);
 
-  err = js_release_threadsafe_function(vfs->on_read, js_threadsafe_function_release);
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_read_done, (void *) data, &args[3]);
   assert(err == 0);
 
-  err = js_release_threadsafe_function(vfs->on_write, js_threadsafe_function_release);
+  err = js_call_function(env, ctx, on_read, 4, args, NULL);
   assert(err == 0);
+}
 
-  err = js_release_threadsafe_function(vfs->on_delete, js_threadsafe_function_release);
-  assert(err == 0);
+static int
+sqlite3_native__read(sqlite3_native_file_t *file, void *buf, int len, int64_t offset) {
+  sqlite3_native_vfs_t *vfs = file->vfs;
 
-  err = js_delete_reference(env, vfs->ctx);
-  assert(err == 0);
+  sqlite3_native_read_t data = {
+    file,
+    buf,
+    len,
+    offset,
+    0
+  };
 
-  return NULL;
+  sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_read, &data);
+
+  return data.read;
+}
+
+static inline void
+sqlite3_native__read_ahead_reset(sqlite3_native_file_t *file) {
+  file->ahead.len = 0;
+  file->sequential = 0;
+}
+
+static inline void
+sqlite3_native__preload_reset(sqlite3_native_file_t *file) {
+  free(file->preload.data);
+
+  file->preload.data = NULL;
+  file->preload.len = 0;
+  file->preload.complete = false;
 }
 
 static void
-sqlite3_native__on_result_call(js_env_t *env, js_value_t *on_result, void *context, void *arg) {
-  int err;
+sqlite3_native__vfs_changed(sqlite3_native_vfs_t *vfs) {
+  uv_mutex_lock(&vfs->lock);
+  vfs->writes++;
+  uv_mutex_unlock(&vfs->lock);
+}
 
-  sqlite3_native_t *db = (sqlite3_native_t *) context;
+static int
+sqlite3_native__on_vfs_read(sqlite3_file *handle, void *buf, int len, sqlite3_int64 offset) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
 
-  sqlite3_native_exec_t *data = (sqlite3_native_exec_t *) arg;
+  sqlite3_native_compression_t *compression = &file->vfs->compression;
 
-  js_value_t *result;
-  err = js_get_reference_value(env, data->result, &result);
-  assert(err == 0);
+  int read_ahead = file->vfs->read_ahead;
 
-  js_value_t *rows;
-  err = js_create_array_with_length(env, data->len, &rows);
-  assert(err == 0);
+  int64_t page = sqlite3_native__compression_page(file, len, offset);
 
-  js_value_t *columns;
-  err = js_create_array_with_length(env, data->len, &columns);
-  assert(err == 0);
+  if (offset == file->last) file->sequential++;
+  else file->sequential = 0;
 
-  for (int i = 0, n = data->len; i < n; i++) {
-    js_value_t *row;
+  file->last = offset + len;
 
-    if (data->rows[i] == NULL) {
-      err = js_get_null(env, &row);
-      assert(err == 0);
-    } else {
-      err = js_create_string_utf8(env, (const utf8_t *) data->rows[i], -1, &row);
-      assert(err == 0);
+  int read;
+
+  if (file->preload.data && (offset + len <= (int64_t) file->preload.len || file->preload.complete)) {
+    int64_t available = (int64_t) file->preload.len - offset;
+
+    read = available <= 0 ? 0 : available < len ? (int) available : len;
+
+    if (read > 0) memcpy(buf, &file->preload.data[offset], read);
+  }
+
+  else if (offset >= file->ahead.offset && offset + len <= file->ahead.offset + (int64_t) file->ahead.len) {
+    memcpy(buf, (char *) file->ahead.data + (offset - file->ahead.offset), len);
+
+    read = len;
+  }
+
+  // After a few reads in ascending order, fetch the following pages in a
+  // single request and serve the next reads from memory.
+  else if (read_ahead > 1 && file->sequential >= 2) {
+    size_t size = (size_t) len * read_ahead;
+
+    if (size > file->ahead.capacity) {
+      free(file->ahead.data);
+
+      file->ahead.data = malloc(size);
+      file->ahead.capacity = size;
     }
 
-    err = js_set_element(env, rows, i, row);
-    assert(err == 0);
+    read = sqlite3_native__read(file, file->ahead.data, (int) size, offset);
 
-    js_value_t *col;
-    err = js_create_string_utf8(env, (const utf8_t *) data->columns[i], -1, &col);
-    assert(err == 0);
+    file->ahead.offset = offset;
+    file->ahead.len = read;
 
-    err = js_set_element(env, columns, i, col);
-    assert(err == 0);
+    if (read > len) read = len;
+
+    memcpy(buf, file->ahead.data, read);
   }
 
-  js_value_t *entry;
-  err = js_create_object(env, &entry);
-  assert(err == 0);
+  else {
+    uint32_t stored = page > 0 ? sqlite3_native__compression_get(compression, page) : 0;
 
-  err = js_set_named_property(env, entry, "rows", rows);
-  assert(err == 0);
+    // Only fetch the stored bytes of pages known to be compressed, falling
+    // back to a full read if the page has since changed.
+    if (stored > 0 && stored < (uint32_t) len) {
+      uint8_t *scratch = sqlite3_native__compression_scratch(file, len);
 
-  err = js_set_named_property(env, entry, "columns", columns);
-  assert(err == 0);
+      read = sqlite3_native__read(file, scratch, (int) stored, offset);
 
-  err = js_set_element(env, result, data->i++, entry);
-  assert(err == 0);
+      if (sqlite3_native__compression_decode(scratch, read, buf, len) == stored) return SQLITE_OK;
+    }
 
-  uv_sem_post(&data->done);
+    read = sqlite3_native__read(file, buf, len, offset);
+  }
+
+  if (page > 0) {
+    if (read >= sqlite3_native_compressed_header && memcmp(buf, sqlite3_native__compressed_magic, 4) == 0) {
+      uint8_t *scratch = sqlite3_native__compression_scratch(file, len);
+
+      memcpy(scratch, buf, read);
+
+      uint32_t stored = sqlite3_native__compression_decode(scratch, read, buf, len);
+
+      if (stored) {
+        sqlite3_native__compression_set(compression, page, stored);
+
+        return SQLITE_OK;
+      }
+
+      memcpy(buf, scratch, read);
+    } else if (read == len) {
+      sqlite3_native__compression_set(compression, page, len);
+    }
+  } else if (compression->enabled && file->type == 0 && offset == 0) {
+    sqlite3_native__compression_header(compression, buf, read);
+  }
+
+  if (read < len) {
+    // SQLite expects the unread remainder of the buffer to be zeroed.
+    memset((char *) buf + read, 0, len - read);
+
+    return SQLITE_IOERR_SHORT_READ;
+  }
+
+  return SQLITE_OK;
+}
+
+static js_value_t *
+sqlite3_native__on_vfs_write_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  sqlite3_native_write_t *data;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
+}
+
+static void
+sqlite3_native__on_vfs_write_call(js_env_t *env, js_value_t *on_write, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+
+  sqlite3_native_write_t *data = (sqlite3_native_write_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
+  assert(err == 0);
+
+  js_value_t *args[4];
+
+  err = js_create_uint32(env, data->file->type, &args[0]);
+  assert(err == 0);
+
+  err = js_create_external_arraybuffer(env, (void *) data->buf, data->len, NULL, NULL, &args[1]);
+  assert(err == 0);
+
+  err = js_create_int64(env, data->offset, &args[2]);
+  assert(err == 0);
+
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_write_done, (void *) data, &args[3]);
+  assert(err == 0);
+
+  err = js_call_function(env, ctx, on_write, 4, args, NULL);
+  assert(err == 0);
+}
+
+static int
+sqlite3_native__on_vfs_write(sqlite3_file *handle, const void *buf, int len, sqlite_int64 offset) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  if (file->type == 0) {
+    sqlite3_native__changes_write(&vfs->changes, len, offset);
+
+    sqlite3_native__preload_reset(file);
+    sqlite3_native__vfs_changed(vfs);
+  }
+
+  if (offset < file->ahead.offset + (int64_t) file->ahead.len && offset + len > file->ahead.offset) {
+    sqlite3_native__read_ahead_reset(file);
+  }
+
+  sqlite3_native_compression_t *compression = &vfs->compression;
+
+  int64_t page = sqlite3_native__compression_page(file, len, offset);
+
+  if (page > 0) {
+    uint8_t *scratch = sqlite3_native__compression_scratch(file, len);
+
+    // Only store the page compressed if that saves space.
+    int stored = sqlite3_native__lz4_compress(buf, len, &scratch[sqlite3_native_compressed_header], len - sqlite3_native_compressed_header - 1);
+
+    if (stored > 0) {
+      memcpy(scratch, sqlite3_native__compressed_magic, 4);
+
+      scratch[4] = (uint8_t) stored;
+      scratch[5] = (uint8_t) (stored >> 8);
+      scratch[6] = (uint8_t) (stored >> 16);
+      scratch[7] = (uint8_t) (stored >> 24);
+
+      buf = scratch;
+      len = sqlite3_native_compressed_header + stored;
+    }
+
+    sqlite3_native__compression_set(compression, page, len);
+  } else if (compression->enabled && file->type == 0 && offset == 0) {
+    sqlite3_native__compression_header(compression, buf, len);
+  }
+
+  sqlite3_native_write_t data = {
+    file,
+    buf,
+    len,
+    offset
+  };
+
+  sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_write, &data);
+
+  return SQLITE_OK;
+}
+
+static js_value_t *
+sqlite3_native__on_vfs_truncate_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  sqlite3_native_truncate_t *data;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
+}
+
+static void
+sqlite3_native__on_vfs_truncate_call(js_env_t *env, js_value_t *on_truncate, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+
+  sqlite3_native_truncate_t *data = (sqlite3_native_truncate_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
+  assert(err == 0);
+
+  js_value_t *args[3];
+
+  err = js_create_uint32(env, data->file->type, &args[0]);
+  assert(err == 0);
+
+  err = js_create_int64(env, data->size, &args[1]);
+  assert(err == 0);
+
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_truncate_done, (void *) data, &args[2]);
+  assert(err == 0);
+
+  err = js_call_function(env, ctx, on_truncate, 3, args, NULL);
+  assert(err == 0);
+}
+
+static int
+sqlite3_native__on_vfs_truncate(sqlite3_file *handle, sqlite_int64 size) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  sqlite3_native__read_ahead_reset(file);
+
+  if (file->type == 0) {
+    sqlite3_native__changes_truncate(&vfs->changes, size);
+    sqlite3_native__compression_truncate(&vfs->compression, size);
+
+    sqlite3_native__preload_reset(file);
+    sqlite3_native__vfs_changed(vfs);
+  }
+
+  if (!vfs->truncate) return SQLITE_OK;
+
+  sqlite3_native_truncate_t data = {
+    file,
+    size
+  };
+
+  sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_truncate, &data);
+
+  return SQLITE_OK;
+}
+
+static js_value_t *
+sqlite3_native__on_vfs_sync_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  sqlite3_native_sync_t *data;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
+}
+
+static void
+sqlite3_native__on_vfs_sync_call(js_env_t *env, js_value_t *on_sync, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+
+  sqlite3_native_sync_t *data = (sqlite3_native_sync_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
+  assert(err == 0);
+
+  js_value_t *args[3];
+
+  err = js_create_uint32(env, data->file->type, &args[0]);
+  assert(err == 0);
+
+  err = js_create_int32(env, data->flags, &args[1]);
+  assert(err == 0);
+
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_sync_done, (void *) data, &args[2]);
+  assert(err == 0);
+
+  err = js_call_function(env, ctx, on_sync, 3, args, NULL);
+  assert(err == 0);
+}
+
+static int
+sqlite3_native__on_vfs_sync(sqlite3_file *handle, int flags) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  if (vfs->sync) {
+    sqlite3_native_sync_t data = {
+      file,
+      flags
+    };
+
+    sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_sync, &data);
+  }
+
+  if (file->type == 0) sqlite3_native__changes_commit(&vfs->changes);
+
+  return SQLITE_OK;
+}
+
+static js_value_t *
+sqlite3_native__on_vfs_size_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  sqlite3_native_size_t *data;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
+  assert(err == 0);
+
+  assert(argc == 2);
+
+  err = js_get_value_int64(env, argv[1], &data->size);
+  assert(err == 0);
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
+}
+
+static void
+sqlite3_native__on_vfs_size_call(js_env_t *env, js_value_t *on_size, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+
+  sqlite3_native_size_t *data = (sqlite3_native_size_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
+  assert(err == 0);
+
+  js_value_t *args[2];
+
+  err = js_create_uint32(env, data->file->type, &args[0]);
+  assert(err == 0);
+
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_size_done, (void *) data, &args[1]);
+  assert(err == 0);
+
+  err = js_call_function(env, ctx, on_size, 2, args, NULL);
+  assert(err == 0);
+}
+
+static int
+sqlite3_native__on_vfs_size(sqlite3_file *handle, sqlite_int64 *size) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  sqlite3_native_size_t data = {
+    file,
+  };
+
+  sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_size, &data);
+
+  *size = data.size;
+
+  sqlite3_native_compression_t *compression = &vfs->compression;
+
+  if (compression->enabled && file->type == 0 && data.size > 0) {
+    uv_mutex_lock(&compression->lock);
+
+    int page_size = compression->page_size;
+
+    uv_mutex_unlock(&compression->lock);
+
+    if (page_size == 0) {
+      uint8_t header[100];
+
+      int read = sqlite3_native__read(file, header, sizeof(header), 0);
+
+      sqlite3_native__compression_header(compression, header, read);
+
+      uv_mutex_lock(&compression->lock);
+
+      page_size = compression->page_size;
+
+      uv_mutex_unlock(&compression->lock);
+    }
+
+    // The last page may be stored compressed and so end before the page does.
+    if (page_size) *size = (data.size + page_size - 1) / page_size * page_size;
+  }
+
+  return SQLITE_OK;
+}
+
+// Read the first `limit` bytes of the main database, or all of it if `limit`
+// is negative, in a single request and serve reads from them until the file
+// changes.
+static void
+sqlite3_native__preload(sqlite3_native_file_t *file, int64_t limit) {
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  uv_mutex_lock(&vfs->lock);
+
+  uint64_t writes = vfs->writes;
+
+  uv_mutex_unlock(&vfs->lock);
+
+  bool complete = limit < 0;
+
+  if (limit < 0) {
+    sqlite3_native_size_t data = {
+      file,
+    };
+
+    sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_size, &data);
+
+    limit = data.size;
+  }
+
+  if (limit <= 0) return;
+
+  if (limit > INT32_MAX) {
+    limit = INT32_MAX;
+    complete = false;
+  }
+
+  uint8_t *data = malloc(limit);
+
+  int read = sqlite3_native__read(file, data, (int) limit, 0);
+
+  sqlite3_native__preload_reset(file);
+
+  file->preload.data = data;
+  file->preload.len = read;
+  file->preload.complete = complete || read < limit;
+  file->preload.writes = writes;
+}
+
+static int
+sqlite3_native__on_vfs_lock(sqlite3_file *handle, int eLock) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  if (file->lock >= eLock) return SQLITE_OK;
+
+  int status = SQLITE_OK;
+
+  bool stale = false;
+
+  uv_mutex_lock(&vfs->lock);
+
+  if (eLock == SQLITE_LOCK_SHARED) {
+    // A writer waiting for readers to finish doesn't let new ones in.
+    if (vfs->locks.pending) status = SQLITE_BUSY;
+    else {
+      vfs->locks.shared++;
+      file->lock = SQLITE_LOCK_SHARED;
+    }
+
+    stale = file->preload.data && file->preload.writes != vfs->writes;
+  } else {
+    if (file->lock < SQLITE_LOCK_RESERVED) {
+      if (vfs->locks.reserved) status = SQLITE_BUSY;
+      else {
+        vfs->locks.reserved = true;
+        file->lock = SQLITE_LOCK_RESERVED;
+      }
+    }
+
+    if (status == SQLITE_OK && eLock == SQLITE_LOCK_EXCLUSIVE) {
+      vfs->locks.pending = true;
+
+      if (vfs->locks.shared > 1) {
+        file->lock = SQLITE_LOCK_PENDING;
+        status = SQLITE_BUSY;
+      } else {
+        file->lock = SQLITE_LOCK_EXCLUSIVE;
+      }
+    }
+  }
+
+  uv_mutex_unlock(&vfs->lock);
+
+  // Another connection may have changed the file since it was last read.
+  if (status == SQLITE_OK && eLock == SQLITE_LOCK_SHARED) sqlite3_native__read_ahead_reset(file);
+
+  if (stale) sqlite3_native__preload_reset(file);
+
+  return status;
+}
+
+static int
+sqlite3_native__on_vfs_unlock(sqlite3_file *handle, int eLock) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native__unlock(file, eLock);
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vfs_check_reserved_lock(sqlite3_file *handle, int *pResOut) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  sqlite3_native_vfs_t *vfs = file->vfs;
+
+  uv_mutex_lock(&vfs->lock);
+
+  *pResOut = vfs->locks.reserved;
+
+  uv_mutex_unlock(&vfs->lock);
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vfs_control(sqlite3_file *sql_file, int op, void *pArg) {
+  // Let SQLite handle every file control itself, including pragmas, which
+  // would otherwise be considered handled and silently ignored.
+  return SQLITE_NOTFOUND;
+}
+
+static int
+sqlite3_native__on_vfs_sector_size(sqlite3_file *sql_file) {
+  return 0;
+}
+
+static int
+sqlite3_native__on_vfs_device_characteristics(sqlite3_file *sql_file) {
+  return 0;
+}
+
+static int
+sqlite3_native__on_vfs_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *handle, int flags, int *pflags) {
+  sqlite3_native_file_t *file = (sqlite3_native_file_t *) handle;
+
+  file->type = sqlite3_native__get_file_type(flags);
+  file->lock = SQLITE_LOCK_NONE;
+
+  file->vfs = (sqlite3_native_vfs_t *) vfs;
+
+  file->last = -1;
+  file->sequential = 0;
+  file->ahead.data = NULL;
+  file->ahead.capacity = 0;
+  file->ahead.len = 0;
+  file->ahead.offset = 0;
+  file->scratch = NULL;
+  file->scratch_len = 0;
+  file->preload.data = NULL;
+  file->preload.len = 0;
+  file->preload.complete = false;
+  file->preload.writes = 0;
+
+  static const sqlite3_io_methods methods = {
+    1, // Version
+    sqlite3_native__on_vfs_close,
+    sqlite3_native__on_vfs_read,
+    sqlite3_native__on_vfs_write,
+    sqlite3_native__on_vfs_truncate,
+    sqlite3_native__on_vfs_sync,
+    sqlite3_native__on_vfs_size,
+    sqlite3_native__on_vfs_lock,
+    sqlite3_native__on_vfs_unlock,
+    sqlite3_native__on_vfs_check_reserved_lock,
+    sqlite3_native__on_vfs_control,
+    sqlite3_native__on_vfs_sector_size,
+    sqlite3_native__on_vfs_device_characteristics
+  };
+
+  file->handle.pMethods = &methods;
+
+  return SQLITE_OK;
+}
+
+static js_value_t *
+sqlite3_native__on_vfs_delete_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  sqlite3_native_delete_t *data;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
+}
+
+static void
+sqlite3_native__on_vfs_delete_call(js_env_t *env, js_value_t *on_delete, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+
+  sqlite3_native_delete_t *data = (sqlite3_native_delete_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
+  assert(err == 0);
+
+  int type = sqlite3_native__get_file_type_from_name(data->name);
+
+  js_value_t *args[2];
+
+  err = js_create_uint32(env, type, &args[0]);
+  assert(err == 0);
+
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_delete_done, (void *) data, &args[1]);
+  assert(err == 0);
+
+  err = js_call_function(env, ctx, on_delete, 2, args, NULL);
+  assert(err == 0);
+}
+
+static int
+sqlite3_native__on_vfs_delete(sqlite3_vfs *handle, const char *name, int sync) {
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) handle;
+
+  sqlite3_native_delete_t data = {
+    vfs,
+    name,
+    sync
+  };
+
+  sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_delete, &data);
+
+  int type = sqlite3_native__get_file_type_from_name(name);
+
+  // Deleting the rollback journal marks the end of a transaction.
+  if (type == 1) sqlite3_native__changes_commit(&vfs->changes);
+
+  if (type == 0) {
+    uv_mutex_lock(&vfs->compression.lock);
+
+    sqlite3_native__compression_clear(&vfs->compression);
+
+    uv_mutex_unlock(&vfs->compression.lock);
+
+    sqlite3_native__vfs_changed(vfs);
+  }
+
+  return SQLITE_OK;
+}
+
+static js_value_t *
+sqlite3_native__on_vfs_access_done(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  sqlite3_native_access_t *data;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, (void **) &data);
+  assert(err == 0);
+
+  assert(argc == 2);
+
+  err = js_get_value_bool(env, argv[1], &data->exists);
+  assert(err == 0);
+
+  uv_sem_post(&data->request.done);
+
+  return NULL;
+}
+
+static void
+sqlite3_native__on_vfs_access_call(js_env_t *env, js_value_t *on_access, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) context;
+
+  sqlite3_native_access_t *data = (sqlite3_native_access_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, vfs->ctx, &ctx);
+  assert(err == 0);
+
+  int type = sqlite3_native__get_file_type_from_name(data->name);
+
+  js_value_t *args[2];
+
+  err = js_create_uint32(env, type, &args[0]);
+  assert(err == 0);
+
+  err = js_create_function(env, "done", -1, sqlite3_native__on_vfs_access_done, (void *) data, &args[1]);
+  assert(err == 0);
+
+  err = js_call_function(env, ctx, on_access, 2, args, NULL);
+  assert(err == 0);
+}
+
+static int
+sqlite3_native__on_vfs_access(sqlite3_vfs *handle, const char *name, int flags, int *exists) {
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) handle;
+
+  sqlite3_native_access_t data = {
+    vfs,
+    name,
+    flags
+  };
+
+  sqlite3_native__vfs_submit(vfs, &data.request, sqlite3_native_vfs_access, &data);
+
+  *exists = data.exists;
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vfs_fullpathname(sqlite3_vfs *vfs, const char *name, int len, char *out) {
+  if (strlen(name) >= len) return SQLITE_ERROR;
+
+  strcpy(out, name);
+
+  return SQLITE_OK;
+}
+
+static void *
+sqlite3_native__on_vfs_dlopen(sqlite3_vfs *vfs, const char *zPath) {
+  return 0;
+}
+
+static void
+sqlite3_native__on_vfs_dlerror(sqlite3_vfs *vfs, int nByte, char *zErrMsg) {
+  zErrMsg[nByte - 1] = '\0';
+}
+
+static void (*(sqlite3_native__on_vfs_dlsym) (sqlite3_vfs *vfs, void *pH, const char *z))(void) {
+  return 0;
+}
+
+static void
+sqlite3_native__on_vfs_dlclose(sqlite3_vfs *vfs, void *pHandle) {
+  return;
+}
+
+static int
+sqlite3_native__on_vfs_randomness(sqlite3_vfs *vfs, int bytes, char *buf) {
+  memset(buf, 0, bytes);
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vfs_sleep(sqlite3_vfs *vfs, int nMicro) {
+  // Called from the thread pool while waiting for a lock, so blocking is fine.
+  uv_sleep((nMicro + 999) / 1000);
+
+  return nMicro;
+}
+
+static int
+sqlite3_native__on_vfs_current_time(sqlite3_vfs *vfs, double *time) {
+  int err;
+
+  uv_timespec64_t ts;
+  err = uv_clock_gettime(UV_CLOCK_REALTIME, &ts);
+  assert(err == 0);
+
+  *time = ts.tv_sec / 86400.0 + 2440587.5;
+
+  return SQLITE_OK;
+}
+
+static void
+sqlite3_native__on_vfs_dispatch(js_env_t *env, js_value_t *function, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_vfs_t *vfs = (sqlite3_native_vfs_t *) arg;
+
+  uv_mutex_lock(&vfs->lock);
+
+  sqlite3_native_request_t *next = vfs->queue.head;
+
+  vfs->queue.head = NULL;
+  vfs->queue.tail = NULL;
+  vfs->queue.scheduled = false;
+
+  uv_mutex_unlock(&vfs->lock);
+
+  while (next) {
+    sqlite3_native_request_t *req = next;
+
+    // The request may complete during the call, after which it's gone.
+    next = req->next;
+
+    js_ref_t *ref;
+    js_threadsafe_function_cb call;
+
+    switch (req->op) {
+    case sqlite3_native_vfs_access:
+      ref = vfs->on_access;
+      call = sqlite3_native__on_vfs_access_call;
+      break;
+    case sqlite3_native_vfs_size:
+      ref = vfs->on_size;
+      call = sqlite3_native__on_vfs_size_call;
+      break;
+    case sqlite3_native_vfs_read:
+      ref = vfs->on_read;
+      call = sqlite3_native__on_vfs_read_call;
+      break;
+    case sqlite3_native_vfs_write:
+      ref = vfs->on_write;
+      call = sqlite3_native__on_vfs_write_call;
+      break;
+    case sqlite3_native_vfs_delete:
+      ref = vfs->on_delete;
+      call = sqlite3_native__on_vfs_delete_call;
+      break;
+    case sqlite3_native_vfs_truncate:
+      ref = vfs->on_truncate;
+      call = sqlite3_native__on_vfs_truncate_call;
+      break;
+    default:
+      ref = vfs->on_sync;
+      call = sqlite3_native__on_vfs_sync_call;
+      break;
+    }
+
+    js_handle_scope_t *scope;
+    err = js_open_handle_scope(env, &scope);
+    assert(err == 0);
+
+    js_value_t *fn;
+    err = js_get_reference_value(env, ref, &fn);
+    assert(err == 0);
+
+    call(env, fn, (void *) vfs, req->data);
+
+    err = js_close_handle_scope(env, scope);
+    assert(err == 0);
+  }
+}
+
+static js_value_t *
+sqlite3_native_vfs_init(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 13;
+  js_value_t *argv[13];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 13);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  js_value_t *handle;
+
+  sqlite3_native_vfs_t *vfs;
+  err = js_create_arraybuffer(env, sizeof(sqlite3_native_vfs_t), (void **) &vfs, &handle);
+  assert(err == 0);
+
+  err = uv_mutex_init(&vfs->lock);
+  assert(err == 0);
+
+  vfs->queue.head = NULL;
+  vfs->queue.tail = NULL;
+  vfs->queue.scheduled = false;
+
+  vfs->locks.shared = 0;
+  vfs->locks.reserved = false;
+  vfs->locks.pending = false;
+
+  vfs->writes = 0;
+
+  err = uv_mutex_init(&vfs->changes.lock);
+  assert(err == 0);
+
+  vfs->changes.page_size = 0;
+  vfs->changes.version = 0;
+  vfs->changes.pending = false;
+  vfs->changes.len = 0;
+  vfs->changes.versions = NULL;
+  vfs->changes.dirty = NULL;
+
+  err = uv_mutex_init(&vfs->compression.lock);
+  assert(err == 0);
+
+  vfs->compression.page_size = 0;
+  vfs->compression.len = 0;
+  vfs->compression.pages = NULL;
+  vfs->compression.known = 0;
+  vfs->compression.compressed = 0;
+  vfs->compression.stored = 0;
+
+  uv_random_t req;
+  err = uv_random(loop, &req, vfs->name, sizeof(vfs->name), 0, NULL);
+  assert(err == 0);
+
+  vfs->name[sizeof(vfs->name) - 1] = '\0';
+
+  vfs->env = env;
+
+  err = js_get_value_int32(env, argv[8], &vfs->read_ahead);
+  assert(err == 0);
+
+  err = js_get_value_bool(env, argv[9], &vfs->compression.enabled);
+  assert(err == 0);
+
+  err = js_get_value_bool(env, argv[10], &vfs->sync);
+  assert(err == 0);
+
+  err = js_get_value_bool(env, argv[11], &vfs->truncate);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[0], 1, &vfs->ctx);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[1], 1, &vfs->on_access);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[2], 1, &vfs->on_size);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[3], 1, &vfs->on_read);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[4], 1, &vfs->on_write);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[5], 1, &vfs->on_delete);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[6], 1, &vfs->on_truncate);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[7], 1, &vfs->on_sync);
+  assert(err == 0);
+
+  err = js_get_arraybuffer_info(env, argv[12], (void **) &vfs->dispatcher, NULL);
+  assert(err == 0);
+
+  err = js_create_reference(env, argv[12], 1, &vfs->dispatcher_ref);
+  assert(err == 0);
+
+  // The VFS is only registered, and the dispatch function only created, once
+  // the first connection using it is opened.
+  vfs->registered = false;
+
+  vfs->handle = (sqlite3_vfs) {
+    1, // Version
+    sizeof(sqlite3_native_file_t),
+    sizeof(sqlite3_native_path_t),
+    NULL,
+    vfs->name,
+    NULL,
+    sqlite3_native__on_vfs_open,
+    sqlite3_native__on_vfs_delete,
+    sqlite3_native__on_vfs_access,
+    sqlite3_native__on_vfs_fullpathname,
+    sqlite3_native__on_vfs_dlopen,
+    sqlite3_native__on_vfs_dlerror,
+    sqlite3_native__on_vfs_dlsym,
+    sqlite3_native__on_vfs_dlclose,
+    sqlite3_native__on_vfs_randomness,
+    sqlite3_native__on_vfs_sleep,
+    sqlite3_native__on_vfs_current_time,
+  };
+
+  return handle;
+}
+
+// Every VFS is still registered with SQLite on its own, as SQLite picks the
+// VFS of a connection by name and each one has its own files and locks.
+static void
+sqlite3_native__vfs_register(js_env_t *env, sqlite3_native_vfs_t *vfs) {
+  int err;
+
+  if (vfs->registered) return;
+
+  sqlite3_native_dispatcher_t *dispatcher = vfs->dispatcher;
+
+  if (dispatcher->refs++ == 0) {
+    err = js_create_threadsafe_function(env, NULL, sqlite3_native__queue_limit, 1, NULL, NULL, (void *) dispatcher, sqlite3_native__on_vfs_dispatch, &dispatcher->function);
+    assert(err == 0);
+  }
+
+  err = sqlite3_vfs_register(&vfs->handle, false);
+  assert(err == 0);
+
+  vfs->registered = true;
+}
+
+static js_value_t *
+sqlite3_native_dispatcher_init(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  js_value_t *handle;
+
+  sqlite3_native_dispatcher_t *dispatcher;
+  err = js_create_arraybuffer(env, sizeof(sqlite3_native_dispatcher_t), (void **) &dispatcher, &handle);
+  assert(err == 0);
+
+  dispatcher->function = NULL;
+  dispatcher->refs = 0;
+
+  return handle;
+}
+
+static js_value_t *
+sqlite3_native_vfs_destroy(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  sqlite3_native_vfs_t *vfs;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &vfs, NULL);
+  assert(err == 0);
+
+  uv_mutex_destroy(&vfs->lock);
+
+  uv_mutex_destroy(&vfs->changes.lock);
+
+  free(vfs->changes.versions);
+  free(vfs->changes.dirty);
+
+  uv_mutex_destroy(&vfs->compression.lock);
+
+  free(vfs->compression.pages);
+
+  if (vfs->registered) {
+    err = sqlite3_vfs_unregister(&vfs->handle);
+    assert(err == 0);
+
+    sqlite3_native_dispatcher_t *dispatcher = vfs->dispatcher;
+
+    if (--dispatcher->refs == 0) {
+      err = js_release_threadsafe_function(dispatcher->function, js_threadsafe_function_release);
+      assert(err == 0);
+
+      dispatcher->function = NULL;
+    }
+  }
+
+  err = js_delete_reference(env, vfs->dispatcher_ref);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_access);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_size);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_read);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_write);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_delete);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_truncate);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->on_sync);
+  assert(err == 0);
+
+  err = js_delete_reference(env, vfs->ctx);
+  assert(err == 0);
+
+  return NULL;
+}
+
+static js_value_t *
+sqlite3_native_vfs_changed_pages_since(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 2);
+
+  sqlite3_native_vfs_t *vfs;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &vfs, NULL);
+  assert(err == 0);
+
+  uint32_t since;
+  err = js_get_value_uint32(env, argv[1], &since);
+  assert(err == 0);
+
+  sqlite3_native_changes_t *changes = &vfs->changes;
+
+  uv_mutex_lock(&changes->lock);
+
+  // A token from the future can only have come from another VFS.
+  if (since > changes->version) since = 0;
+
+  size_t len = 0;
+
+  for (size_t i = 0; i < changes->len; i++) {
+    if (changes->versions[i] > since) len++;
+  }
+
+  js_value_t *arraybuffer;
+
+  uint32_t *data;
+  err = js_create_arraybuffer(env, len * sizeof(uint32_t), (void **) &data, &arraybuffer);
+  assert(err == 0);
+
+  for (size_t i = 0, j = 0; i < changes->len; i++) {
+    if (changes->versions[i] > since) data[j++] = i;
+  }
+
+  js_value_t *token;
+  err = js_create_uint32(env, changes->version, &token);
+  assert(err == 0);
+
+  js_value_t *page_size;
+  err = js_create_int32(env, changes->page_size, &page_size);
+  assert(err == 0);
+
+  uv_mutex_unlock(&changes->lock);
+
+  js_value_t *pages;
+  err = js_create_typedarray(env, js_uint32array, len, arraybuffer, 0, &pages);
+  assert(err == 0);
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "token", token);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "pageSize", page_size);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "pages", pages);
+  assert(err == 0);
+
+  return result;
+}
+
+static js_value_t *
+sqlite3_native_vfs_compression_stats(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  sqlite3_native_vfs_t *vfs;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &vfs, NULL);
+  assert(err == 0);
+
+  sqlite3_native_compression_t *compression = &vfs->compression;
+
+  uv_mutex_lock(&compression->lock);
+
+  int page_size = compression->page_size;
+  uint64_t known = compression->known;
+  uint64_t compressed = compression->compressed;
+  uint64_t stored = compression->stored;
+
+  uv_mutex_unlock(&compression->lock);
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  js_value_t *value;
+
+  err = js_create_int32(env, page_size, &value);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "pageSize", value);
+  assert(err == 0);
+
+  err = js_create_int64(env, (int64_t) known, &value);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "pages", value);
+  assert(err == 0);
+
+  err = js_create_int64(env, (int64_t) compressed, &value);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "compressed", value);
+  assert(err == 0);
+
+  err = js_create_int64(env, (int64_t) (known * page_size), &value);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "bytes", value);
+  assert(err == 0);
+
+  err = js_create_int64(env, (int64_t) stored, &value);
+  assert(err == 0);
+
+  err = js_set_named_property(env, result, "stored", value);
+  assert(err == 0);
+
+  return result;
+}
+
+static inline size_t
+sqlite3_native__pcache_page_size(sqlite3_native_pcache_t *cache) {
+  return sizeof(sqlite3_native_pcache_page_t) + cache->page_size + cache->extra_size;
+}
+
+static inline void
+sqlite3_native__pcache_lru_remove(sqlite3_native_pcache_page_t *page) {
+  page->lru_prev->lru_next = page->lru_next;
+  page->lru_next->lru_prev = page->lru_prev;
+
+  page->lru_prev = page->lru_next = NULL;
+}
+
+static inline void
+sqlite3_native__pcache_lru_push(sqlite3_native_pcache_page_t *page) {
+  sqlite3_native_pcache_page_t *head = &sqlite3_native__pcache.lru;
+
+  page->lru_prev = head;
+  page->lru_next = head->lru_next;
+
+  head->lru_next->lru_prev = page;
+  head->lru_next = page;
+}
+
+static void
+sqlite3_native__pcache_remove(sqlite3_native_pcache_page_t *page) {
+  sqlite3_native_pcache_t *cache = page->cache;
+
+  sqlite3_native_pcache_page_t **next = &cache->buckets[page->key % cache->buckets_len];
+
+  while (*next != page) next = &(*next)->next;
+
+  *next = page->next;
+
+  if (page->lru_next) sqlite3_native__pcache_lru_remove(page);
+
+  cache->len--;
+
+  sqlite3_native__pcache.used -= sqlite3_native__pcache_page_size(cache);
+  sqlite3_native__pcache.pages--;
+
+  free(page);
+}
+
+static void
+sqlite3_native__pcache_insert(sqlite3_native_pcache_t *cache, sqlite3_native_pcache_page_t *page) {
+  if (cache->len >= cache->buckets_len) {
+    unsigned int buckets_len = cache->buckets_len * 2;
+
+    sqlite3_native_pcache_page_t **buckets = calloc(buckets_len, sizeof(sqlite3_native_pcache_page_t *));
+
+    for (unsigned int i = 0; i < cache->buckets_len; i++) {
+      sqlite3_native_pcache_page_t *next = cache->buckets[i];
+
+      while (next) {
+        sqlite3_native_pcache_page_t *current = next;
+
+        next = current->next;
+
+        current->next = buckets[current->key % buckets_len];
+        buckets[current->key % buckets_len] = current;
+      }
+    }
+
+    free(cache->buckets);
+
+    cache->buckets = buckets;
+    cache->buckets_len = buckets_len;
+  }
+
+  page->next = cache->buckets[page->key % cache->buckets_len];
+  cache->buckets[page->key % cache->buckets_len] = page;
+
+  cache->len++;
+}
+
+// Evict unpinned pages, least recently used first and across every cache,
+// until `size` additional bytes fit within the budget.
+static bool
+sqlite3_native__pcache_reserve(size_t size) {
+  sqlite3_native_pcache_page_t *head = &sqlite3_native__pcache.lru;
+
+  while (sqlite3_native__pcache.used + size > sqlite3_native__pcache.budget) {
+    sqlite3_native_pcache_page_t *page = head->lru_prev;
+
+    if (page == head) return false;
+
+    sqlite3_native__pcache_remove(page);
+
+    sqlite3_native__pcache.evictions++;
+  }
+
+  return true;
+}
+
+static sqlite3_pcache *
+sqlite3_native__on_pcache_create(int page_size, int extra_size, int purgeable) {
+  sqlite3_native_pcache_t *cache = malloc(sizeof(sqlite3_native_pcache_t));
+
+  cache->page_size = page_size;
+  cache->extra_size = extra_size;
+  cache->purgeable = purgeable;
+  cache->len = 0;
+  cache->buckets_len = 64;
+  cache->buckets = calloc(cache->buckets_len, sizeof(sqlite3_native_pcache_page_t *));
+
+  return (sqlite3_pcache *) cache;
+}
+
+static void
+sqlite3_native__on_pcache_cachesize(sqlite3_pcache *handle, int size) {
+  // The process wide budget takes precedence over the per connection size.
+}
+
+static int
+sqlite3_native__on_pcache_pagecount(sqlite3_pcache *handle) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  int len = cache->len;
+
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+
+  return len;
+}
+
+static sqlite3_pcache_page *
+sqlite3_native__on_pcache_fetch(sqlite3_pcache *handle, unsigned int key, int create) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  sqlite3_native_pcache_page_t *page = cache->buckets[key % cache->buckets_len];
+
+  while (page && page->key != key) page = page->next;
+
+  if (page) {
+    sqlite3_native__pcache.hits++;
+
+    if (page->lru_next) sqlite3_native__pcache_lru_remove(page);
+
+    page->pinned = true;
+
+    goto done;
+  }
+
+  sqlite3_native__pcache.misses++;
+
+  if (create == 0) goto done;
+
+  size_t size = sqlite3_native__pcache_page_size(cache);
+
+  if (!sqlite3_native__pcache_reserve(size) && create == 1 && cache->purgeable) goto done;
+
+  page = malloc(size);
+
+  if (page == NULL) goto done;
+
+  page->handle.pBuf = (char *) page + sizeof(sqlite3_native_pcache_page_t);
+  page->handle.pExtra = (char *) page->handle.pBuf + cache->page_size;
+  page->key = key;
+  page->pinned = true;
+  page->cache = cache;
+  page->lru_prev = page->lru_next = NULL;
+
+  memset(page->handle.pExtra, 0, cache->extra_size);
+
+  sqlite3_native__pcache_insert(cache, page);
+
+  sqlite3_native__pcache.used += size;
+  sqlite3_native__pcache.pages++;
+
+done:
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+
+  return (sqlite3_pcache_page *) page;
+}
+
+static void
+sqlite3_native__on_pcache_unpin(sqlite3_pcache *handle, sqlite3_pcache_page *handle_page, int discard) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  sqlite3_native_pcache_page_t *page = (sqlite3_native_pcache_page_t *) handle_page;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  page->pinned = false;
+
+  if (discard) sqlite3_native__pcache_remove(page);
+  else if (cache->purgeable) {
+    sqlite3_native__pcache_lru_push(page);
+    sqlite3_native__pcache_reserve(0);
+  }
+
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+}
+
+static void
+sqlite3_native__on_pcache_rekey(sqlite3_pcache *handle, sqlite3_pcache_page *handle_page, unsigned int from, unsigned int to) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  sqlite3_native_pcache_page_t *page = (sqlite3_native_pcache_page_t *) handle_page;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  sqlite3_native_pcache_page_t *existing = cache->buckets[to % cache->buckets_len];
+
+  while (existing && existing->key != to) existing = existing->next;
+
+  if (existing) sqlite3_native__pcache_remove(existing);
+
+  sqlite3_native_pcache_page_t **next = &cache->buckets[from % cache->buckets_len];
+
+  while (*next != page) next = &(*next)->next;
+
+  *next = page->next;
+
+  page->key = to;
+  page->next = cache->buckets[to % cache->buckets_len];
+  cache->buckets[to % cache->buckets_len] = page;
+
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+}
+
+static void
+sqlite3_native__pcache_discard(sqlite3_native_pcache_t *cache, unsigned int limit, bool unpinned) {
+  for (unsigned int i = 0; i < cache->buckets_len; i++) {
+    sqlite3_native_pcache_page_t *next = cache->buckets[i];
+
+    while (next) {
+      sqlite3_native_pcache_page_t *page = next;
+
+      next = page->next;
+
+      if (page->key >= limit && (!unpinned || !page->pinned)) sqlite3_native__pcache_remove(page);
+    }
+  }
+}
+
+static void
+sqlite3_native__on_pcache_truncate(sqlite3_pcache *handle, unsigned int limit) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  sqlite3_native__pcache_discard(cache, limit, false);
+
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+}
+
+static void
+sqlite3_native__on_pcache_destroy(sqlite3_pcache *handle) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  sqlite3_native__pcache_discard(cache, 0, false);
+
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+
+  free(cache->buckets);
+  free(cache);
+}
+
+static void
+sqlite3_native__on_pcache_shrink(sqlite3_pcache *handle) {
+  sqlite3_native_pcache_t *cache = (sqlite3_native_pcache_t *) handle;
+
+  if (!cache->purgeable) return;
+
+  uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+  sqlite3_native__pcache_discard(cache, 0, true);
+
+  uv_mutex_unlock(&sqlite3_native__pcache.lock);
+}
+
+static js_value_t *
+sqlite3_native_configure_page_cache(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  int64_t budget;
+  err = js_get_value_int64(env, argv[0], &budget);
+  assert(err == 0);
+
+  if (sqlite3_native__pcache.installed) {
+    uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+    sqlite3_native__pcache.budget = budget;
+
+    sqlite3_native__pcache_reserve(0);
+
+    uv_mutex_unlock(&sqlite3_native__pcache.lock);
+
+    return NULL;
+  }
+
+  static const sqlite3_pcache_methods2 methods = {
+    1, // Version
+    NULL,
+    NULL,
+    NULL,
+    sqlite3_native__on_pcache_create,
+    sqlite3_native__on_pcache_cachesize,
+    sqlite3_native__on_pcache_pagecount,
+    sqlite3_native__on_pcache_fetch,
+    sqlite3_native__on_pcache_unpin,
+    sqlite3_native__on_pcache_rekey,
+    sqlite3_native__on_pcache_truncate,
+    sqlite3_native__on_pcache_destroy,
+    sqlite3_native__on_pcache_shrink
+  };
+
+  err = sqlite3_config(SQLITE_CONFIG_PCACHE2, &methods);
+
+  if (err != SQLITE_OK) {
+    err = js_throw_error(env, NULL, "Page cache must be configured before opening a database");
+    assert(err == 0);
+
+    return NULL;
+  }
+
+  err = uv_mutex_init(&sqlite3_native__pcache.lock);
+  assert(err == 0);
+
+  sqlite3_native__pcache.installed = true;
+  sqlite3_native__pcache.budget = budget;
+  sqlite3_native__pcache.lru.lru_prev = &sqlite3_native__pcache.lru;
+  sqlite3_native__pcache.lru.lru_next = &sqlite3_native__pcache.lru;
+
+  return NULL;
+}
+
+static js_value_t *
+sqlite3_native_page_cache_stats(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  js_value_t *result;
+  err = js_create_object(env, &result);
+  assert(err == 0);
+
+  if (sqlite3_native__pcache.installed) uv_mutex_lock(&sqlite3_native__pcache.lock);
+
+#define V(name, value) \
+  { \
+    js_value_t *val; \
+    err = js_create_int64(env, (int64_t) (value), &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
+
+  V("budget", sqlite3_native__pcache.budget)
+  V("used", sqlite3_native__pcache.used)
+  V("pages", sqlite3_native__pcache.pages)
+  V("hits", sqlite3_native__pcache.hits)
+  V("misses", sqlite3_native__pcache.misses)
+  V("evictions", sqlite3_native__pcache.evictions)
+#undef V
+
+  if (sqlite3_native__pcache.installed) uv_mutex_unlock(&sqlite3_native__pcache.lock);
+
+  return result;
+}
+
+static inline void
+sqlite3_native__data_changed(sqlite3_native_t *db) {
+  uv_mutex_lock(&db->lock);
+  db->version++;
+  uv_mutex_unlock(&db->lock);
+}
+
+// Commits made through other connections sharing the VFS are only visible
+// through its commit generation, so fold that into the version as well.
+static uint64_t
+sqlite3_native__data_version(sqlite3_native_t *db) {
+  uv_mutex_lock(&db->lock);
+  uint64_t version = db->version;
+  uv_mutex_unlock(&db->lock);
+
+  sqlite3_native_changes_t *changes = db->changes;
+
+  if (changes) {
+    uv_mutex_lock(&changes->lock);
+    version += changes->version;
+    uv_mutex_unlock(&changes->lock);
+  }
+
+  return version;
+}
+
+static void
+sqlite3_native__value_from_sqlite(sqlite3_native_value_t *value, sqlite3_value *handle) {
+  value->type = sqlite3_value_type(handle);
+  value->data = NULL;
+  value->len = 0;
+
+  switch (value->type) {
+  case SQLITE_INTEGER:
+    value->integer = sqlite3_value_int64(handle);
+    break;
+
+  case SQLITE_FLOAT:
+    value->real = sqlite3_value_double(handle);
+    break;
+
+  case SQLITE_TEXT:
+  case SQLITE_BLOB: {
+    const void *data = value->type == SQLITE_TEXT ? sqlite3_value_text(handle) : sqlite3_value_blob(handle);
+
+    value->len = sqlite3_value_bytes(handle);
+    value->data = malloc(value->len ? value->len : 1);
+
+    if (value->len) memcpy(value->data, data, value->len);
+    break;
+  }
+  }
+}
+
+static void
+sqlite3_native__value_from_js(js_env_t *env, js_value_t *handle, sqlite3_native_value_t *value) {
+  int err;
+
+  value->type = SQLITE_NULL;
+  value->data = NULL;
+  value->len = 0;
+
+  js_value_type_t type;
+  err = js_typeof(env, handle, &type);
+  assert(err == 0);
+
+  switch (type) {
+  case js_undefined:
+  case js_null:
+    break;
+
+  case js_boolean: {
+    bool boolean;
+    err = js_get_value_bool(env, handle, &boolean);
+    assert(err == 0);
+
+    value->type = SQLITE_INTEGER;
+    value->integer = boolean;
+    break;
+  }
+
+  case js_number: {
+    double real;
+    err = js_get_value_double(env, handle, &real);
+    assert(err == 0);
+
+    if (real >= -9007199254740992.0 && real <= 9007199254740992.0 && (double) (int64_t) real == real) {
+      value->type = SQLITE_INTEGER;
+      value->integer = (int64_t) real;
+    } else {
+      value->type = SQLITE_FLOAT;
+      value->real = real;
+    }
+    break;
+  }
+
+  case js_bigint: {
+    bool lossless;
+    err = js_get_value_bigint_int64(env, handle, &value->integer, &lossless);
+    assert(err == 0);
+
+    value->type = SQLITE_INTEGER;
+    break;
+  }
+
+  default: {
+    bool is_typedarray;
+    err = js_is_typedarray(env, handle, &is_typedarray);
+    assert(err == 0);
+
+    if (is_typedarray) {
+      void *data;
+      size_t len;
+      err = js_get_typedarray_info(env, handle, NULL, &data, &len, NULL, NULL);
+      assert(err == 0);
+
+      value->type = SQLITE_BLOB;
+      value->len = len;
+      value->data = malloc(len ? len : 1);
+
+      if (len) memcpy(value->data, data, len);
+      break;
+    }
+
+    if (type != js_string) {
+      err = js_coerce_to_string(env, handle, &handle);
+      assert(err == 0);
+    }
+
+    err = js_get_value_string_utf8(env, handle, NULL, 0, &value->len);
+    assert(err == 0);
+
+    value->type = SQLITE_TEXT;
+    value->data = malloc(value->len + 1 /* NULL */);
+
+    err = js_get_value_string_utf8(env, handle, value->data, value->len + 1, NULL);
+    assert(err == 0);
+  }
+  }
+}
+
+static void
+sqlite3_native__value_to_js(js_env_t *env, sqlite3_native_value_t *value, js_value_t **result) {
+  int err;
+
+  switch (value->type) {
+  case SQLITE_INTEGER:
+    if (value->integer >= -9007199254740991 && value->integer <= 9007199254740991) {
+      err = js_create_int64(env, value->integer, result);
+    } else {
+      err = js_create_bigint_int64(env, value->integer, result);
+    }
+    assert(err == 0);
+    break;
+
+  case SQLITE_FLOAT:
+    err = js_create_double(env, value->real, result);
+    assert(err == 0);
+    break;
+
+  case SQLITE_TEXT:
+    err = js_create_string_utf8(env, value->data, value->len, result);
+    assert(err == 0);
+    break;
+
+  case SQLITE_BLOB: {
+    js_value_t *arraybuffer;
+
+    void *data;
+    err = js_create_arraybuffer(env, value->len, &data, &arraybuffer);
+    assert(err == 0);
+
+    memcpy(data, value->data, value->len);
+
+    err = js_create_typedarray(env, js_uint8array, value->len, arraybuffer, 0, result);
+    assert(err == 0);
+    break;
+  }
+
+  default:
+    err = js_get_null(env, result);
+    assert(err == 0);
+  }
+}
+
+static void
+sqlite3_native__value_result(sqlite3_context *context, sqlite3_native_value_t *value) {
+  switch (value->type) {
+  case SQLITE_INTEGER:
+    sqlite3_result_int64(context, value->integer);
+    break;
+
+  case SQLITE_FLOAT:
+    sqlite3_result_double(context, value->real);
+    break;
+
+  case SQLITE_TEXT:
+    sqlite3_result_text64(context, value->data, value->len, SQLITE_TRANSIENT, SQLITE_UTF8);
+    break;
+
+  case SQLITE_BLOB:
+    sqlite3_result_blob64(context, value->data, value->len, SQLITE_TRANSIENT);
+    break;
+
+  default:
+    sqlite3_result_null(context);
+  }
+}
+
+static void
+sqlite3_native__value_copy(sqlite3_native_value_t *target, sqlite3_native_value_t *value) {
+  *target = *value;
+
+  if (value->data) {
+    target->data = malloc(value->len ? value->len : 1);
+
+    if (value->len) memcpy(target->data, value->data, value->len);
+  }
+}
+
+static inline void
+sqlite3_native__value_free(sqlite3_native_value_t *value) {
+  free(value->data);
+
+  value->data = NULL;
+}
+
+static char *
+sqlite3_native__get_exception_message(js_env_t *env) {
+  int err;
+
+  js_value_t *exception;
+  err = js_get_and_clear_last_exception(env, &exception);
+  assert(err == 0);
+
+  js_value_type_t type;
+  err = js_typeof(env, exception, &type);
+  assert(err == 0);
+
+  if (type == js_object) {
+    err = js_get_named_property(env, exception, "message", &exception);
+    assert(err == 0);
+  }
+
+  err = js_coerce_to_string(env, exception, &exception);
+  assert(err == 0);
+
+  size_t len;
+  err = js_get_value_string_utf8(env, exception, NULL, 0, &len);
+  assert(err == 0);
+
+  char *message = malloc(len + 1 /* NULL */);
+
+  err = js_get_value_string_utf8(env, exception, (utf8_t *) message, len + 1, NULL);
+  assert(err == 0);
+
+  return message;
+}
+
+static uint64_t
+sqlite3_native__hash(const uint8_t *data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+// Encode the arguments of a deterministic function call into a key that
+// identifies the call, returning its length.
+static size_t
+sqlite3_native__memo_key(int argc, sqlite3_native_value_t *argv, uint8_t **result) {
+  size_t len = 0;
+
+  for (int i = 0; i < argc; i++) {
+    len += 1 + sizeof(size_t) + (argv[i].data ? argv[i].len : sizeof(double));
+  }
+
+  uint8_t *key = malloc(len ? len : 1);
+
+  size_t offset = 0;
+
+  for (int i = 0; i < argc; i++) {
+    sqlite3_native_value_t *value = &argv[i];
+
+    key[offset++] = value->type;
+
+    if (value->data) {
+      memcpy(&key[offset], &value->len, sizeof(size_t));
+      offset += sizeof(size_t);
+
+      memcpy(&key[offset], value->data, value->len);
+      offset += value->len;
+    } else {
+      memset(&key[offset], 0, sizeof(size_t));
+      offset += sizeof(size_t);
+
+      if (value->type == SQLITE_INTEGER) memcpy(&key[offset], &value->integer, sizeof(double));
+      else if (value->type == SQLITE_FLOAT) memcpy(&key[offset], &value->real, sizeof(double));
+      else memset(&key[offset], 0, sizeof(double));
+
+      offset += sizeof(double);
+    }
+  }
+
+  *result = key;
+
+  return len;
+}
+
+static const size_t sqlite3_native__memo_limit = 4096;
+
+static void
+sqlite3_native__memo_clear(sqlite3_native_function_t *function) {
+  for (size_t i = 0; i < 256; i++) {
+    sqlite3_native_memo_t *next = function->memo[i];
+
+    while (next) {
+      sqlite3_native_memo_t *memo = next;
+
+      next = memo->next;
+
+      sqlite3_native__value_free(&memo->result);
+
+      free(memo->key);
+      free(memo);
+    }
+
+    function->memo[i] = NULL;
+  }
+
+  function->memo_len = 0;
+}
+
+static void
+sqlite3_native__on_call_call(js_env_t *env, js_value_t *function, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_call_t *call = (sqlite3_native_call_t *) arg;
+
+  sqlite3_native_function_t *fn = call->function;
+
+  sqlite3_native_aggregate_t *aggregate = call->aggregate;
+
+  js_value_t *receiver;
+  err = js_get_reference_value(env, fn->fn, &receiver);
+  assert(err == 0);
+
+  call->result.type = SQLITE_NULL;
+  call->result.data = NULL;
+
+  if (call->type == sqlite3_native_call_scalar) {
+    js_value_t **argv = malloc(call->argc * sizeof(js_value_t *));
+
+    for (int i = 0; i < call->argc; i++) {
+      sqlite3_native__value_to_js(env, &call->argv[i], &argv[i]);
+    }
+
+    js_value_t *recv;
+    err = js_get_undefined(env, &recv);
+    assert(err == 0);
+
+    js_value_t *result;
+    err = js_call_function(env, recv, receiver, call->argc, argv, &result);
+
+    free(argv);
+
+    if (err != 0) call->error = sqlite3_native__get_exception_message(env);
+    else sqlite3_native__value_from_js(env, result, &call->result);
+
+    goto done;
+  }
+
+  js_value_t *state;
+
+  if (aggregate->state == NULL) {
+    js_value_t *start;
+    err = js_get_named_property(env, receiver, "start", &start);
+    assert(err == 0);
+
+    js_value_type_t type;
+    err = js_typeof(env, start, &type);
+    assert(err == 0);
+
+    if (type == js_function) {
+      err = js_call_function(env, receiver, start, 0, NULL, &state);
+
+      if (err != 0) {
+        call->error = sqlite3_native__get_exception_message(env);
+
+        goto done;
+      }
+    } else {
+      state = start;
+    }
+
+    err = js_create_reference(env, state, 1, &aggregate->state);
+    assert(err == 0);
+  } else {
+    err = js_get_reference_value(env, aggregate->state, &state);
+    assert(err == 0);
+  }
+
+  if (aggregate->rows > 0) {
+    js_value_t *step;
+    err = js_get_named_property(env, receiver, "step", &step);
+    assert(err == 0);
+
+    int argc = aggregate->argc;
+
+    js_value_t **argv = malloc((argc + 1) * sizeof(js_value_t *));
+
+    if (fn->vectorized) {
+      js_value_t *rows;
+      err = js_create_array_with_length(env, aggregate->rows, &rows);
+      assert(err == 0);
+
+      for (int i = 0; i < aggregate->rows; i++) {
+        js_value_t *row;
+        err = js_create_array_with_length(env, argc, &row);
+        assert(err == 0);
+
+        for (int j = 0; j < argc; j++) {
+          js_value_t *value;
+          sqlite3_native__value_to_js(env, &aggregate->values[i * argc + j], &value);
+
+          err = js_set_element(env, row, j, value);
+          assert(err == 0);
+        }
+
+        err = js_set_element(env, rows, i, row);
+        assert(err == 0);
+      }
+
+      argv[0] = state;
+      argv[1] = rows;
+
+      js_value_t *result;
+      err = js_call_function(env, receiver, step, 2, argv, &result);
+
+      if (err != 0) call->error = sqlite3_native__get_exception_message(env);
+      else {
+        js_value_type_t type;
+        err = js_typeof(env, result, &type);
+        assert(err == 0);
+
+        if (type != js_undefined) state = result;
+      }
+    } else {
+      for (int i = 0; i < aggregate->rows && call->error == NULL; i++) {
+        argv[0] = state;
+
+        for (int j = 0; j < argc; j++) {
+          sqlite3_native__value_to_js(env, &aggregate->values[i * argc + j], &argv[j + 1]);
+        }
+
+        js_value_t *result;
+        err = js_call_function(env, receiver, step, argc + 1, argv, &result);
+
+        if (err != 0) call->error = sqlite3_native__get_exception_message(env);
+        else {
+          js_value_type_t type;
+          err = js_typeof(env, result, &type);
+          assert(err == 0);
+
+          if (type != js_undefined) state = result;
+        }
+      }
+    }
+
+    free(argv);
+
+    err = js_delete_reference(env, aggregate->state);
+    assert(err == 0);
+
+    err = js_create_reference(env, state, 1, &aggregate->state);
+    assert(err == 0);
+  }
+
+  if (call->type == sqlite3_native_call_final) {
+    if (call->error == NULL) {
+      js_value_t *fn;
+      err = js_get_named_property(env, receiver, "result", &fn);
+      assert(err == 0);
+
+      js_value_type_t type;
+      err = js_typeof(env, fn, &type);
+      assert(err == 0);
+
+      if (type == js_function) {
+        js_value_t *result;
+        err = js_call_function(env, receiver, fn, 1, &state, &result);
+
+        if (err != 0) call->error = sqlite3_native__get_exception_message(env);
+        else sqlite3_native__value_from_js(env, result, &call->result);
+      } else {
+        sqlite3_native__value_from_js(env, state, &call->result);
+      }
+    }
+
+    err = js_delete_reference(env, aggregate->state);
+    assert(err == 0);
+
+    aggregate->state = NULL;
+  }
+
+done:
+  uv_sem_post(&call->done);
+}
+
+static void
+sqlite3_native__call(sqlite3_native_call_t *call) {
+  int err;
+
+  err = uv_sem_init(&call->done, 0);
+  assert(err == 0);
+
+  call->error = NULL;
+
+  err = js_call_threadsafe_function(call->function->db->on_call, (void *) call, js_threadsafe_function_blocking);
+  assert(err == 0);
+
+  uv_sem_wait(&call->done);
+
+  uv_sem_destroy(&call->done);
+}
+
+static void
+sqlite3_native__on_function(sqlite3_context *context, int argc, sqlite3_value **values) {
+  sqlite3_native_function_t *function = sqlite3_user_data(context);
+
+  sqlite3_native_value_t *argv = malloc((argc ? argc : 1) * sizeof(sqlite3_native_value_t));
+
+  for (int i = 0; i < argc; i++) {
+    sqlite3_native__value_from_sqlite(&argv[i], values[i]);
+  }
+
+  uint8_t *key = NULL;
+  size_t len = 0;
+  uint64_t hash = 0;
+
+  if (function->deterministic) {
+    len = sqlite3_native__memo_key(argc, argv, &key);
+    hash = sqlite3_native__hash(key, len);
+
+    sqlite3_native_memo_t *memo = function->memo[hash % 256];
+
+    while (memo && (memo->hash != hash || memo->len != len || memcmp(memo->key, key, len) != 0)) {
+      memo = memo->next;
+    }
+
+    if (memo) {
+      sqlite3_native__value_result(context, &memo->result);
+
+      free(key);
+
+      goto done;
+    }
+  }
+
+  sqlite3_native_call_t call = {
+    .type = sqlite3_native_call_scalar,
+    .function = function,
+    .argc = argc,
+    .argv = argv,
+  };
+
+  sqlite3_native__call(&call);
+
+  if (call.error) {
+    sqlite3_result_error(context, call.error, -1);
+
+    free(call.error);
+    free(key);
+
+    goto done;
+  }
+
+  sqlite3_native__value_result(context, &call.result);
+
+  if (function->deterministic) {
+    if (function->memo_len >= sqlite3_native__memo_limit) sqlite3_native__memo_clear(function);
+
+    sqlite3_native_memo_t *memo = malloc(sizeof(sqlite3_native_memo_t));
+
+    memo->hash = hash;
+    memo->key = key;
+    memo->len = len;
+    memo->result = call.result;
+    memo->next = function->memo[hash % 256];
+
+    function->memo[hash % 256] = memo;
+    function->memo_len++;
+  } else {
+    sqlite3_native__value_free(&call.result);
+  }
+
+done:
+  for (int i = 0; i < argc; i++) {
+    sqlite3_native__value_free(&argv[i]);
+  }
+
+  free(argv);
+}
+
+static void
+sqlite3_native__aggregate_flush(sqlite3_context *context, sqlite3_native_aggregate_t *aggregate, sqlite3_native_call_type_t type) {
+  sqlite3_native_function_t *function = sqlite3_user_data(context);
+
+  sqlite3_native_call_t call = {
+    .type = type,
+    .function = function,
+    .aggregate = aggregate,
+  };
+
+  sqlite3_native__call(&call);
+
+  for (int i = 0, n = aggregate->rows * aggregate->argc; i < n; i++) {
+    sqlite3_native__value_free(&aggregate->values[i]);
+  }
+
+  aggregate->rows = 0;
+
+  if (call.error) {
+    sqlite3_result_error(context, call.error, -1);
+
+    free(call.error);
+  } else if (type == sqlite3_native_call_final) {
+    sqlite3_native__value_result(context, &call.result);
+  }
+
+  sqlite3_native__value_free(&call.result);
+}
+
+static void
+sqlite3_native__on_aggregate_step(sqlite3_context *context, int argc, sqlite3_value **values) {
+  sqlite3_native_function_t *function = sqlite3_user_data(context);
+
+  sqlite3_native_aggregate_t *aggregate = sqlite3_aggregate_context(context, sizeof(sqlite3_native_aggregate_t));
+
+  if (aggregate == NULL) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  if (aggregate->values == NULL) {
+    aggregate->argc = argc;
+    aggregate->values = malloc((argc ? argc : 1) * function->batch * sizeof(sqlite3_native_value_t));
+  }
+
+  for (int i = 0; i < argc; i++) {
+    sqlite3_native__value_from_sqlite(&aggregate->values[aggregate->rows * argc + i], values[i]);
+  }
+
+  // Rows are buffered natively and handed to JavaScript a batch at a time.
+  if (++aggregate->rows == function->batch) {
+    sqlite3_native__aggregate_flush(context, aggregate, sqlite3_native_call_step);
+  }
+}
+
+static void
+sqlite3_native__on_aggregate_final(sqlite3_context *context) {
+  sqlite3_native_aggregate_t *aggregate = sqlite3_aggregate_context(context, sizeof(sqlite3_native_aggregate_t));
+
+  if (aggregate == NULL) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  sqlite3_native__aggregate_flush(context, aggregate, sqlite3_native_call_final);
+
+  free(aggregate->values);
+}
+
+static void
+sqlite3_native__on_after_create_function(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_create_function_t *req = (sqlite3_native_create_function_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (req->status != SQLITE_OK) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) sqlite3_errstr(req->status), -1, &message);
+    assert(err == 0);
+
+    err = js_create_error(env, NULL, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, req->deferred, result);
+    assert(err == 0);
+
+    err = js_delete_reference(env, req->function->fn);
+    assert(err == 0);
+
+    free(req->function);
+  } else {
+    req->function->next = db->functions;
+
+    db->functions = req->function;
+
+    err = js_get_undefined(env, &result);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  free(req->name);
+  free(req);
+}
+
+static void
+sqlite3_native__on_before_create_function(uv_work_t *handle) {
+  sqlite3_native_create_function_t *req = (sqlite3_native_create_function_t *) handle->data;
+
+  sqlite3_native_function_t *function = req->function;
+
+  int flags = SQLITE_UTF8;
+
+  if (function->deterministic) flags |= SQLITE_DETERMINISTIC;
+
+  if (function->aggregate) {
+    req->status = sqlite3_create_function_v2(req->db->handle, req->name, -1, flags, function, NULL, sqlite3_native__on_aggregate_step, sqlite3_native__on_aggregate_final, NULL);
+  } else {
+    req->status = sqlite3_create_function_v2(req->db->handle, req->name, -1, flags, function, sqlite3_native__on_function, NULL, NULL, NULL);
+  }
+
+  // Cached results may have been computed by a previous definition.
+  if (req->status == SQLITE_OK) sqlite3_native__data_changed(req->db);
+}
+
+static js_value_t *
+sqlite3_native_create_function(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 7;
+  js_value_t *argv[7];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 7);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  size_t name_len;
+  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &name_len);
+  assert(err == 0);
+
+  char *name = malloc(name_len + 1 /* NULL */);
+
+  err = js_get_value_string_utf8(env, argv[1], (utf8_t *) name, name_len + 1, NULL);
+  assert(err == 0);
+
+  if (db->on_call == NULL) {
+    err = js_create_threadsafe_function(env, NULL, sqlite3_native__queue_limit, 1, NULL, NULL, (void *) db, sqlite3_native__on_call_call, &db->on_call);
+    assert(err == 0);
+  }
+
+  sqlite3_native_function_t *function = calloc(1, sizeof(sqlite3_native_function_t));
+
+  function->db = db;
+
+  err = js_create_reference(env, argv[2], 1, &function->fn);
+  assert(err == 0);
+
+  err = js_get_value_bool(env, argv[3], &function->aggregate);
+  assert(err == 0);
+
+  err = js_get_value_bool(env, argv[4], &function->deterministic);
+  assert(err == 0);
+
+  err = js_get_value_bool(env, argv[5], &function->vectorized);
+  assert(err == 0);
+
+  err = js_get_value_int32(env, argv[6], &function->batch);
+  assert(err == 0);
+
+  if (function->batch < 1) function->batch = 1;
+
+  sqlite3_native_create_function_t *req = malloc(sizeof(sqlite3_native_create_function_t));
+
+  req->db = db;
+  req->function = function;
+  req->name = name;
+  req->status = SQLITE_OK;
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_create_function, sqlite3_native__on_after_create_function);
+  assert(err == 0);
+
+  return promise;
+}
+
+static inline bool
+sqlite3_native__column_is_integer(sqlite3_native_column_t *column) {
+  return column->type != js_float32array && column->type != js_float64array;
+}
+
+static inline int64_t
+sqlite3_native__column_get_int64(sqlite3_native_column_t *column, size_t i) {
+  switch (column->type) {
+  case js_int8array:
+    return ((int8_t *) column->data)[i];
+  case js_uint8array:
+  case js_uint8clampedarray:
+    return ((uint8_t *) column->data)[i];
+  case js_int16array:
+    return ((int16_t *) column->data)[i];
+  case js_uint16array:
+    return ((uint16_t *) column->data)[i];
+  case js_int32array:
+    return ((int32_t *) column->data)[i];
+  case js_uint32array:
+    return ((uint32_t *) column->data)[i];
+  case js_bigint64array:
+    return ((int64_t *) column->data)[i];
+  case js_biguint64array:
+    return (int64_t) ((uint64_t *) column->data)[i];
+  default:
+    return 0;
+  }
+}
+
+static inline double
+sqlite3_native__column_get_double(sqlite3_native_column_t *column, size_t i) {
+  switch (column->type) {
+  case js_float32array:
+    return ((float *) column->data)[i];
+  case js_float64array:
+    return ((double *) column->data)[i];
+  case js_biguint64array:
+    return (double) ((uint64_t *) column->data)[i];
+  default:
+    return (double) sqlite3_native__column_get_int64(column, i);
+  }
+}
+
+// Compare the value of a column, or of the row index if `column` is NULL, to
+// a numeric SQL value.
+static inline int
+sqlite3_native__column_compare(sqlite3_native_column_t *column, size_t i, sqlite3_value *value) {
+  if (sqlite3_value_numeric_type(value) == SQLITE_INTEGER && (column == NULL || (sqlite3_native__column_is_integer(column) && column->type != js_biguint64array))) {
+    int64_t a = column ? sqlite3_native__column_get_int64(column, i) : (int64_t) i;
+    int64_t b = sqlite3_value_int64(value);
+
+    return a < b ? -1 : a > b ? 1 : 0;
+  }
+
+  double a = column ? sqlite3_native__column_get_double(column, i) : (double) i;
+  double b = sqlite3_value_double(value);
+
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Find the first row in [start, end) for which the column compares greater
+// than, or greater than or equal to, the value.
+static size_t
+sqlite3_native__column_search(sqlite3_native_column_t *column, size_t start, size_t end, sqlite3_value *value, bool inclusive) {
+  while (start < end) {
+    size_t middle = start + (end - start) / 2;
+
+    int cmp = sqlite3_native__column_compare(column, middle, value);
+
+    if (cmp < 0 || (cmp == 0 && !inclusive)) start = middle + 1;
+    else end = middle;
+  }
+
+  return start;
+}
+
+static int
+sqlite3_native__on_vtab_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **result, char **error) {
+  int err;
+
+  sqlite3_native_table_t *table = (sqlite3_native_table_t *) aux;
+
+  sqlite3_str *sql = sqlite3_str_new(db);
+
+  sqlite3_str_appendall(sql, "CREATE TABLE x(");
+
+  for (int i = 0; i < table->columns_len; i++) {
+    sqlite3_native_column_t *column = &table->columns[i];
+
+    sqlite3_str_appendf(sql, "%s\"%w\" %s", i == 0 ? "" : ", ", column->name, sqlite3_native__column_is_integer(column) ? "INTEGER" : "REAL");
+  }
+
+  sqlite3_str_appendall(sql, ")");
+
+  char *query = sqlite3_str_finish(sql);
+
+  if (query == NULL) return SQLITE_NOMEM;
+
+  err = sqlite3_declare_vtab(db, query);
+
+  sqlite3_free(query);
+
+  if (err != SQLITE_OK) return err;
+
+  sqlite3_native_vtab_t *vtab = sqlite3_malloc(sizeof(sqlite3_native_vtab_t));
+
+  if (vtab == NULL) return SQLITE_NOMEM;
+
+  memset(vtab, 0, sizeof(sqlite3_native_vtab_t));
+
+  vtab->table = table;
+
+  *result = (sqlite3_vtab *) vtab;
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_disconnect(sqlite3_vtab *handle) {
+  sqlite3_free(handle);
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_best_index(sqlite3_vtab *handle, sqlite3_index_info *info) {
+  sqlite3_native_table_t *table = ((sqlite3_native_vtab_t *) handle)->table;
+
+  // Pick a sorted column, or the row index, with a usable range constraint.
+  int index = -2;
+
+  for (int i = 0; i < info->nConstraint && index == -2; i++) {
+    const struct sqlite3_index_constraint *constraint = &info->aConstraint[i];
+
+    if (!constraint->usable) continue;
+
+    switch (constraint->op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+    case SQLITE_INDEX_CONSTRAINT_GT:
+    case SQLITE_INDEX_CONSTRAINT_GE:
+    case SQLITE_INDEX_CONSTRAINT_LT:
+    case SQLITE_INDEX_CONSTRAINT_LE:
+      if (constraint->iColumn < 0 || table->columns[constraint->iColumn].sorted) index = constraint->iColumn;
+    }
+  }
+
+  info->estimatedCost = (double) table->len;
+  info->estimatedRows = table->len;
+
+  if (index != -2) {
+    char *ops = sqlite3_malloc(info->nConstraint + 1);
+
+    if (ops == NULL) return SQLITE_NOMEM;
+
+    int argc = 0;
+    bool eq = false;
+
+    for (int i = 0; i < info->nConstraint; i++) {
+      const struct sqlite3_index_constraint *constraint = &info->aConstraint[i];
+
+      if (!constraint->usable || constraint->iColumn != index) continue;
+
+      switch (constraint->op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        eq = true;
+        // fallthrough
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        ops[argc++] = constraint->op;
+
+        // SQLite still checks the constraint as numbers are compared with
+        // the affinity of the column, which the search does not replicate.
+        info->aConstraintUsage[i].argvIndex = argc;
+        info->aConstraintUsage[i].omit = 0;
+      }
+    }
+
+    ops[argc] = '\0';
+
+    double log = 1;
+
+    for (size_t len = table->len; len > 1; len /= 2) log++;
+
+    info->idxNum = index + 2;
+    info->idxStr = ops;
+    info->needToFreeIdxStr = 1;
+    info->estimatedCost = eq ? log : log + table->len / 4.0;
+    info->estimatedRows = eq ? 1 : table->len / 4;
+  }
+
+  if (info->nOrderBy == 1 && !info->aOrderBy[0].desc) {
+    int column = info->aOrderBy[0].iColumn;
+
+    if (column < 0 || table->columns[column].sorted) info->orderByConsumed = 1;
+  }
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_open(sqlite3_vtab *handle, sqlite3_vtab_cursor **result) {
+  sqlite3_native_vtab_cursor_t *cursor = sqlite3_malloc(sizeof(sqlite3_native_vtab_cursor_t));
+
+  if (cursor == NULL) return SQLITE_NOMEM;
+
+  memset(cursor, 0, sizeof(sqlite3_native_vtab_cursor_t));
+
+  cursor->table = ((sqlite3_native_vtab_t *) handle)->table;
+
+  *result = (sqlite3_vtab_cursor *) cursor;
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_close(sqlite3_vtab_cursor *handle) {
+  sqlite3_free(handle);
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_filter(sqlite3_vtab_cursor *handle, int index, const char *ops, int argc, sqlite3_value **argv) {
+  sqlite3_native_vtab_cursor_t *cursor = (sqlite3_native_vtab_cursor_t *) handle;
+
+  sqlite3_native_table_t *table = cursor->table;
+
+  size_t start = 0;
+  size_t end = table->len;
+
+  if (index > 0) {
+    sqlite3_native_column_t *column = index == 1 ? NULL : &table->columns[index - 2];
+
+    for (int i = 0; i < argc; i++) {
+      int type = sqlite3_value_numeric_type(argv[i]);
+
+      if (type == SQLITE_NULL) {
+        start = end;
+        break;
+      }
+
+      if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) continue;
+
+      switch ((unsigned char) ops[i]) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        start = sqlite3_native__column_search(column, start, end, argv[i], true);
+        end = sqlite3_native__column_search(column, start, end, argv[i], false);
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+        start = sqlite3_native__column_search(column, start, end, argv[i], false);
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        start = sqlite3_native__column_search(column, start, end, argv[i], true);
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+        end = sqlite3_native__column_search(column, start, end, argv[i], true);
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        end = sqlite3_native__column_search(column, start, end, argv[i], false);
+        break;
+      }
+    }
+  }
+
+  cursor->row = start;
+  cursor->end = end;
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_next(sqlite3_vtab_cursor *handle) {
+  sqlite3_native_vtab_cursor_t *cursor = (sqlite3_native_vtab_cursor_t *) handle;
+
+  cursor->row++;
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_eof(sqlite3_vtab_cursor *handle) {
+  sqlite3_native_vtab_cursor_t *cursor = (sqlite3_native_vtab_cursor_t *) handle;
+
+  return cursor->row >= cursor->end;
+}
+
+static int
+sqlite3_native__on_vtab_column(sqlite3_vtab_cursor *handle, sqlite3_context *context, int i) {
+  sqlite3_native_vtab_cursor_t *cursor = (sqlite3_native_vtab_cursor_t *) handle;
+
+  sqlite3_native_column_t *column = &cursor->table->columns[i];
+
+  if (column->type == js_biguint64array && ((uint64_t *) column->data)[cursor->row] > INT64_MAX) {
+    sqlite3_result_double(context, sqlite3_native__column_get_double(column, cursor->row));
+  } else if (sqlite3_native__column_is_integer(column)) {
+    sqlite3_result_int64(context, sqlite3_native__column_get_int64(column, cursor->row));
+  } else {
+    sqlite3_result_double(context, sqlite3_native__column_get_double(column, cursor->row));
+  }
+
+  return SQLITE_OK;
+}
+
+static int
+sqlite3_native__on_vtab_rowid(sqlite3_vtab_cursor *handle, sqlite3_int64 *rowid) {
+  sqlite3_native_vtab_cursor_t *cursor = (sqlite3_native_vtab_cursor_t *) handle;
+
+  *rowid = cursor->row;
+
+  return SQLITE_OK;
+}
+
+static const sqlite3_module sqlite3_native__table_module = {
+  .iVersion = 1,
+  .xCreate = NULL, // Eponymous only
+  .xConnect = sqlite3_native__on_vtab_connect,
+  .xBestIndex = sqlite3_native__on_vtab_best_index,
+  .xDisconnect = sqlite3_native__on_vtab_disconnect,
+  .xOpen = sqlite3_native__on_vtab_open,
+  .xClose = sqlite3_native__on_vtab_close,
+  .xFilter = sqlite3_native__on_vtab_filter,
+  .xNext = sqlite3_native__on_vtab_next,
+  .xEof = sqlite3_native__on_vtab_eof,
+  .xColumn = sqlite3_native__on_vtab_column,
+  .xRowid = sqlite3_native__on_vtab_rowid,
+};
+
+static inline void
+sqlite3_native__statements_unlink(sqlite3_native_query_t *query) {
+  query->prev->next = query->next;
+  query->next->prev = query->prev;
+}
+
+static inline void
+sqlite3_native__statements_push(sqlite3_native_statements_t *statements, sqlite3_native_query_t *query) {
+  sqlite3_native_query_t *head = &statements->lru;
+
+  query->prev = head;
+  query->next = head->next;
+
+  head->next->prev = query;
+  head->next = query;
+}
+
+// Finalize the statements of the query from the `i`th onwards, such that they
+// are prepared again on next use.
+static void
+sqlite3_native__statements_truncate(sqlite3_native_t *db, sqlite3_native_query_t *query, uint32_t i) {
+  sqlite3_native_statements_t *statements = &db->statements;
+
+  if (i >= query->statements_len) return;
+
+  for (uint32_t j = i; j < query->statements_len; j++) {
+    sqlite3_finalize(query->statements[j].handle);
+  }
+
+  uv_mutex_lock(&db->lock);
+  statements->len -= query->statements_len - i;
+  uv_mutex_unlock(&db->lock);
+
+  query->statements_len = i;
+}
+
+static void
+sqlite3_native__statements_remove(sqlite3_native_t *db, sqlite3_native_query_t *query) {
+  sqlite3_native_statements_t *statements = &db->statements;
+
+  sqlite3_native__statements_truncate(db, query, 0);
+
+  sqlite3_native__statements_unlink(query);
+
+  sqlite3_native_query_t **next = &statements->buckets[query->hash & (statements->buckets_len - 1)];
+
+  while (*next != query) next = &(*next)->bucket;
+
+  *next = query->bucket;
+
+  statements->queries--;
+
+  free(query->statements);
+  free(query->sql);
+  free(query);
+}
+
+static void
+sqlite3_native__statements_clear(sqlite3_native_t *db) {
+  sqlite3_native_statements_t *statements = &db->statements;
+
+  sqlite3_native_query_t *head = &statements->lru;
+
+  while (head->next != head) sqlite3_native__statements_remove(db, head->next);
+
+  free(statements->buckets);
+
+  statements->buckets = NULL;
+  statements->buckets_len = 0;
+}
+
+static void
+sqlite3_native__statements_rehash(sqlite3_native_statements_t *statements, size_t buckets_len) {
+  sqlite3_native_query_t **buckets = calloc(buckets_len, sizeof(sqlite3_native_query_t *));
+
+  for (size_t i = 0; i < statements->buckets_len; i++) {
+    sqlite3_native_query_t *next = statements->buckets[i];
+
+    while (next) {
+      sqlite3_native_query_t *query = next;
+
+      next = query->bucket;
+
+      sqlite3_native_query_t **bucket = &buckets[query->hash & (buckets_len - 1)];
+
+      query->bucket = *bucket;
+      *bucket = query;
+    }
+  }
+
+  free(statements->buckets);
+
+  statements->buckets = buckets;
+  statements->buckets_len = buckets_len;
+}
+
+// Look up the cache entry of a query by its full text, creating an empty one on
+// a miss. Its statements are then prepared one at a time as they're reached by
+// sqlite3_native__statements_prepare().
+static sqlite3_native_query_t *
+sqlite3_native__statements_get(sqlite3_native_t *db, const char *sql, size_t len) {
+  sqlite3_native_statements_t *statements = &db->statements;
+
+  uint64_t hash = sqlite3_native__hash((const uint8_t *) sql, len);
+
+  if (statements->buckets_len) {
+    sqlite3_native_query_t *query = statements->buckets[hash & (statements->buckets_len - 1)];
+
+    for (; query; query = query->bucket) {
+      if (query->hash != hash || query->len != len || memcmp(query->sql, sql, len) != 0) continue;
+
+      sqlite3_native__statements_unlink(query);
+      sqlite3_native__statements_push(statements, query);
+
+      return query;
+    }
+  }
+
+  if (statements->queries >= statements->buckets_len) {
+    sqlite3_native__statements_rehash(statements, statements->buckets_len ? statements->buckets_len * 2 : 64);
+  }
+
+  sqlite3_native_query_t *query = malloc(sizeof(sqlite3_native_query_t));
+
+  query->hash = hash;
+  query->sql = malloc(len + 1 /* NULL */);
+  query->len = len;
+  query->statements_len = 0;
+  query->statements_capacity = 0;
+  query->statements = NULL;
+
+  memcpy(query->sql, sql, len);
+
+  query->sql[len] = '\0';
+
+  sqlite3_native_query_t **bucket = &statements->buckets[hash & (statements->buckets_len - 1)];
+
+  query->bucket = *bucket;
+  *bucket = query;
+
+  statements->queries++;
+
+  sqlite3_native__statements_push(statements, query);
+
+  return query;
+}
+
+// Get the `i`th statement of the query, preparing and caching it on a miss.
+// Only the statements following those already prepared can be requested.
+static int
+sqlite3_native__statements_prepare(sqlite3_native_t *db, sqlite3_native_query_t *query, uint32_t i, sqlite3_native_statement_t **result) {
+  int err;
+
+  sqlite3_native_statements_t *statements = &db->statements;
+
+  if (i < query->statements_len) {
+    uv_mutex_lock(&db->lock);
+    statements->hits++;
+    uv_mutex_unlock(&db->lock);
+
+    *result = &query->statements[i];
+
+    return SQLITE_OK;
+  }
+
+  assert(i == query->statements_len);
+
+  uv_mutex_lock(&db->lock);
+  statements->misses++;
+  uv_mutex_unlock(&db->lock);
+
+  size_t start = i ? query->statements[i - 1].end : 0;
+
+  // Include the terminator as otherwise SQLite copies the remaining text of the
+  // query for every statement.
+  sqlite3_stmt *handle;
+  const char *tail;
+  err = sqlite3_prepare_v3(db->handle, &query->sql[start], (int) (query->len - start + 1), statements->capacity ? SQLITE_PREPARE_PERSISTENT : 0, &handle, &tail);
+  if (err != SQLITE_OK) return err;
+
+  if (query->statements_len == query->statements_capacity) {
+    query->statements_capacity = query->statements_capacity ? query->statements_capacity * 2 : 1;
+    query->statements = realloc(query->statements, query->statements_capacity * sizeof(sqlite3_native_statement_t));
+  }
+
+  sqlite3_native_statement_t *statement = &query->statements[query->statements_len++];
+
+  statement->handle = handle;
+
+  // Parsing stops at an embedded terminator, so skip whatever follows it.
+  statement->end = tail > &query->sql[start] ? tail - query->sql : query->len;
+
+  uv_mutex_lock(&db->lock);
+  statements->len++;
+  uv_mutex_unlock(&db->lock);
+
+  sqlite3_native_query_t *head = &statements->lru;
+
+  while (statements->len > statements->capacity && head->prev != query) {
+    sqlite3_native__statements_remove(db, head->prev);
+  }
+
+  *result = statement;
+
+  return SQLITE_OK;
+}
+
+static void
+sqlite3_native__on_after_register_table(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_register_table_t *req = (sqlite3_native_register_table_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  // The table is kept until the database is closed as it may still be
+  // referenced by a previous registration under the same name.
+  req->table->next = db->tables;
+
+  db->tables = req->table;
+
+  if (req->status != SQLITE_OK) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) sqlite3_errstr(req->status), -1, &message);
+    assert(err == 0);
+
+    err = js_create_error(env, NULL, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, req->deferred, result);
+    assert(err == 0);
+  } else {
+    err = js_get_undefined(env, &result);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  free(req);
+}
+
+static void
+sqlite3_native__on_before_register_table(uv_work_t *handle) {
+  sqlite3_native_register_table_t *req = (sqlite3_native_register_table_t *) handle->data;
+
+  sqlite3_native_table_t *table = req->table;
+
+  for (int i = 0; i < table->columns_len; i++) {
+    sqlite3_native_column_t *column = &table->columns[i];
+
+    column->sorted = true;
+
+    for (size_t j = 1; j < table->len && column->sorted; j++) {
+      if (sqlite3_native__column_is_integer(column) && column->type != js_biguint64array) {
+        column->sorted = sqlite3_native__column_get_int64(column, j) >= sqlite3_native__column_get_int64(column, j - 1);
+      } else {
+        column->sorted = sqlite3_native__column_get_double(column, j) >= sqlite3_native__column_get_double(column, j - 1);
+      }
+    }
+  }
+
+  sqlite3 *db = req->db->handle;
+
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+
+  // Statements prepared while a previous registration under the same name was
+  // in place would keep reading its columns.
+  sqlite3_native__statements_clear(req->db);
+
+  req->status = sqlite3_create_module_v2(db, table->name, &sqlite3_native__table_module, (void *) table, NULL);
+
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+
+  // Nor may cached results read from them.
+  if (req->status == SQLITE_OK) sqlite3_native__data_changed(req->db);
+}
+
+static js_value_t *
+sqlite3_native_register_table(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 4;
+  js_value_t *argv[4];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 4);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  sqlite3_native_table_t *table = malloc(sizeof(sqlite3_native_table_t));
+
+  size_t name_len;
+  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &name_len);
+  assert(err == 0);
+
+  table->name = malloc(name_len + 1 /* NULL */);
+
+  err = js_get_value_string_utf8(env, argv[1], (utf8_t *) table->name, name_len + 1, NULL);
+  assert(err == 0);
+
+  uint32_t columns_len;
+  err = js_get_array_length(env, argv[2], &columns_len);
+  assert(err == 0);
+
+  table->len = 0;
+  table->columns_len = columns_len;
+  table->columns = malloc(columns_len * sizeof(sqlite3_native_column_t));
+
+  for (uint32_t i = 0; i < columns_len; i++) {
+    sqlite3_native_column_t *column = &table->columns[i];
+
+    js_value_t *name;
+    err = js_get_element(env, argv[2], i, &name);
+    assert(err == 0);
+
+    err = js_get_value_string_utf8(env, name, NULL, 0, &name_len);
+    assert(err == 0);
+
+    column->name = malloc(name_len + 1 /* NULL */);
+
+    err = js_get_value_string_utf8(env, name, (utf8_t *) column->name, name_len + 1, NULL);
+    assert(err == 0);
+
+    js_value_t *array;
+    err = js_get_element(env, argv[3], i, &array);
+    assert(err == 0);
+
+    size_t len;
+    err = js_get_typedarray_info(env, array, &column->type, &column->data, &len, NULL, NULL);
+    assert(err == 0);
+
+    if (i == 0 || len < table->len) table->len = len;
+
+    err = js_create_reference(env, array, 1, &column->array);
+    assert(err == 0);
+  }
+
+  sqlite3_native_register_table_t *req = malloc(sizeof(sqlite3_native_register_table_t));
+
+  req->db = db;
+  req->table = table;
+  req->status = SQLITE_OK;
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_register_table, sqlite3_native__on_after_register_table);
+  assert(err == 0);
+
+  return promise;
+}
+
+static void
+sqlite3_native__value_bind(sqlite3_stmt *stmt, int i, sqlite3_native_value_t *value) {
+  switch (value->type) {
+  case SQLITE_INTEGER:
+    sqlite3_bind_int64(stmt, i, value->integer);
+    break;
+
+  case SQLITE_FLOAT:
+    sqlite3_bind_double(stmt, i, value->real);
+    break;
+
+  case SQLITE_TEXT:
+    sqlite3_bind_text64(stmt, i, value->data, value->len, SQLITE_STATIC, SQLITE_UTF8);
+    break;
+
+  case SQLITE_BLOB:
+    sqlite3_bind_blob64(stmt, i, value->data, value->len, SQLITE_STATIC);
+    break;
+
+  default:
+    sqlite3_bind_null(stmt, i);
+  }
+}
+
+static void
+sqlite3_native__on_result_call(js_env_t *env, js_value_t *on_result, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_t *db = (sqlite3_native_t *) context;
+
+  sqlite3_native_exec_t *data = (sqlite3_native_exec_t *) arg;
+
+  js_value_t *result;
+  err = js_get_reference_value(env, data->result, &result);
+  assert(err == 0);
+
+  js_value_t *rows;
+  err = js_create_array_with_length(env, data->len, &rows);
+  assert(err == 0);
+
+  js_value_t *columns;
+  err = js_create_array_with_length(env, data->len, &columns);
+  assert(err == 0);
+
+  for (int i = 0, n = data->len; i < n; i++) {
+    js_value_t *row;
+
+    if (data->rows[i] == NULL) {
+      err = js_get_null(env, &row);
+      assert(err == 0);
+    } else {
+      err = js_create_string_utf8(env, (const utf8_t *) data->rows[i], -1, &row);
+      assert(err == 0);
+    }
+
+    err = js_set_element(env, rows, i, row);
+    assert(err == 0);
+
+    js_value_t *col;
+    err = js_create_string_utf8(env, (const utf8_t *) data->columns[i], -1, &col);
+    assert(err == 0);
+
+    err = js_set_element(env, columns, i, col);
+    assert(err == 0);
+  }
+
+  js_value_t *entry;
+  err = js_create_object(env, &entry);
+  assert(err == 0);
+
+  err = js_set_named_property(env, entry, "rows", rows);
+  assert(err == 0);
+
+  err = js_set_named_property(env, entry, "columns", columns);
+  assert(err == 0);
+
+  err = js_set_element(env, result, data->i++, entry);
+  assert(err == 0);
+
+  uv_sem_post(&data->done);
+}
+
+static int
+sqlite3_native__on_result(void *arg, int len, char **rows, char **columns) {
+  int err;
+
+  sqlite3_native_exec_t *data = (sqlite3_native_exec_t *) arg;
+
+  data->len = len;
+  data->rows = rows;
+  data->columns = columns;
+
+  err = js_call_threadsafe_function(data->db->on_result, (void *) data, js_threadsafe_function_blocking);
+  assert(err == 0);
+
+  uv_sem_wait(&data->done);
+
+  return SQLITE_OK;
+}
+
+static void
+sqlite3_native__updates_free(sqlite3_native_updates_t *updates) {
+  for (uint32_t i = 0; i < updates->tables_len; i++) {
+    free(updates->tables[i]);
+  }
+
+  free(updates->tables);
+  free(updates->entries);
+  free(updates);
+}
+
+static void
+sqlite3_native__on_update(void *ctx, int op, const char *database, const char *name, sqlite3_int64 rowid) {
+  sqlite3_native_t *db = (sqlite3_native_t *) ctx;
+
+  uv_mutex_lock(&db->lock);
+  bool watching = db->watching;
+  uv_mutex_unlock(&db->lock);
+
+  if (!watching) return;
+
+  sqlite3_native_updates_t *updates = db->updates;
+
+  if (updates == NULL) updates = db->updates = calloc(1, sizeof(sqlite3_native_updates_t));
+
+  uint32_t table = updates->tables_len;
+
+  // Transactions tend to touch few tables, and mostly the same one as the
+  // previous change, so search from the back.
+  for (uint32_t i = updates->tables_len; i > 0; i--) {
+    if (strcmp(updates->tables[i - 1], name) == 0) {
+      table = i - 1;
+      break;
+    }
+  }
+
+  if (table == updates->tables_len) {
+    if (updates->tables_len == updates->tables_capacity) {
+      updates->tables_capacity = updates->tables_capacity ? updates->tables_capacity * 2 : 4;
+      updates->tables = realloc(updates->tables, updates->tables_capacity * sizeof(char *));
+    }
+
+    updates->tables[updates->tables_len++] = strdup(name);
+  }
+
+  if (updates->len == updates->capacity) {
+    updates->capacity = updates->capacity ? updates->capacity * 2 : 64;
+    updates->entries = realloc(updates->entries, updates->capacity * sizeof(sqlite3_native_update_t));
+  }
+
+  sqlite3_native_update_t *update = &updates->entries[updates->len++];
+
+  update->op = (uint8_t) op;
+  update->table = table;
+  update->rowid = rowid;
+}
+
+// Read the next keyword or name of a statement, without any quotes around it,
+// and return where the statement continues.
+static const char *
+sqlite3_native__token(const char *sql, const char **token, size_t *len) {
+  while (*sql == ' ' || *sql == '\t' || *sql == '\n' || *sql == '\r') sql++;
+
+  char quote = *sql == '[' ? ']' : (*sql == '"' || *sql == '\'' || *sql == '`') ? *sql : 0;
+
+  if (quote) sql++;
+
+  *token = sql;
+
+  if (quote) {
+    while (*sql != '\0' && *sql != quote) sql++;
+  } else {
+    while (*sql != '\0' && *sql != ';' && *sql != ' ' && *sql != '\t' && *sql != '\n' && *sql != '\r') sql++;
+  }
+
+  *len = sql - *token;
+
+  if (quote && *sql != '\0') sql++;
+
+  return sql;
+}
+
+static bool
+sqlite3_native__token_is(const char *token, size_t len, const char *keyword) {
+  return len == strlen(keyword) && sqlite3_strnicmp(token, keyword, (int) len) == 0;
+}
+
+// Find the innermost open savepoint of the given name.
+static bool
+sqlite3_native__savepoint_find(sqlite3_native_t *db, const char *name, size_t len, uint32_t *index) {
+  for (uint32_t i = db->savepoints_len; i > 0; i--) {
+    const char *candidate = db->savepoints[i - 1].name;
+
+    if (strlen(candidate) == len && sqlite3_strnicmp(candidate, name, (int) len) == 0) {
+      *index = i - 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void
+sqlite3_native__savepoints_pop(sqlite3_native_t *db, uint32_t len) {
+  while (db->savepoints_len > len) {
+    free(db->savepoints[--db->savepoints_len].name);
+  }
+}
+
+// Follows the savepoints opened, released, and rolled back to by each
+// statement as it starts running, which SQLite has no hook for.
+static int
+sqlite3_native__on_trace(unsigned type, void *ctx, void *stmt, void *x) {
+  sqlite3_native_t *db = (sqlite3_native_t *) ctx;
+
+  // Savepoints end with the transaction they belong to.
+  if (sqlite3_get_autocommit(db->handle)) sqlite3_native__savepoints_pop(db, 0);
+
+  const char *sql = (const char *) x;
+
+  const char *token;
+  size_t len;
+
+  sql = sqlite3_native__token(sql, &token, &len);
+
+  if (sqlite3_native__token_is(token, len, "SAVEPOINT")) {
+    sql = sqlite3_native__token(sql, &token, &len);
+
+    if (db->savepoints_len == db->savepoints_capacity) {
+      db->savepoints_capacity = db->savepoints_capacity ? db->savepoints_capacity * 2 : 4;
+      db->savepoints = realloc(db->savepoints, db->savepoints_capacity * sizeof(sqlite3_native_savepoint_t));
+    }
+
+    sqlite3_native_savepoint_t *savepoint = &db->savepoints[db->savepoints_len++];
+
+    savepoint->name = malloc(len + 1 /* NULL */);
+    memcpy(savepoint->name, token, len);
+    savepoint->name[len] = '\0';
+    savepoint->changes = db->updates ? db->updates->len : 0;
+  } else if (sqlite3_native__token_is(token, len, "RELEASE")) {
+    sql = sqlite3_native__token(sql, &token, &len);
+
+    if (sqlite3_native__token_is(token, len, "SAVEPOINT")) sql = sqlite3_native__token(sql, &token, &len);
+
+    uint32_t index;
+    if (sqlite3_native__savepoint_find(db, token, len, &index)) sqlite3_native__savepoints_pop(db, index);
+  } else if (sqlite3_native__token_is(token, len, "ROLLBACK")) {
+    sql = sqlite3_native__token(sql, &token, &len);
+
+    if (sqlite3_native__token_is(token, len, "TRANSACTION")) sql = sqlite3_native__token(sql, &token, &len);
+
+    // Rolling back the whole transaction is handled by the rollback hook.
+    if (!sqlite3_native__token_is(token, len, "TO")) return 0;
+
+    sql = sqlite3_native__token(sql, &token, &len);
+
+    if (sqlite3_native__token_is(token, len, "SAVEPOINT")) sql = sqlite3_native__token(sql, &token, &len);
+
+    uint32_t index;
+    if (!sqlite3_native__savepoint_find(db, token, len, &index)) return 0;
+
+    // The savepoint itself stays open, but any opened after it are cancelled.
+    sqlite3_native__savepoints_pop(db, index + 1);
+
+    size_t changes = db->savepoints[index].changes;
+
+    if (db->updates == NULL || db->updates->len <= changes) return 0;
+
+    // Leave no empty batch behind to be delivered on commit.
+    if (changes == 0) {
+      sqlite3_native__updates_free(db->updates);
+
+      db->updates = NULL;
+    } else {
+      db->updates->len = changes;
+    }
+  }
+
+  return 0;
+}
+
+static void
+sqlite3_native__updates_emit(sqlite3_native_t *db, sqlite3_native_updates_t *updates) {
+  int err;
+
+  err = js_call_threadsafe_function(db->on_change, (void *) updates, js_threadsafe_function_nonblocking);
+  if (err != 0) sqlite3_native__updates_free(updates);
+}
+
+// Called once a statement is done, which is when a failed commit has left its
+// transaction open rather than ending it.
+static void
+sqlite3_native__updates_flush(sqlite3_native_t *db) {
+  sqlite3_native_updates_t *updates = db->committed;
+
+  if (updates == NULL) return;
+
+  db->committed = NULL;
+
+  if (sqlite3_get_autocommit(db->handle)) {
+    sqlite3_native__updates_emit(db, updates);
+  } else {
+    assert(db->updates == NULL);
+
+    db->updates = updates;
+  }
+}
+
+static int
+sqlite3_native__on_commit(void *ctx) {
+  sqlite3_native_t *db = (sqlite3_native_t *) ctx;
+
+  sqlite3_native__data_changed(db);
+
+  // A batch still held back belongs to an earlier commit that went through.
+  if (db->committed) sqlite3_native__updates_emit(db, db->committed);
+
+  db->committed = db->updates;
+  db->updates = NULL;
+
+  return 0;
+}
+
+static void
+sqlite3_native__on_rollback(void *ctx) {
+  sqlite3_native_t *db = (sqlite3_native_t *) ctx;
+
+  if (db->updates) {
+    sqlite3_native__updates_free(db->updates);
+
+    db->updates = NULL;
+  }
+
+  if (db->committed) {
+    sqlite3_native__updates_free(db->committed);
+
+    db->committed = NULL;
+  }
+}
+
+static void
+sqlite3_native__on_change_call(js_env_t *env, js_value_t *on_change, void *context, void *arg) {
+  int err;
+
+  sqlite3_native_t *db = (sqlite3_native_t *) context;
+
+  sqlite3_native_updates_t *updates = (sqlite3_native_updates_t *) arg;
+
+  js_value_t *ctx;
+  err = js_get_reference_value(env, db->ctx, &ctx);
+  assert(err == 0);
+
+  js_value_t *ops[3];
+
+  err = js_create_string_utf8(env, (utf8_t *) "insert", -1, &ops[0]);
+  assert(err == 0);
+
+  err = js_create_string_utf8(env, (utf8_t *) "update", -1, &ops[1]);
+  assert(err == 0);
+
+  err = js_create_string_utf8(env, (utf8_t *) "delete", -1, &ops[2]);
+  assert(err == 0);
+
+  js_value_t **tables = malloc(updates->tables_len * sizeof(js_value_t *));
+
+  for (uint32_t i = 0; i < updates->tables_len; i++) {
+    err = js_create_string_utf8(env, (utf8_t *) updates->tables[i], -1, &tables[i]);
+    assert(err == 0);
+  }
+
+  js_value_t *changes;
+  err = js_create_array_with_length(env, updates->len, &changes);
+  assert(err == 0);
+
+  for (size_t i = 0; i < updates->len; i++) {
+    sqlite3_native_update_t *update = &updates->entries[i];
+
+    js_value_t *change;
+    err = js_create_object(env, &change);
+    assert(err == 0);
+
+    err = js_set_named_property(env, change, "table", tables[update->table]);
+    assert(err == 0);
+
+    js_value_t *op = update->op == SQLITE_INSERT ? ops[0] : update->op == SQLITE_UPDATE ? ops[1] : ops[2];
+
+    err = js_set_named_property(env, change, "op", op);
+    assert(err == 0);
+
+    sqlite3_native_value_t value = {.type = SQLITE_INTEGER, .integer = update->rowid};
+
+    js_value_t *rowid;
+    sqlite3_native__value_to_js(env, &value, &rowid);
+
+    err = js_set_named_property(env, change, "rowid", rowid);
+    assert(err == 0);
+
+    err = js_set_element(env, changes, (uint32_t) i, change);
+    assert(err == 0);
+  }
+
+  free(tables);
+
+  sqlite3_native__updates_free(updates);
+
+  err = js_call_function(env, ctx, on_change, 1, &changes, NULL);
+
+  // Exceptions thrown by listeners can't be handed back to the commit they
+  // belong to, so report them as uncaught.
+  if (err != 0) {
+    js_value_t *error;
+    err = js_get_and_clear_last_exception(env, &error);
+    assert(err == 0);
+
+    err = js_fatal_exception(env, error);
+    assert(err == 0);
+  }
+}
+
+static js_value_t *
+sqlite3_native_init(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 2);
+
+  uint32_t statements;
+  err = js_get_value_uint32(env, argv[1], &statements);
+  assert(err == 0);
+
+  js_value_t *handle;
+
+  sqlite3_native_t *db;
+  err = js_create_arraybuffer(env, sizeof(sqlite3_native_t), (void **) &db, &handle);
+  assert(err == 0);
+
+  err = uv_mutex_init(&db->lock);
+  assert(err == 0);
+
+  db->statements.capacity = statements;
+  db->statements.len = 0;
+  db->statements.hits = 0;
+  db->statements.misses = 0;
+  db->statements.queries = 0;
+  db->statements.buckets_len = 0;
+  db->statements.buckets = NULL;
+  db->statements.lru.prev = &db->statements.lru;
+  db->statements.lru.next = &db->statements.lru;
+
+  db->env = env;
+  db->version = 0;
+  db->dirty = false;
+  db->changes = NULL;
+  db->watching = false;
+  db->updates = NULL;
+  db->committed = NULL;
+  db->savepoints_len = 0;
+  db->savepoints_capacity = 0;
+  db->savepoints = NULL;
+  db->memory = NULL;
+  db->functions = NULL;
+  db->tables = NULL;
+
+  err = js_create_reference(env, argv[0], 1, &db->ctx);
+  assert(err == 0);
+
+  db->on_result = NULL;
+  db->on_call = NULL;
+  db->on_change = NULL;
+
+  return handle;
+}
+
+// The name of a primary result code, exposed to JavaScript as the `code` of
+// errors so that callers can tell, for example, a busy database from a failed
+// constraint.
+static const char *
+sqlite3_native__error_code(int code) {
+  switch (code & 0xff) {
+  case SQLITE_OK:
+    return "SQLITE_OK";
+  case SQLITE_ERROR:
+    return "SQLITE_ERROR";
+  case SQLITE_INTERNAL:
+    return "SQLITE_INTERNAL";
+  case SQLITE_PERM:
+    return "SQLITE_PERM";
+  case SQLITE_ABORT:
+    return "SQLITE_ABORT";
+  case SQLITE_BUSY:
+    return "SQLITE_BUSY";
+  case SQLITE_LOCKED:
+    return "SQLITE_LOCKED";
+  case SQLITE_NOMEM:
+    return "SQLITE_NOMEM";
+  case SQLITE_READONLY:
+    return "SQLITE_READONLY";
+  case SQLITE_INTERRUPT:
+    return "SQLITE_INTERRUPT";
+  case SQLITE_IOERR:
+    return "SQLITE_IOERR";
+  case SQLITE_CORRUPT:
+    return "SQLITE_CORRUPT";
+  case SQLITE_NOTFOUND:
+    return "SQLITE_NOTFOUND";
+  case SQLITE_FULL:
+    return "SQLITE_FULL";
+  case SQLITE_CANTOPEN:
+    return "SQLITE_CANTOPEN";
+  case SQLITE_PROTOCOL:
+    return "SQLITE_PROTOCOL";
+  case SQLITE_EMPTY:
+    return "SQLITE_EMPTY";
+  case SQLITE_SCHEMA:
+    return "SQLITE_SCHEMA";
+  case SQLITE_TOOBIG:
+    return "SQLITE_TOOBIG";
+  case SQLITE_CONSTRAINT:
+    return "SQLITE_CONSTRAINT";
+  case SQLITE_MISMATCH:
+    return "SQLITE_MISMATCH";
+  case SQLITE_MISUSE:
+    return "SQLITE_MISUSE";
+  case SQLITE_NOLFS:
+    return "SQLITE_NOLFS";
+  case SQLITE_AUTH:
+    return "SQLITE_AUTH";
+  case SQLITE_FORMAT:
+    return "SQLITE_FORMAT";
+  case SQLITE_RANGE:
+    return "SQLITE_RANGE";
+  case SQLITE_NOTADB:
+    return "SQLITE_NOTADB";
+  case SQLITE_NOTICE:
+    return "SQLITE_NOTICE";
+  case SQLITE_WARNING:
+    return "SQLITE_WARNING";
+  default:
+    return "SQLITE_ERROR";
+  }
+}
+
+static void
+sqlite3_native__on_after_open(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_open_t *req = (sqlite3_native_open_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (req->error) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) req->error, -1, &message);
+    assert(err == 0);
+
+    sqlite3_free(req->error);
+
+    js_value_t *code;
+    err = js_create_string_utf8(env, (utf8_t *) sqlite3_native__error_code(req->code), -1, &code);
+    assert(err == 0);
+
+    err = js_create_error(env, code, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, req->deferred, result);
+    assert(err == 0);
+  } else {
+    err = js_get_undefined(env, &result);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  free(req);
+}
+
+static void
+sqlite3_native__on_before_open(uv_work_t *handle) {
+  int err;
+
+  sqlite3_native_open_t *req = (sqlite3_native_open_t *) handle->data;
+
+  err = sqlite3_open_v2((char *) req->name, &req->db->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, req->vfs->name);
+  assert(err == 0);
+
+  req->db->changes = &req->vfs->changes;
+
+  // No busy handler is installed as waiting for locks held by other
+  // connections would hold up a thread of the shared pool. Requests that can
+  // safely be run again are instead retried from JavaScript.
+
+  if (req->preload) {
+    sqlite3_file *file;
+    err = sqlite3_file_control(req->db->handle, "main", SQLITE_FCNTL_FILE_POINTER, &file);
+    assert(err == 0);
+
+    sqlite3_native__preload((sqlite3_native_file_t *) file, req->preload);
+
+    // Load the schema while its pages are at hand rather than on first use.
+    err = sqlite3_exec(req->db->handle, "SELECT 1 FROM sqlite_schema LIMIT 1;", NULL, NULL, NULL);
+
+    // A database that can't be read fails to open, as it would otherwise only
+    // fail on first use. One locked by another connection is opened anyway,
+    // leaving the schema to be loaded on first use.
+    if (err != SQLITE_OK && (err & 0xff) != SQLITE_BUSY) {
+      req->error = sqlite3_mprintf("%s", sqlite3_errmsg(req->db->handle));
+      req->code = err;
+
+      sqlite3_close_v2(req->db->handle);
+
+      req->db->handle = NULL;
+      req->db->changes = NULL;
+
+      return;
+    }
+  }
+
+  sqlite3_commit_hook(req->db->handle, sqlite3_native__on_commit, (void *) req->db);
+  sqlite3_rollback_hook(req->db->handle, sqlite3_native__on_rollback, (void *) req->db);
+  sqlite3_update_hook(req->db->handle, sqlite3_native__on_update, (void *) req->db);
+  sqlite3_trace_v2(req->db->handle, SQLITE_TRACE_STMT, sqlite3_native__on_trace, (void *) req->db);
+}
+
+static js_value_t *
+sqlite3_native_open(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 4;
+  js_value_t *argv[4];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 4);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  sqlite3_native_vfs_t *vfs;
+  err = js_get_arraybuffer_info(env, argv[1], (void **) &vfs, NULL);
+  assert(err == 0);
+
+  sqlite3_native_path_t name;
+  err = js_get_value_string_utf8(env, argv[2], name, sizeof(name), NULL);
+  assert(err == 0);
+
+  int64_t preload;
+  err = js_get_value_int64(env, argv[3], &preload);
+  assert(err == 0);
+
+  sqlite3_native__vfs_register(env, vfs);
+
+  sqlite3_native_open_t *req = malloc(sizeof(sqlite3_native_open_t));
+
+  req->db = db;
+  req->vfs = vfs;
+  req->preload = preload;
+  req->error = NULL;
+  req->code = SQLITE_OK;
+
+  memcpy(req->name, name, sizeof(name));
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_open, sqlite3_native__on_after_open);
+  assert(err == 0);
+
+  return promise;
+}
+
+static void
+sqlite3_native__on_after_close(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_close_t *req = (sqlite3_native_close_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+  err = js_get_undefined(env, &result);
+  assert(err == 0);
+
+  err = js_resolve_deferred(env, req->deferred, result);
+  assert(err == 0);
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  if (db->on_result) {
+    err = js_release_threadsafe_function(db->on_result, js_threadsafe_function_release);
+    assert(err == 0);
+  }
+
+  if (db->on_call) {
+    err = js_release_threadsafe_function(db->on_call, js_threadsafe_function_release);
+    assert(err == 0);
+  }
+
+  if (db->on_change) {
+    err = js_release_threadsafe_function(db->on_change, js_threadsafe_function_release);
+    assert(err == 0);
+  }
+
+  if (db->updates) {
+    sqlite3_native__updates_free(db->updates);
+
+    db->updates = NULL;
+  }
+
+  if (db->committed) {
+    sqlite3_native__updates_free(db->committed);
+
+    db->committed = NULL;
+  }
+
+  sqlite3_native__savepoints_pop(db, 0);
+
+  free(db->savepoints);
+
+  db->savepoints = NULL;
+  db->savepoints_capacity = 0;
+
+  sqlite3_native_function_t *next = db->functions;
+
+  while (next) {
+    sqlite3_native_function_t *function = next;
+
+    next = function->next;
+
+    err = js_delete_reference(env, function->fn);
+    assert(err == 0);
+
+    sqlite3_native__memo_clear(function);
+
+    free(function);
+  }
+
+  db->functions = NULL;
+
+  sqlite3_native_table_t *next_table = db->tables;
+
+  while (next_table) {
+    sqlite3_native_table_t *table = next_table;
+
+    next_table = table->next;
+
+    for (int i = 0; i < table->columns_len; i++) {
+      err = js_delete_reference(env, table->columns[i].array);
+      assert(err == 0);
+
+      free(table->columns[i].name);
+    }
+
+    free(table->columns);
+    free(table->name);
+    free(table);
+  }
+
+  db->tables = NULL;
+
+  uv_mutex_destroy(&db->lock);
+
+  if (db->memory) {
+    err = js_delete_reference(env, db->memory);
+    assert(err == 0);
+
+    db->memory = NULL;
+  }
+
+  err = js_delete_reference(env, db->ctx);
+  assert(err == 0);
+
+  db->ctx = NULL;
+
+  free(req);
+}
+
+static void
+sqlite3_native__on_before_close(uv_work_t *handle) {
+  int err;
+
+  sqlite3_native_close_t *req = (sqlite3_native_close_t *) handle->data;
+
+  sqlite3_native__statements_clear(req->db);
+
+  err = sqlite3_close_v2(req->db->handle);
+  assert(err == 0);
+}
+
+static js_value_t *
+sqlite3_native_close(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  sqlite3_native_close_t *req = malloc(sizeof(sqlite3_native_close_t));
+
+  req->db = db;
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_close, sqlite3_native__on_after_close);
+  assert(err == 0);
+
+  return promise;
+}
+
+// Packed results are laid out as a sequence of records followed by a row
+// index. A column set is `u32 n` followed by `n` names, each prefixed with its
+// `u32` byte length. A row is the `u32` offset of its column set followed by
+// one cell per column, each a `u8` type tag and its payload: nothing for NULL,
+// a little-endian 64-bit integer or double, or a `u32` byte length followed by
+// the bytes for text and blobs. The buffer ends with the `u32` offset of every
+// row and finally the `u32` row count.
+
+enum {
+  sqlite3_native_packed_null = 0,
+  sqlite3_native_packed_integer = 1,
+  sqlite3_native_packed_float = 2,
+  sqlite3_native_packed_text = 3,
+  sqlite3_native_packed_blob = 4,
+};
+
+static void
+sqlite3_native__packed_init(sqlite3_native_packed_t *packed) {
+  packed->data = NULL;
+  packed->len = 0;
+  packed->capacity = 0;
+
+  packed->rows = NULL;
+  packed->rows_len = 0;
+  packed->rows_capacity = 0;
+}
+
+static void
+sqlite3_native__packed_destroy(sqlite3_native_packed_t *packed) {
+  free(packed->data);
+  free(packed->rows);
+}
+
+static int
+sqlite3_native__packed_reserve(sqlite3_native_packed_t *packed, size_t len) {
+  if (packed->len + len <= packed->capacity) return 0;
+
+  size_t capacity = packed->capacity ? packed->capacity : 4096;
+
+  while (capacity < packed->len + len) capacity *= 2;
+
+  if (capacity > UINT32_MAX) return SQLITE_TOOBIG;
+
+  uint8_t *data = realloc(packed->data, capacity);
+  if (data == NULL) return SQLITE_NOMEM;
+
+  packed->data = data;
+  packed->capacity = capacity;
+
+  return 0;
+}
+
+static inline void
+sqlite3_native__packed_append(sqlite3_native_packed_t *packed, const void *data, size_t len) {
+  memcpy(&packed->data[packed->len], data, len);
+
+  packed->len += len;
+}
+
+static inline void
+sqlite3_native__packed_append_uint32(sqlite3_native_packed_t *packed, uint32_t value) {
+  sqlite3_native__packed_append(packed, &value, sizeof(value));
+}
+
+static int
+sqlite3_native__packed_columns(sqlite3_native_packed_t *packed, sqlite3_stmt *stmt, uint32_t *result) {
+  int err;
+
+  int n = sqlite3_column_count(stmt);
+
+  size_t len = 4;
+
+  for (int i = 0; i < n; i++) {
+    len += 4 + strlen(sqlite3_column_name(stmt, i));
+  }
+
+  err = sqlite3_native__packed_reserve(packed, len);
+  if (err != 0) return err;
+
+  *result = (uint32_t) packed->len;
+
+  sqlite3_native__packed_append_uint32(packed, (uint32_t) n);
+
+  for (int i = 0; i < n; i++) {
+    const char *name = sqlite3_column_name(stmt, i);
+
+    uint32_t name_len = (uint32_t) strlen(name);
+
+    sqlite3_native__packed_append_uint32(packed, name_len);
+    sqlite3_native__packed_append(packed, name, name_len);
+  }
+
+  return 0;
+}
+
+static int
+sqlite3_native__packed_row(sqlite3_native_packed_t *packed, sqlite3_stmt *stmt, uint32_t columns) {
+  int err;
+
+  int n = sqlite3_column_count(stmt);
+
+  if (packed->rows_len == packed->rows_capacity) {
+    size_t capacity = packed->rows_capacity ? packed->rows_capacity * 2 : 256;
+
+    uint32_t *rows = realloc(packed->rows, capacity * sizeof(uint32_t));
+    if (rows == NULL) return SQLITE_NOMEM;
+
+    packed->rows = rows;
+    packed->rows_capacity = capacity;
+  }
+
+  // Size the whole row up front so the cells can be appended unchecked.
+  size_t len = 4;
+
+  for (int i = 0; i < n; i++) {
+    switch (sqlite3_column_type(stmt, i)) {
+    case SQLITE_NULL:
+      len += 1;
+      break;
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+      len += 1 + 8;
+      break;
+    case SQLITE_TEXT:
+      sqlite3_column_text(stmt, i);
+      len += 1 + 4 + sqlite3_column_bytes(stmt, i);
+      break;
+    default:
+      sqlite3_column_blob(stmt, i);
+      len += 1 + 4 + sqlite3_column_bytes(stmt, i);
+      break;
+    }
+  }
+
+  err = sqlite3_native__packed_reserve(packed, len);
+  if (err != 0) return err;
+
+  packed->rows[packed->rows_len++] = (uint32_t) packed->len;
+
+  sqlite3_native__packed_append_uint32(packed, columns);
+
+  for (int i = 0; i < n; i++) {
+    uint8_t type;
+
+    switch (sqlite3_column_type(stmt, i)) {
+    case SQLITE_NULL:
+      type = sqlite3_native_packed_null;
+      sqlite3_native__packed_append(packed, &type, 1);
+      break;
+
+    case SQLITE_INTEGER: {
+      type = sqlite3_native_packed_integer;
+      sqlite3_native__packed_append(packed, &type, 1);
+
+      int64_t value = sqlite3_column_int64(stmt, i);
+      sqlite3_native__packed_append(packed, &value, 8);
+      break;
+    }
+
+    case SQLITE_FLOAT: {
+      type = sqlite3_native_packed_float;
+      sqlite3_native__packed_append(packed, &type, 1);
+
+      double value = sqlite3_column_double(stmt, i);
+      sqlite3_native__packed_append(packed, &value, 8);
+      break;
+    }
+
+    case SQLITE_TEXT: {
+      type = sqlite3_native_packed_text;
+      sqlite3_native__packed_append(packed, &type, 1);
+
+      const unsigned char *value = sqlite3_column_text(stmt, i);
+      uint32_t value_len = (uint32_t) sqlite3_column_bytes(stmt, i);
+      sqlite3_native__packed_append_uint32(packed, value_len);
+      sqlite3_native__packed_append(packed, value, value_len);
+      break;
+    }
+
+    default: {
+      type = sqlite3_native_packed_blob;
+      sqlite3_native__packed_append(packed, &type, 1);
+
+      const void *value = sqlite3_column_blob(stmt, i);
+      uint32_t value_len = (uint32_t) sqlite3_column_bytes(stmt, i);
+      sqlite3_native__packed_append_uint32(packed, value_len);
+      if (value_len) sqlite3_native__packed_append(packed, value, value_len);
+      break;
+    }
+    }
+  }
+
+  return 0;
+}
+
+static int
+sqlite3_native__packed_finish(sqlite3_native_packed_t *packed) {
+  int err;
+
+  err = sqlite3_native__packed_reserve(packed, (packed->rows_len + 1) * 4);
+  if (err != 0) return err;
+
+  if (packed->rows_len) sqlite3_native__packed_append(packed, packed->rows, packed->rows_len * 4);
+
+  sqlite3_native__packed_append_uint32(packed, (uint32_t) packed->rows_len);
+
+  return 0;
+}
+
+static void
+sqlite3_native__on_packed_finalize(js_env_t *env, void *data, void *finalize_hint) {
+  free(data);
+}
+
+static void
+sqlite3_native__on_after_exec(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_exec_t *req = (sqlite3_native_exec_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (req->error) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) req->error, -1, &message);
+    assert(err == 0);
+
+    sqlite3_free(req->error);
+
+    js_value_t *code;
+    err = js_create_string_utf8(env, (utf8_t *) sqlite3_native__error_code(req->code), -1, &code);
+    assert(err == 0);
+
+    err = js_create_error(env, code, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, req->deferred, result);
+    assert(err == 0);
+  } else if (req->packed) {
+    sqlite3_native_packed_t *packed = &req->rows_packed;
+
+    err = js_create_external_arraybuffer(env, packed->data, packed->len, sqlite3_native__on_packed_finalize, NULL, &result);
+    assert(err == 0);
+
+    packed->data = NULL;
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  } else {
+    err = js_get_reference_value(env, req->result, &result);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  }
+
+  if (req->info) {
+    js_value_t *info;
+    err = js_get_reference_value(env, req->info, &info);
+    assert(err == 0);
+
+    js_value_t *readonly;
+    err = js_get_boolean(env, req->readonly && req->error == NULL, &readonly);
+    assert(err == 0);
+
+    err = js_set_named_property(env, info, "readonly", readonly);
+    assert(err == 0);
+
+    js_value_t *version;
+    err = js_create_int64(env, (int64_t) req->version, &version);
+    assert(err == 0);
+
+    err = js_set_named_property(env, info, "version", version);
+    assert(err == 0);
+
+    js_value_t *busy;
+    err = js_get_boolean(env, req->busy, &busy);
+    assert(err == 0);
+
+    err = js_set_named_property(env, info, "busy", busy);
+    assert(err == 0);
+
+    err = js_delete_reference(env, req->info);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  err = js_delete_reference(env, req->result);
+  assert(err == 0);
+
+  sqlite3_native__packed_destroy(&req->rows_packed);
+
+  free(req);
+}
+
+static int
+sqlite3_native__exec(sqlite3_native_exec_t *req) {
+  int err;
+
+  sqlite3_native_t *db = req->db;
+
+  sqlite3_native_statements_t *statements = &db->statements;
+
+  sqlite3_native_query_t *query = sqlite3_native__statements_get(db, (const char *) req->query, req->query_len);
+
+  size_t offset = 0;
+  uint32_t i = 0;
+
+  bool retried = false;
+
+  err = SQLITE_OK;
+
+  while (offset < query->len) {
+    sqlite3_native_statement_t *statement;
+    err = sqlite3_native__statements_prepare(db, query, i, &statement);
+    if (err != SQLITE_OK) break;
+
+    sqlite3_stmt *stmt = statement->handle;
+
+    size_t end = statement->end;
+
+    if (stmt == NULL) goto next; // Whitespace or a comment
+
+    // Statements without result columns, such as BEGIN, are readonly too but
+    // running them has side effects, so they never make a result cacheable.
+    if (!sqlite3_stmt_readonly(stmt) || sqlite3_column_count(stmt) == 0) req->readonly = false;
+
+    for (int i = 0, n = sqlite3_bind_parameter_count(stmt); i < n && i < req->params_len; i++) {
+      sqlite3_native__value_bind(stmt, i + 1, &req->params[i]);
+    }
+
+    int columns_len = sqlite3_column_count(stmt);
+
+    char **columns = NULL;
+    char **rows = NULL;
+
+    int64_t packed_columns = -1;
+
+    while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (req->packed) {
+        uint32_t offset;
+
+        if (packed_columns == -1) {
+          err = sqlite3_native__packed_columns(&req->rows_packed, stmt, &offset);
+          if (err != 0) {
+            req->error = sqlite3_mprintf("%s", sqlite3_errstr(err));
+            break;
+          }
+
+          packed_columns = offset;
+        }
+
+        err = sqlite3_native__packed_row(&req->rows_packed, stmt, (uint32_t) packed_columns);
+        if (err != 0) {
+          req->error = sqlite3_mprintf("%s", sqlite3_errstr(err));
+          break;
+        }
+
+        continue;
+      }
+
+      if (columns == NULL) {
+        columns = malloc(columns_len * sizeof(char *) + 1);
+        rows = malloc(columns_len * sizeof(char *) + 1);
+
+        for (int i = 0; i < columns_len; i++) {
+          columns[i] = (char *) sqlite3_column_name(stmt, i);
+        }
+      }
+
+      for (int i = 0; i < columns_len; i++) {
+        rows[i] = (char *) sqlite3_column_text(stmt, i);
+      }
+
+      sqlite3_native__on_result((void *) req, columns_len, rows, columns);
+    }
+
+    free(columns);
+    free(rows);
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    sqlite3_native__updates_flush(db);
+
+    if (err != SQLITE_DONE) {
+      // The schema changed too many times for SQLite to reprepare the
+      // statement on its own, so drop it from the cache and prepare it again.
+      if (err == SQLITE_SCHEMA && !retried) {
+        sqlite3_native__statements_truncate(db, query, i);
+
+        retried = true;
+
+        continue;
+      }
+
+      if (req->error == NULL) req->error = sqlite3_mprintf("%s", sqlite3_errmsg(db->handle));
+
+      if (err == SQLITE_SCHEMA) sqlite3_native__statements_truncate(db, query, i);
+
+      break;
+    }
+
+    err = SQLITE_OK;
+
+    if (!sqlite3_stmt_readonly(stmt)) req->wrote = true;
+
+    retried = false;
+
+  next:
+    offset = end;
+    i++;
+  }
+
+  // Queries with more statements than fit in the cache aren't kept.
+  if (statements->len > statements->capacity) sqlite3_native__statements_remove(db, query);
+
+  return err;
+}
+
+static void
+sqlite3_native__on_before_exec(uv_work_t *handle) {
+  int err;
+
+  sqlite3_native_exec_t *req = (sqlite3_native_exec_t *) handle->data;
+
+  sqlite3 *db = req->db->handle;
+
+  err = uv_sem_init(&req->done, 0);
+  assert(err == 0);
+
+  req->error = NULL;
+  req->code = SQLITE_OK;
+
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+
+  uint64_t version = sqlite3_native__data_version(req->db);
+
+  sqlite3_int64 changes = sqlite3_total_changes64(db);
+
+  // Open the transaction or savepoint the statements belong to as part of the
+  // same request rather than in a separate round trip.
+  if (req->begin) {
+    err = sqlite3_exec(db, req->begin, NULL, NULL, NULL);
+
+    req->readonly = false;
+  } else {
+    err = SQLITE_OK;
+  }
+
+  if (err == SQLITE_OK) err = sqlite3_native__exec(req);
+
+  if (err == SQLITE_OK && req->packed) {
+    err = sqlite3_native__packed_finish(&req->rows_packed);
+
+    if (err != SQLITE_OK) req->error = sqlite3_mprintf("%s", sqlite3_errstr(err));
+  }
+
+  if (err != SQLITE_OK && req->error == NULL) {
+    req->error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+
+  if (err != SQLITE_OK) req->code = err;
+
+  // A lock held by another connection kept the statements from running, and
+  // as none of them wrote anything and no transaction is left open, all of
+  // them can be run again once the lock is released.
+  req->busy = (err & 0xff) == SQLITE_BUSY && !req->wrote && sqlite3_get_autocommit(db);
+
+  // Changes made within a transaction aren't committed yet, but they're
+  // visible to this connection and so still make its cached results stale, as
+  // does undoing them. Until the transaction ends nothing is cached. Schema
+  // changes aren't counted as row changes, so any statement that wrote counts.
+  bool changed = req->wrote || sqlite3_total_changes64(db) != changes;
+
+  if (changed || req->db->dirty) sqlite3_native__data_changed(req->db);
+
+  req->db->dirty = (changed || req->db->dirty) && !sqlite3_get_autocommit(db);
+
+  req->version = sqlite3_native__data_version(req->db);
+
+  // Another connection may have committed while the statements ran.
+  if (req->version != version) req->readonly = false;
+
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+
+  free(req->query);
+  free(req->begin);
+
+  for (int i = 0; i < req->params_len; i++) {
+    sqlite3_native__value_free(&req->params[i]);
+  }
+
+  free(req->params);
+
+  uv_sem_destroy(&req->done);
+}
+
+static js_value_t *
+sqlite3_native_exec(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 6;
+  js_value_t *argv[6];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 6);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  size_t query_len;
+  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &query_len);
+  assert(err == 0);
+
+  utf8_t *query = (utf8_t *) malloc(query_len + 1 /* NULL */);
+
+  err = js_get_value_string_utf8(env, argv[1], query, query_len + 1, NULL);
+  assert(err == 0);
+
+  uint32_t params_len = 0;
+
+  bool has_params;
+  err = js_is_array(env, argv[2], &has_params);
+  assert(err == 0);
+
+  if (has_params) {
+    err = js_get_array_length(env, argv[2], &params_len);
+    assert(err == 0);
+  }
+
+  sqlite3_native_value_t *params = malloc((params_len ? params_len : 1) * sizeof(sqlite3_native_value_t));
+
+  for (uint32_t i = 0; i < params_len; i++) {
+    js_value_t *param;
+    err = js_get_element(env, argv[2], i, &param);
+    assert(err == 0);
+
+    sqlite3_native__value_from_js(env, param, &params[i]);
+  }
+
+  bool packed;
+  err = js_get_value_bool(env, argv[3], &packed);
+  assert(err == 0);
+
+  char *begin = NULL;
+
+  js_value_type_t begin_type;
+  err = js_typeof(env, argv[5], &begin_type);
+  assert(err == 0);
+
+  if (begin_type == js_string) {
+    size_t begin_len;
+    err = js_get_value_string_utf8(env, argv[5], NULL, 0, &begin_len);
+    assert(err == 0);
+
+    begin = malloc(begin_len + 1 /* NULL */);
+
+    err = js_get_value_string_utf8(env, argv[5], (utf8_t *) begin, begin_len + 1, NULL);
+    assert(err == 0);
+  }
+
+  js_value_t *result;
+  err = js_create_array(env, &result);
+  assert(err == 0);
+
+  // Rows are only handed to JavaScript one at a time when not packed.
+  if (!packed && db->on_result == NULL) {
+    err = js_create_threadsafe_function(env, NULL, sqlite3_native__queue_limit, 1, NULL, NULL, (void *) db, sqlite3_native__on_result_call, &db->on_result);
+    assert(err == 0);
+  }
+
+  sqlite3_native_exec_t *req = malloc(sizeof(sqlite3_native_exec_t));
+
+  req->db = db;
+  req->query = query;
+  req->query_len = query_len;
+  req->params = params;
+  req->params_len = params_len;
+  req->begin = begin;
+  req->packed = packed;
+  req->info = NULL;
+  req->readonly = true;
+  req->wrote = false;
+  req->version = 0;
+  req->i = 0;
+
+  sqlite3_native__packed_init(&req->rows_packed);
+
+  js_value_type_t info_type;
+  err = js_typeof(env, argv[4], &info_type);
+  assert(err == 0);
+
+  if (info_type == js_object) {
+    err = js_create_reference(env, argv[4], 1, &req->info);
+    assert(err == 0);
+  }
+
+  req->handle.data = (void *) req;
+
+  err = js_create_reference(env, result, 1, &req->result);
+  assert(err == 0);
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_exec, sqlite3_native__on_after_exec);
+  assert(err == 0);
+
+  return promise;
+}
+
+enum {
+  sqlite3_native_merge_concat = 0,
+  sqlite3_native_merge_sum = 1,
+  sqlite3_native_merge_order_by = 2,
+};
+
+static inline uint32_t
+sqlite3_native__packed_read_uint32(const uint8_t *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static inline void
+sqlite3_native__packed_write_uint32(uint8_t *data, uint32_t value) {
+  memcpy(data, &value, sizeof(value));
+}
+
+static inline size_t
+sqlite3_native__packed_cell_len(const uint8_t *cell) {
+  switch (cell[0]) {
+  case sqlite3_native_packed_null:
+    return 1;
+  case sqlite3_native_packed_integer:
+  case sqlite3_native_packed_float:
+    return 9;
+  default:
+    return 5 + sqlite3_native__packed_read_uint32(&cell[1]);
+  }
+}
+
+static inline const uint8_t *
+sqlite3_native__packed_cell(const uint8_t *data, uint32_t row, int column) {
+  const uint8_t *cell = &data[row + 4];
+
+  for (int i = 0; i < column; i++) cell += sqlite3_native__packed_cell_len(cell);
+
+  return cell;
+}
+
+static inline uint32_t
+sqlite3_native__packed_row_columns(const uint8_t *data, uint32_t row) {
+  return sqlite3_native__packed_read_uint32(&data[sqlite3_native__packed_read_uint32(&data[row])]);
+}
+
+// Compare two cells in the order SQLite sorts values with the BINARY
+// collation: NULL first, then numbers, then text, then blobs.
+static int
+sqlite3_native__packed_compare(const uint8_t *a, const uint8_t *b) {
+  static const int ranks[] = {0, 1, 1, 2, 3};
+
+  int rank = ranks[a[0]] - ranks[b[0]];
+
+  if (rank != 0 || a[0] == sqlite3_native_packed_null) return rank;
+
+  if (ranks[a[0]] == 1) {
+    if (a[0] == sqlite3_native_packed_integer && b[0] == sqlite3_native_packed_integer) {
+      int64_t x, y;
+      memcpy(&x, &a[1], 8);
+      memcpy(&y, &b[1], 8);
+
+      return x < y ? -1 : x > y;
+    }
+
+    double x, y;
+
+    if (a[0] == sqlite3_native_packed_integer) {
+      int64_t value;
+      memcpy(&value, &a[1], 8);
+      x = (double) value;
+    } else {
+      memcpy(&x, &a[1], 8);
+    }
+
+    if (b[0] == sqlite3_native_packed_integer) {
+      int64_t value;
+      memcpy(&value, &b[1], 8);
+      y = (double) value;
+    } else {
+      memcpy(&y, &b[1], 8);
+    }
+
+    return x < y ? -1 : x > y;
+  }
+
+  uint32_t a_len = sqlite3_native__packed_read_uint32(&a[1]);
+  uint32_t b_len = sqlite3_native__packed_read_uint32(&b[1]);
+
+  int cmp = memcmp(&a[5], &b[5], a_len < b_len ? a_len : b_len);
+
+  if (cmp != 0) return cmp;
+
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int
+sqlite3_native__packed_column_index(const uint8_t *data, uint32_t columns, const char *name) {
+  uint32_t n = sqlite3_native__packed_read_uint32(&data[columns]);
+
+  size_t name_len = strlen(name);
+
+  const uint8_t *next = &data[columns + 4];
+
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t len = sqlite3_native__packed_read_uint32(next);
+
+    if (len == name_len && memcmp(&next[4], name, len) == 0) return (int) i;
+
+    next += 4 + len;
+  }
+
+  return -1;
+}
+
+// Copy the records of every shard into the result, rebasing the column set
+// offsets of their rows, and collect the rebased row offsets per shard.
+static int
+sqlite3_native__parallel_concat(sqlite3_native_parallel_t *parallel, uint32_t *counts, uint32_t **rows) {
+  int err;
+
+  sqlite3_native_packed_t *result = &parallel->result;
+
+  size_t len = 0;
+
+  for (uint32_t i = 0; i < parallel->len; i++) {
+    sqlite3_native_packed_t *packed = &parallel->shards[i].exec.rows_packed;
+
+    counts[i] = sqlite3_native__packed_read_uint32(&packed->data[packed->len - 4]);
+    rows[i] = NULL;
+
+    len += packed->len - 4 - counts[i] * 4;
+  }
+
+  err = sqlite3_native__packed_reserve(result, len);
+  if (err != 0) return err;
+
+  for (uint32_t i = 0; i < parallel->len; i++) {
+    sqlite3_native_packed_t *packed = &parallel->shards[i].exec.rows_packed;
+
+    uint32_t count = counts[i];
+    uint32_t records = (uint32_t) (packed->len - 4 - count * 4);
+
+    uint32_t base = (uint32_t) result->len;
+
+    sqlite3_native__packed_append(result, packed->data, records);
+
+    rows[i] = malloc((count ? count : 1) * sizeof(uint32_t));
+
+    for (uint32_t j = 0; j < count; j++) {
+      uint32_t row = base + sqlite3_native__packed_read_uint32(&packed->data[records + j * 4]);
+
+      uint8_t *columns = &result->data[row];
+
+      sqlite3_native__packed_write_uint32(columns, base + sqlite3_native__packed_read_uint32(columns));
+
+      rows[i][j] = row;
+    }
+  }
+
+  return 0;
+}
+
+static int
+sqlite3_native__parallel_append_row(sqlite3_native_packed_t *result, uint32_t row) {
+  if (result->rows_len == result->rows_capacity) {
+    size_t capacity = result->rows_capacity ? result->rows_capacity * 2 : 256;
+
+    uint32_t *rows = realloc(result->rows, capacity * sizeof(uint32_t));
+    if (rows == NULL) return SQLITE_NOMEM;
+
+    result->rows = rows;
+    result->rows_capacity = capacity;
+  }
+
+  result->rows[result->rows_len++] = row;
+
+  return 0;
+}
+
+static int
+sqlite3_native__parallel_merge_rows(sqlite3_native_parallel_t *parallel) {
+  int err = 0;
+
+  sqlite3_native_packed_t *result = &parallel->result;
+
+  uint32_t *counts = malloc((parallel->len ? parallel->len : 1) * sizeof(uint32_t));
+  uint32_t **rows = malloc((parallel->len ? parallel->len : 1) * sizeof(uint32_t *));
+
+  err = sqlite3_native__parallel_concat(parallel, counts, rows);
+
+  if (err == 0 && parallel->merge == sqlite3_native_merge_concat) {
+    for (uint32_t i = 0; i < parallel->len && err == 0; i++) {
+      for (uint32_t j = 0; j < counts[i] && err == 0; j++) {
+        err = sqlite3_native__parallel_append_row(result, rows[i][j]);
+      }
+    }
+  } else if (err == 0) {
+    // Every shard is already sorted, so repeatedly take the smallest of their
+    // first rows. Shards are few, so a linear scan beats a heap here.
+    uint32_t *next = calloc(parallel->len ? parallel->len : 1, sizeof(uint32_t));
+    int *columns = malloc((parallel->len ? parallel->len : 1) * sizeof(int));
+
+    for (uint32_t i = 0; i < parallel->len; i++) {
+      columns[i] = parallel->order;
+
+      if (parallel->order_name && counts[i] > 0) {
+        columns[i] = sqlite3_native__packed_column_index(result->data, sqlite3_native__packed_read_uint32(&result->data[rows[i][0]]), parallel->order_name);
+      }
+
+      if (counts[i] > 0 && (columns[i] < 0 || (uint32_t) columns[i] >= sqlite3_native__packed_row_columns(result->data, rows[i][0]))) {
+        parallel->error = sqlite3_mprintf("No such column to order by");
+        err = SQLITE_ERROR;
+      }
+    }
+
+    while (err == 0) {
+      int64_t best = -1;
+      const uint8_t *best_cell = NULL;
+
+      for (uint32_t i = 0; i < parallel->len; i++) {
+        if (next[i] == counts[i]) continue;
+
+        const uint8_t *cell = sqlite3_native__packed_cell(result->data, rows[i][next[i]], columns[i]);
+
+        if (best != -1) {
+          int cmp = sqlite3_native__packed_compare(cell, best_cell);
+
+          if (parallel->descending ? cmp <= 0 : cmp >= 0) continue;
+        }
+
+        best = i;
+        best_cell = cell;
+      }
+
+      if (best == -1) break;
+
+      err = sqlite3_native__parallel_append_row(result, rows[best][next[best]++]);
+    }
+
+    free(next);
+    free(columns);
+  }
+
+  for (uint32_t i = 0; i < parallel->len; i++) free(rows[i]);
+
+  free(rows);
+  free(counts);
+
+  return err;
+}
+
+typedef struct {
+  uint64_t hash;
+  uint32_t row;
+  const uint8_t *data;
+
+  int64_t *integers;
+  double *reals;
+  uint8_t *types;
+} sqlite3_native_group_t;
+
+// Combine the rows of every shard whose first `keys` cells are equal, summing
+// the remaining numeric cells. Other cells keep the value of the first row of
+// the group.
+static int
+sqlite3_native__parallel_merge_sum(sqlite3_native_parallel_t *parallel) {
+  int err = 0;
+
+  sqlite3_native_packed_t *result = &parallel->result;
+
+  size_t total = 0;
+
+  for (uint32_t i = 0; i < parallel->len; i++) {
+    sqlite3_native_packed_t *packed = &parallel->shards[i].exec.rows_packed;
+
+    total += sqlite3_native__packed_read_uint32(&packed->data[packed->len - 4]);
+  }
+
+  size_t capacity = 16;
+
+  while (capacity < total * 2) capacity *= 2;
+
+  int64_t *table = malloc(capacity * sizeof(int64_t));
+
+  for (size_t i = 0; i < capacity; i++) table[i] = -1;
+
+  sqlite3_native_group_t *groups = malloc((total ? total : 1) * sizeof(sqlite3_native_group_t));
+  size_t groups_len = 0;
+
+  int n = -1;
+
+  for (uint32_t i = 0; i < parallel->len && err == 0; i++) {
+    sqlite3_native_packed_t *packed = &parallel->shards[i].exec.rows_packed;
+
+    const uint8_t *data = packed->data;
+
+    uint32_t count = sqlite3_native__packed_read_uint32(&data[packed->len - 4]);
+    uint32_t index = (uint32_t) (packed->len - 4 - count * 4);
+
+    for (uint32_t j = 0; j < count; j++) {
+      uint32_t row = sqlite3_native__packed_read_uint32(&data[index + j * 4]);
+
+      int columns = (int) sqlite3_native__packed_row_columns(data, row);
+
+      if (n == -1) n = columns;
+
+      if (columns != n || parallel->keys > n) {
+        parallel->error = sqlite3_mprintf("Shards returned rows of different shapes");
+        err = SQLITE_ERROR;
+        break;
+      }
+
+      const uint8_t *cell = sqlite3_native__packed_cell(data, row, parallel->keys);
+
+      size_t key_len = cell - &data[row + 4];
+
+      uint64_t hash = sqlite3_native__hash(&data[row + 4], key_len);
+
+      size_t slot = hash & (capacity - 1);
+
+      sqlite3_native_group_t *group = NULL;
+
+      while (table[slot] != -1) {
+        sqlite3_native_group_t *candidate = &groups[table[slot]];
+
+        const uint8_t *key = &candidate->data[candidate->row + 4];
+
+        if (candidate->hash == hash && (size_t) (sqlite3_native__packed_cell(candidate->data, candidate->row, parallel->keys) - key) == key_len && memcmp(key, &data[row + 4], key_len) == 0) {
+          group = candidate;
+          break;
+        }
+
+        slot = (slot + 1) & (capacity - 1);
+      }
+
+      if (group == NULL) {
+        table[slot] = groups_len;
+
+        group = &groups[groups_len++];
+
+        group->hash = hash;
+        group->row = row;
+        group->data = data;
+        group->integers = calloc(n ? n : 1, sizeof(int64_t));
+        group->reals = calloc(n ? n : 1, sizeof(double));
+        group->types = calloc(n ? n : 1, sizeof(uint8_t));
+      }
+
+      for (int k = parallel->keys; k < n; k++) {
+        uint8_t type = cell[0];
+
+        if (type == sqlite3_native_packed_integer) {
+          int64_t value;
+          memcpy(&value, &cell[1], 8);
+
+          int64_t sum = group->integers[k];
+
+          if (group->types[k] == sqlite3_native_packed_float || (value > 0 && sum > INT64_MAX - value) || (value < 0 && sum < INT64_MIN - value)) {
+            // Fall back to floating point on overflow, like SQLite's total().
+            if (group->types[k] != sqlite3_native_packed_float) group->reals[k] = (double) sum;
+
+            group->types[k] = sqlite3_native_packed_float;
+            group->reals[k] += (double) value;
+          } else {
+            group->types[k] = sqlite3_native_packed_integer;
+            group->integers[k] = sum + value;
+          }
+        } else if (type == sqlite3_native_packed_float) {
+          double value;
+          memcpy(&value, &cell[1], 8);
+
+          if (group->types[k] == sqlite3_native_packed_integer) group->reals[k] = (double) group->integers[k];
+
+          group->types[k] = sqlite3_native_packed_float;
+          group->reals[k] += value;
+        }
+
+        cell += sqlite3_native__packed_cell_len(cell);
+      }
+    }
+  }
+
+  // All groups share the column set of the first row.
+  uint32_t columns = 0;
+
+  if (err == 0 && groups_len > 0) {
+    const uint8_t *data = groups[0].data;
+
+    uint32_t offset = sqlite3_native__packed_read_uint32(&data[groups[0].row]);
+
+    const uint8_t *end = &data[offset + 4];
+
+    for (uint32_t i = 0, m = sqlite3_native__packed_read_uint32(&data[offset]); i < m; i++) {
+      end += 4 + sqlite3_native__packed_read_uint32(end);
+    }
+
+    size_t len = end - &data[offset];
+
+    err = sqlite3_native__packed_reserve(result, len);
+
+    if (err == 0) {
+      columns = (uint32_t) result->len;
+
+      sqlite3_native__packed_append(result, &data[offset], len);
+    }
+  }
+
+  for (size_t i = 0; i < groups_len; i++) {
+    sqlite3_native_group_t *group = &groups[i];
+
+    if (err == 0) {
+      const uint8_t *cell = &group->data[group->row + 4];
+
+      size_t len = 4;
+
+      const uint8_t *next = cell;
+
+      for (int k = 0; k < n; k++) {
+        size_t cell_len = sqlite3_native__packed_cell_len(next);
+
+        len += k < parallel->keys || group->types[k] == 0 ? cell_len : 9;
+
+        next += cell_len;
+      }
+
+      err = sqlite3_native__packed_reserve(result, len);
+
+      if (err == 0) err = sqlite3_native__parallel_append_row(result, (uint32_t) result->len);
+
+      if (err == 0) {
+        sqlite3_native__packed_append_uint32(result, columns);
+
+        for (int k = 0; k < n; k++) {
+          size_t cell_len = sqlite3_native__packed_cell_len(cell);
+
+          if (k < parallel->keys || group->types[k] == 0) {
+            sqlite3_native__packed_append(result, cell, cell_len);
+          } else {
+            uint8_t type = group->types[k];
+
+            sqlite3_native__packed_append(result, &type, 1);
+
+            if (type == sqlite3_native_packed_integer) {
+              sqlite3_native__packed_append(result, &group->integers[k], 8);
+            } else {
+              sqlite3_native__packed_append(result, &group->reals[k], 8);
+            }
+          }
+
+          cell += cell_len;
+        }
+      }
+    }
+
+    free(group->integers);
+    free(group->reals);
+    free(group->types);
+  }
+
+  free(groups);
+  free(table);
+
+  return err;
+}
+
+static void
+sqlite3_native__on_before_merge(uv_work_t *handle) {
+  int err;
+
+  sqlite3_native_parallel_t *parallel = (sqlite3_native_parallel_t *) handle->data;
+
+  for (uint32_t i = 0; i < parallel->len; i++) {
+    sqlite3_native_exec_t *req = &parallel->shards[i].exec;
+
+    if (req->error) {
+      parallel->error = sqlite3_mprintf("%s", req->error);
+      parallel->code = req->code;
+      return;
+    }
+  }
+
+  if (parallel->merge == sqlite3_native_merge_sum) {
+    err = sqlite3_native__parallel_merge_sum(parallel);
+  } else {
+    err = sqlite3_native__parallel_merge_rows(parallel);
+  }
+
+  if (err == 0) err = sqlite3_native__packed_finish(&parallel->result);
+
+  if (err != 0 && parallel->error == NULL) {
+    parallel->error = sqlite3_mprintf("%s", sqlite3_errstr(err));
+    parallel->code = err;
+  }
+}
+
+static void
+sqlite3_native__on_after_merge(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_parallel_t *parallel = (sqlite3_native_parallel_t *) handle->data;
+
+  js_env_t *env = parallel->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (parallel->error) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) parallel->error, -1, &message);
+    assert(err == 0);
+
+    sqlite3_free(parallel->error);
+
+    js_value_t *code;
+    err = js_create_string_utf8(env, (utf8_t *) sqlite3_native__error_code(parallel->code), -1, &code);
+    assert(err == 0);
+
+    err = js_create_error(env, code, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, parallel->deferred, result);
+    assert(err == 0);
+  } else {
+    sqlite3_native_packed_t *packed = &parallel->result;
+
+    err = js_create_external_arraybuffer(env, packed->data, packed->len, sqlite3_native__on_packed_finalize, NULL, &result);
+    assert(err == 0);
+
+    packed->data = NULL;
+
+    err = js_resolve_deferred(env, parallel->deferred, result);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  for (uint32_t i = 0; i < parallel->len; i++) {
+    sqlite3_native_exec_t *req = &parallel->shards[i].exec;
+
+    if (req->error) sqlite3_free(req->error);
+
+    sqlite3_native__packed_destroy(&req->rows_packed);
+  }
+
+  for (int i = 0; i < parallel->params_len; i++) {
+    sqlite3_native__value_free(&parallel->params[i]);
+  }
+
+  sqlite3_native__packed_destroy(&parallel->result);
+
+  free(parallel->shards);
+  free(parallel->params);
+  free(parallel->query);
+  free(parallel->order_name);
+  free(parallel);
+}
+
+static void
+sqlite3_native__on_before_shard(uv_work_t *handle) {
+  int err;
+
+  sqlite3_native_shard_t *shard = (sqlite3_native_shard_t *) handle->data;
+
+  sqlite3_native_exec_t *req = &shard->exec;
+
+  sqlite3 *db = req->db->handle;
+
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+
+  err = sqlite3_native__exec(req);
+
+  if (err == SQLITE_OK) {
+    err = sqlite3_native__packed_finish(&req->rows_packed);
+
+    if (err != SQLITE_OK) req->error = sqlite3_mprintf("%s", sqlite3_errstr(err));
+  }
+
+  if (err != SQLITE_OK && req->error == NULL) {
+    req->error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+
+  if (err != SQLITE_OK) req->code = err;
+
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+}
+
+static void
+sqlite3_native__on_after_shard(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_shard_t *shard = (sqlite3_native_shard_t *) handle->data;
+
+  sqlite3_native_parallel_t *parallel = shard->parallel;
+
+  if (--parallel->pending > 0) return;
+
+  err = uv_queue_work(parallel->loop, &parallel->handle, sqlite3_native__on_before_merge, sqlite3_native__on_after_merge);
+  assert(err == 0);
+}
+
+static js_value_t *
+sqlite3_native_parallel(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 7;
+  js_value_t *argv[7];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 7);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  uint32_t len;
+  err = js_get_array_length(env, argv[0], &len);
+  assert(err == 0);
+
+  size_t query_len;
+  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &query_len);
+  assert(err == 0);
+
+  utf8_t *query = (utf8_t *) malloc(query_len + 1 /* NULL */);
+
+  err = js_get_value_string_utf8(env, argv[1], query, query_len + 1, NULL);
+  assert(err == 0);
+
+  uint32_t params_len = 0;
+
+  bool has_params;
+  err = js_is_array(env, argv[2], &has_params);
+  assert(err == 0);
+
+  if (has_params) {
+    err = js_get_array_length(env, argv[2], &params_len);
+    assert(err == 0);
+  }
+
+  sqlite3_native_value_t *params = malloc((params_len ? params_len : 1) * sizeof(sqlite3_native_value_t));
+
+  for (uint32_t i = 0; i < params_len; i++) {
+    js_value_t *param;
+    err = js_get_element(env, argv[2], i, &param);
+    assert(err == 0);
+
+    sqlite3_native__value_from_js(env, param, &params[i]);
+  }
+
+  sqlite3_native_parallel_t *parallel = malloc(sizeof(sqlite3_native_parallel_t));
+
+  parallel->loop = loop;
+  parallel->env = env;
+  parallel->query = query;
+  parallel->query_len = query_len;
+  parallel->params = params;
+  parallel->params_len = params_len;
+  parallel->order = 0;
+  parallel->order_name = NULL;
+  parallel->len = len;
+  parallel->pending = len;
+  parallel->shards = malloc((len ? len : 1) * sizeof(sqlite3_native_shard_t));
+  parallel->error = NULL;
+  parallel->code = SQLITE_OK;
+
+  parallel->handle.data = (void *) parallel;
+
+  sqlite3_native__packed_init(&parallel->result);
+
+  err = js_get_value_int32(env, argv[3], &parallel->merge);
+  assert(err == 0);
+
+  js_value_type_t type;
+  err = js_typeof(env, argv[4], &type);
+  assert(err == 0);
+
+  if (type == js_string) {
+    size_t name_len;
+    err = js_get_value_string_utf8(env, argv[4], NULL, 0, &name_len);
+    assert(err == 0);
+
+    parallel->order_name = malloc(name_len + 1 /* NULL */);
+
+    err = js_get_value_string_utf8(env, argv[4], (utf8_t *) parallel->order_name, name_len + 1, NULL);
+    assert(err == 0);
+  } else {
+    err = js_get_value_int32(env, argv[4], &parallel->order);
+    assert(err == 0);
+  }
+
+  err = js_get_value_bool(env, argv[5], &parallel->descending);
+  assert(err == 0);
+
+  err = js_get_value_int32(env, argv[6], &parallel->keys);
+  assert(err == 0);
+
+  if (parallel->keys < 0) parallel->keys = 0;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &parallel->deferred, &promise);
+  assert(err == 0);
+
+  if (len == 0) {
+    err = uv_queue_work(loop, &parallel->handle, sqlite3_native__on_before_merge, sqlite3_native__on_after_merge);
+    assert(err == 0);
+
+    return promise;
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    js_value_t *handle;
+    err = js_get_element(env, argv[0], i, &handle);
+    assert(err == 0);
+
+    sqlite3_native_shard_t *shard = &parallel->shards[i];
+
+    sqlite3_native_exec_t *req = &shard->exec;
+
+    err = js_get_arraybuffer_info(env, handle, (void **) &req->db, NULL);
+    assert(err == 0);
+
+    // The shards share the query and parameters, which are only read.
+    req->query = query;
+    req->query_len = query_len;
+    req->params = params;
+    req->params_len = params_len;
+    req->begin = NULL;
+    req->packed = true;
+    req->info = NULL;
+    req->readonly = true;
+    req->wrote = false;
+    req->version = 0;
+    req->result = NULL;
+    req->i = 0;
+    req->error = NULL;
+    req->code = SQLITE_OK;
+
+    sqlite3_native__packed_init(&req->rows_packed);
+
+    shard->parallel = parallel;
+
+    req->handle.data = (void *) shard;
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    sqlite3_native_exec_t *req = &parallel->shards[i].exec;
+
+    err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_shard, sqlite3_native__on_after_shard);
+    assert(err == 0);
+  }
+
+  return promise;
+}
+
+static void
+sqlite3_native__on_serialize_finalize(js_env_t *env, void *data, void *finalize_hint) {
+  sqlite3_free(data);
+}
+
+static void
+sqlite3_native__on_after_serialize(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_serialize_t *req = (sqlite3_native_serialize_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (req->data) {
+    err = js_create_external_arraybuffer(env, req->data, (size_t) req->len, sqlite3_native__on_serialize_finalize, NULL, &result);
+    assert(err == 0);
+  } else {
+    err = js_create_arraybuffer(env, 0, NULL, &result);
+    assert(err == 0);
+  }
+
+  err = js_resolve_deferred(env, req->deferred, result);
+  assert(err == 0);
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  free(req);
+}
+
+static void
+sqlite3_native__on_before_serialize(uv_work_t *handle) {
+  sqlite3_native_serialize_t *req = (sqlite3_native_serialize_t *) handle->data;
+
+  req->data = sqlite3_serialize(req->db->handle, "main", &req->len, 0);
+}
+
+static js_value_t *
+sqlite3_native_serialize(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  sqlite3_native_serialize_t *req = malloc(sizeof(sqlite3_native_serialize_t));
+
+  req->db = db;
+  req->data = NULL;
+  req->len = 0;
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_serialize, sqlite3_native__on_after_serialize);
+  assert(err == 0);
+
+  return promise;
+}
+
+static void
+sqlite3_native__on_after_deserialize(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_deserialize_t *req = (sqlite3_native_deserialize_t *) handle->data;
+
+  sqlite3_native_t *db = req->db;
+
+  js_env_t *env = db->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (req->status != SQLITE_OK) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) sqlite3_errstr(req->status), -1, &message);
+    assert(err == 0);
+
+    err = js_create_error(env, NULL, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, req->deferred, result);
+    assert(err == 0);
+  } else {
+    err = js_get_undefined(env, &result);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+
+  // Without a copy the buffer backs the database and must outlive it.
+  if (req->copy || req->status != SQLITE_OK) {
+    err = js_delete_reference(env, req->buffer);
+    assert(err == 0);
+  } else {
+    if (db->memory) {
+      err = js_delete_reference(env, db->memory);
+      assert(err == 0);
+    }
+
+    db->memory = req->buffer;
+  }
+
+  free(req);
+}
+
+static void
+sqlite3_native__on_before_deserialize(uv_work_t *handle) {
+  sqlite3_native_deserialize_t *req = (sqlite3_native_deserialize_t *) handle->data;
+
+  unsigned char *data = req->data;
+
+  if (req->copy) {
+    data = sqlite3_malloc64(req->len);
+
+    if (data == NULL && req->len > 0) {
+      req->status = SQLITE_NOMEM;
+      return;
+    }
+
+    memcpy(data, req->data, req->len);
+  }
+
+  req->status = sqlite3_deserialize(req->db->handle, "main", data, req->len, req->len, req->flags);
+
+  sqlite3_native__data_changed(req->db);
+}
+
+static js_value_t *
+sqlite3_native_deserialize(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 4;
+  js_value_t *argv[4];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 4);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
+
+  void *data;
+  size_t len;
+  err = js_get_typedarray_info(env, argv[1], NULL, &data, &len, NULL, NULL);
+  assert(err == 0);
+
+  bool copy;
+  err = js_get_value_bool(env, argv[2], &copy);
+  assert(err == 0);
+
+  bool readonly;
+  err = js_get_value_bool(env, argv[3], &readonly);
+  assert(err == 0);
+
+  sqlite3_native_deserialize_t *req = malloc(sizeof(sqlite3_native_deserialize_t));
+
+  req->db = db;
+  req->data = data;
+  req->len = len;
+  req->copy = copy;
+  req->flags = 0;
+  req->status = SQLITE_OK;
+
+  if (copy) req->flags |= SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE;
+  if (readonly) req->flags |= SQLITE_DESERIALIZE_READONLY;
+
+  req->handle.data = (void *) req;
+
+  err = js_create_reference(env, argv[1], 1, &req->buffer);
+  assert(err == 0);
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_deserialize, sqlite3_native__on_after_deserialize);
+  assert(err == 0);
+
+  return promise;
+}
+
+static js_value_t *
+sqlite3_native_backup_init(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 2);
+
+  sqlite3_native_t *src;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &src, NULL);
+  assert(err == 0);
+
+  sqlite3_native_t *dest;
+  err = js_get_arraybuffer_info(env, argv[1], (void **) &dest, NULL);
+  assert(err == 0);
+
+  js_value_t *handle;
+
+  sqlite3_native_backup_t *backup;
+  err = js_create_arraybuffer(env, sizeof(sqlite3_native_backup_t), (void **) &backup, &handle);
+  assert(err == 0);
+
+  backup->src = src;
+  backup->dest = dest;
+  backup->backup = NULL;
+  backup->status = SQLITE_OK;
+  backup->remaining = -1;
+  backup->total = -1;
+  backup->error = NULL;
+
+  return handle;
+}
+
+static void
+sqlite3_native__on_after_backup_step(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_backup_t *req = (sqlite3_native_backup_t *) handle->data;
+
+  js_env_t *env = req->src->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+
+  if (req->error) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) req->error, -1, &message);
+    assert(err == 0);
+
+    free(req->error);
+
+    req->error = NULL;
+
+    err = js_create_error(env, NULL, message, &result);
+    assert(err == 0);
+
+    err = js_reject_deferred(env, req->deferred, result);
+    assert(err == 0);
+  } else {
+    err = js_create_object(env, &result);
+    assert(err == 0);
+
+    js_value_t *done;
+    err = js_get_boolean(env, req->status == SQLITE_DONE, &done);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "done", done);
+    assert(err == 0);
+
+    js_value_t *busy;
+    err = js_get_boolean(env, req->status == SQLITE_BUSY || req->status == SQLITE_LOCKED, &busy);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "busy", busy);
+    assert(err == 0);
+
+    js_value_t *remaining;
+    err = js_create_int32(env, req->remaining, &remaining);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "remaining", remaining);
+    assert(err == 0);
+
+    js_value_t *total;
+    err = js_create_int32(env, req->total, &total);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "total", total);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, req->deferred, result);
+    assert(err == 0);
+  }
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+}
+
+static void
+sqlite3_native__on_before_backup_step(uv_work_t *handle) {
+  int err;
+
+  sqlite3_native_backup_t *req = (sqlite3_native_backup_t *) handle->data;
+
+  sqlite3 *dest = req->dest->handle;
+
+  if (req->backup == NULL) {
+    req->backup = sqlite3_backup_init(dest, "main", req->src->handle, "main");
+
+    if (req->backup == NULL) {
+      req->error = strdup(sqlite3_errmsg(dest));
+      return;
+    }
+  }
+
+  req->status = sqlite3_backup_step(req->backup, req->pages);
+
+  // Backups write the destination without committing through it.
+  sqlite3_native__data_changed(req->dest);
+
+  req->remaining = sqlite3_backup_remaining(req->backup);
+  req->total = sqlite3_backup_pagecount(req->backup);
+
+  switch (req->status) {
+  case SQLITE_OK:
+  case SQLITE_BUSY:
+  case SQLITE_LOCKED:
+    return;
+  }
+
+  err = sqlite3_backup_finish(req->backup);
+
+  req->backup = NULL;
+
+  if (err != SQLITE_OK) req->error = strdup(sqlite3_errmsg(dest));
+}
+
+static js_value_t *
+sqlite3_native_backup_step(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 2;
+  js_value_t *argv[2];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 2);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_backup_t *req;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &req, NULL);
+  assert(err == 0);
+
+  err = js_get_value_int32(env, argv[1], &req->pages);
+  assert(err == 0);
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_backup_step, sqlite3_native__on_after_backup_step);
+  assert(err == 0);
+
+  return promise;
+}
+
+static void
+sqlite3_native__on_after_backup_finish(uv_work_t *handle, int status) {
+  int err;
+
+  sqlite3_native_backup_t *req = (sqlite3_native_backup_t *) handle->data;
+
+  js_env_t *env = req->src->env;
+
+  js_handle_scope_t *scope;
+  err = js_open_handle_scope(env, &scope);
+  assert(err == 0);
+
+  js_value_t *result;
+  err = js_get_undefined(env, &result);
+  assert(err == 0);
+
+  err = js_resolve_deferred(env, req->deferred, result);
+  assert(err == 0);
+
+  err = js_close_handle_scope(env, scope);
+  assert(err == 0);
+}
+
+static void
+sqlite3_native__on_before_backup_finish(uv_work_t *handle) {
+  sqlite3_native_backup_t *req = (sqlite3_native_backup_t *) handle->data;
+
+  // Backups that ran to completion, or failed, have already been finished.
+  if (req->backup == NULL) return;
+
+  sqlite3_backup_finish(req->backup);
+
+  req->backup = NULL;
+}
+
+static js_value_t *
+sqlite3_native_backup_finish(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 1;
+  js_value_t *argv[1];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
+  assert(err == 0);
+
+  assert(argc == 1);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
+  assert(err == 0);
+
+  sqlite3_native_backup_t *req;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &req, NULL);
+  assert(err == 0);
+
+  req->handle.data = (void *) req;
+
+  js_value_t *promise;
+  err = js_create_promise(env, &req->deferred, &promise);
+  assert(err == 0);
+
+  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_backup_finish, sqlite3_native__on_after_backup_finish);
+  assert(err == 0);
+
+  return promise;
+}
+
+enum {
+  sqlite3_native_import_csv = 0,
+  sqlite3_native_import_ndjson = 1,
+};
+
+static sqlite3_native_import_field_t *
+sqlite3_native__import_field(sqlite3_native_import_t *import) {
+  if (import->fields_len == import->fields_capacity) {
+    import->fields_capacity = import->fields_capacity ? import->fields_capacity * 2 : 16;
+    import->fields = realloc(import->fields, import->fields_capacity * sizeof(sqlite3_native_import_field_t));
+  }
+
+  sqlite3_native_import_field_t *field = &import->fields[import->fields_len++];
+
+  field->type = SQLITE_NULL;
+  field->data = NULL;
+  field->offset = 0;
+  field->len = 0;
+  field->key = NULL;
+  field->key_offset = 0;
+  field->key_len = 0;
+
+  return field;
+}
+
+static uint8_t *
+sqlite3_native__import_scratch(sqlite3_native_import_t *import, size_t len) {
+  if (import->scratch_len + len > import->scratch_capacity) {
+    size_t capacity = import->scratch_capacity ? import->scratch_capacity : 4096;
+
+    while (capacity < import->scratch_len + len) capacity *= 2;
+
+    import->scratch = realloc(import->scratch, capacity);
+    import->scratch_capacity = capacity;
+  }
+
+  return &import->scratch[import->scratch_len];
+}
+
+static inline const uint8_t *
+sqlite3_native__import_text(sqlite3_native_import_t *import, const uint8_t *data, size_t offset) {
+  return data ? data : &import->scratch[offset];
+}
+
+// The record parsers return 1 for a complete record, 0 if the record
+// continues past the end of the input, and -1 if the record is malformed.
+
+static int
+sqlite3_native__import_csv(sqlite3_native_import_t *import, const uint8_t *data, size_t len, bool final, size_t *consumed) {
+  size_t i = 0;
+
+  // End of the current line, found once and reused by the unquoted fields
+  // on it. Quoted fields may span lines, so they forget it.
+  size_t line = 0;
+  bool has_line = false;
+
+  import->fields_len = 0;
+  import->scratch_len = 0;
+
+  for (;;) {
+    sqlite3_native_import_field_t *field = sqlite3_native__import_field(import);
+
+    if (i < len && data[i] == '"') {
+      size_t start = ++i;
+
+      bool escaped = false;
+
+      for (;;) {
+        const uint8_t *quote = memchr(&data[i], '"', len - i);
+        if (quote == NULL) return final ? -1 : 0;
+
+        i = quote - data;
+
+        // The quote may be the first half of an escaped quote.
+        if (i + 1 == len && !final) return 0;
+
+        if (i + 1 < len && data[i + 1] == '"') {
+          escaped = true;
+          i += 2;
+          continue;
+        }
+
+        break;
+      }
+
+      field->type = SQLITE_TEXT;
+
+      if (escaped) {
+        uint8_t *text = sqlite3_native__import_scratch(import, i - start);
+
+        size_t n = 0;
+
+        for (size_t j = start; j < i; j++) {
+          text[n++] = data[j];
+
+          if (data[j] == '"') j++;
+        }
+
+        field->offset = import->scratch_len;
+        field->len = n;
+
+        import->scratch_len += n;
+      } else {
+        field->data = &data[start];
+        field->len = i - start;
+      }
+
+      i++;
+
+      has_line = false;
+    } else {
+      if (!has_line || line < i) {
+        const uint8_t *newline = memchr(&data[i], '\n', len - i);
+        if (newline == NULL && !final) return 0;
+
+        line = newline ? (size_t) (newline - data) : len;
+        has_line = true;
+      }
+
+      const uint8_t *comma = memchr(&data[i], ',', line - i);
+
+      size_t start = i;
+      size_t end = comma ? (size_t) (comma - data) : line;
+
+      i = end;
+
+      if (end == line && end > start && data[end - 1] == '\r') end--;
+
+      // Empty unquoted fields are NULL, empty quoted fields are empty strings.
+      if (end > start) {
+        field->type = SQLITE_TEXT;
+        field->data = &data[start];
+        field->len = end - start;
+      }
+    }
+
+    if (i == len) {
+      *consumed = len;
+      return 1;
+    }
+
+    if (data[i] == ',') {
+      i++;
+      continue;
+    }
+
+    if (data[i] == '\r') {
+      if (i + 1 == len) {
+        if (!final) return 0;
+
+        *consumed = len;
+        return 1;
+      }
+
+      i++;
+    }
+
+    if (data[i] == '\n') {
+      *consumed = i + 1;
+      return 1;
+    }
+
+    return -1;
+  }
+}
+
+static inline size_t
+sqlite3_native__import_json_space(const uint8_t *data, size_t i, size_t len) {
+  while (i < len && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r')) i++;
+
+  return i;
+}
+
+static inline bool
+sqlite3_native__import_json_hex(const uint8_t *data, size_t i, size_t len, uint32_t *result) {
+  if (i + 4 > len) return false;
+
+  uint32_t code = 0;
+
+  for (size_t j = i; j < i + 4; j++) {
+    uint8_t c = data[j];
+
+    code <<= 4;
+
+    if (c >= '0' && c <= '9') code |= c - '0';
+    else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+    else return false;
+  }
+
+  *result = code;
+
+  return true;
+}
+
+static inline size_t
+sqlite3_native__import_json_utf8(uint32_t code, uint8_t *result) {
+  if (code < 0x80) {
+    result[0] = (uint8_t) code;
+    return 1;
+  }
+
+  if (code < 0x800) {
+    result[0] = 0xc0 | (code >> 6);
+    result[1] = 0x80 | (code & 0x3f);
+    return 2;
+  }
+
+  if (code < 0x10000) {
+    result[0] = 0xe0 | (code >> 12);
+    result[1] = 0x80 | ((code >> 6) & 0x3f);
+    result[2] = 0x80 | (code & 0x3f);
+    return 3;
+  }
+
+  result[0] = 0xf0 | (code >> 18);
+  result[1] = 0x80 | ((code >> 12) & 0x3f);
+  result[2] = 0x80 | ((code >> 6) & 0x3f);
+  result[3] = 0x80 | (code & 0x3f);
+  return 4;
+}
+
+// Parse the string starting at `data[i]`, returning the index following it or
+// 0 if it is malformed. Strings without escapes point into the input, others
+// are unescaped into the scratch buffer.
+static size_t
+sqlite3_native__import_json_string(sqlite3_native_import_t *import, const uint8_t *data, size_t i, size_t len, const uint8_t **result, size_t *offset, size_t *result_len) {
+  size_t start = ++i;
+
+  const uint8_t *quote = memchr(&data[i], '"', len - i);
+  if (quote == NULL) return 0;
+
+  size_t end = quote - data;
+
+  if (memchr(&data[start], '\\', end - start) == NULL) {
+    *result = &data[start];
+    *result_len = end - start;
+
+    return end + 1;
+  }
+
+  // Unescaping never makes a string longer.
+  uint8_t *text = sqlite3_native__import_scratch(import, len - start);
+
+  size_t n = 0;
+
+  while (i < len) {
+    uint8_t c = data[i++];
+
+    if (c == '"') {
+      *result = NULL;
+      *offset = import->scratch_len;
+      *result_len = n;
+
+      import->scratch_len += n;
+
+      return i;
+    }
+
+    if (c != '\\') {
+      text[n++] = c;
+      continue;
+    }
+
+    if (i == len) return 0;
+
+    switch (data[i++]) {
+    case '"':
+      text[n++] = '"';
+      break;
+    case '\\':
+      text[n++] = '\\';
+      break;
+    case '/':
+      text[n++] = '/';
+      break;
+    case 'b':
+      text[n++] = '\b';
+      break;
+    case 'f':
+      text[n++] = '\f';
+      break;
+    case 'n':
+      text[n++] = '\n';
+      break;
+    case 'r':
+      text[n++] = '\r';
+      break;
+    case 't':
+      text[n++] = '\t';
+      break;
+    case 'u': {
+      uint32_t code;
+      if (!sqlite3_native__import_json_hex(data, i, len, &code)) return 0;
+
+      i += 4;
+
+      if (code >= 0xd800 && code < 0xdc00 && i + 2 <= len && data[i] == '\\' && data[i + 1] == 'u') {
+        uint32_t low;
+
+        if (sqlite3_native__import_json_hex(data, i + 2, len, &low) && low >= 0xdc00 && low < 0xe000) {
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+
+          i += 6;
+        }
+      }
+
+      n += sqlite3_native__import_json_utf8(code, &text[n]);
+      break;
+    }
+    default:
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+static size_t
+sqlite3_native__import_json_value(sqlite3_native_import_t *import, const uint8_t *data, size_t i, size_t len, sqlite3_native_import_field_t *field) {
+  size_t start = i;
+
+  switch (data[i]) {
+  case '"':
+    field->type = SQLITE_TEXT;
+
+    return sqlite3_native__import_json_string(import, data, i, len, &field->data, &field->offset, &field->len);
+
+  case '{':
+  case '[': {
+    // Nested values are stored as their JSON text.
+    int depth = 0;
+
+    while (i < len) {
+      uint8_t c = data[i++];
+
+      if (c == '"') {
+        while (i < len && data[i] != '"') {
+          if (data[i] == '\\') i++;
+          i++;
+        }
+
+        if (i++ >= len) return 0;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        field->type = SQLITE_TEXT;
+        field->data = &data[start];
+        field->len = i - start;
+
+        return i;
+      }
+    }
+
+    return 0;
+  }
+
+  case 't':
+    if (len - i < 4 || memcmp(&data[i], "true", 4) != 0) return 0;
+
+    field->type = SQLITE_INTEGER;
+    field->integer = 1;
+
+    return i + 4;
+
+  case 'f':
+    if (len - i < 5 || memcmp(&data[i], "false", 5) != 0) return 0;
+
+    field->type = SQLITE_INTEGER;
+    field->integer = 0;
+
+    return i + 5;
+
+  case 'n':
+    if (len - i < 4 || memcmp(&data[i], "null", 4) != 0) return 0;
+
+    return i + 4;
+
+  default: {
+    bool real = false;
+
+    while (i < len) {
+      uint8_t c = data[i];
+
+      if (c == '.' || c == 'e' || c == 'E') real = true;
+      else if ((c < '0' || c > '9') && c != '-' && c != '+') break;
+
+      i++;
+    }
+
+    char number[64];
+
+    if (i == start || i - start >= sizeof(number)) return 0;
+
+    memcpy(number, &data[start], i - start);
+
+    number[i - start] = '\0';
+
+    char *end;
+
+    if (!real) {
+      errno = 0;
+
+      field->type = SQLITE_INTEGER;
+      field->integer = strtoll(number, &end, 10);
+
+      if (errno == ERANGE) real = true;
+    }
+
+    if (real) {
+      field->type = SQLITE_FLOAT;
+      field->real = strtod(number, &end);
+    }
+
+    if (*end != '\0') return 0;
+
+    return i;
+  }
+  }
+}
+
+static int
+sqlite3_native__import_ndjson(sqlite3_native_import_t *import, const uint8_t *data, size_t len, bool final, size_t *consumed) {
+  const uint8_t *newline = memchr(data, '\n', len);
+  if (newline == NULL && !final) return 0;
+
+  size_t line = newline ? (size_t) (newline - data) : len;
+
+  *consumed = newline ? line + 1 : len;
+
+  import->fields_len = 0;
+  import->scratch_len = 0;
+
+  size_t i = sqlite3_native__import_json_space(data, 0, line);
+
+  if (i == line) return 1;
+
+  if (data[i] != '{') return -1;
+
+  i = sqlite3_native__import_json_space(data, i + 1, line);
+
+  if (i < line && data[i] == '}') {
+    return sqlite3_native__import_json_space(data, i + 1, line) == line ? 1 : -1;
+  }
+
+  for (;;) {
+    if (i == line || data[i] != '"') return -1;
+
+    sqlite3_native_import_field_t *field = sqlite3_native__import_field(import);
+
+    i = sqlite3_native__import_json_string(import, data, i, line, &field->key, &field->key_offset, &field->key_len);
+    if (i == 0) return -1;
+
+    i = sqlite3_native__import_json_space(data, i, line);
+    if (i == line || data[i] != ':') return -1;
+
+    i = sqlite3_native__import_json_space(data, i + 1, line);
+    if (i == line) return -1;
+
+    i = sqlite3_native__import_json_value(import, data, i, line, field);
+    if (i == 0) return -1;
+
+    i = sqlite3_native__import_json_space(data, i, line);
+    if (i == line) return -1;
+
+    if (data[i] == ',') {
+      i = sqlite3_native__import_json_space(data, i + 1, line);
+      continue;
+    }
+
+    if (data[i] == '}') {
+      return sqlite3_native__import_json_space(data, i + 1, line) == line ? 1 : -1;
+    }
+
+    return -1;
+  }
+}
+
+static void
+sqlite3_native__import_columns(sqlite3_native_import_t *import) {
+  int len = import->fields_len;
+
+  import->columns = malloc((len ? len : 1) * sizeof(char *));
+  import->columns_lens = malloc((len ? len : 1) * sizeof(size_t));
+  import->columns_len = len;
+
+  for (int i = 0; i < len; i++) {
+    sqlite3_native_import_field_t *field = &import->fields[i];
+
+    const uint8_t *name;
+    size_t name_len;
+
+    if (import->format == sqlite3_native_import_ndjson) {
+      name = sqlite3_native__import_text(import, field->key, field->key_offset);
+      name_len = field->key_len;
+    } else {
+      name = sqlite3_native__import_text(import, field->data, field->offset);
+      name_len = field->type == SQLITE_TEXT ? field->len : 0;
+    }
+
+    import->columns[i] = malloc(name_len + 1);
+    import->columns_lens[i] = name_len;
+
+    memcpy(import->columns[i], name, name_len);
+
+    import->columns[i][name_len] = '\0';
+  }
+}
+
+static void
+sqlite3_native__import_prepare_sql(sqlite3_native_import_t *import) {
+  sqlite3_str *sql = sqlite3_str_new(NULL);
+
+  sqlite3_str_appendf(sql, "INSERT INTO \"%w\" (", import->table);
+
+  for (int i = 0; i < import->columns_len; i++) {
+    sqlite3_str_appendf(sql, i ? ", \"%w\"" : "\"%w\"", import->columns[i]);
+  }
+
+  sqlite3_str_appendall(sql, ") VALUES (");
+
+  for (int i = 0; i < import->columns_len; i++) {
+    sqlite3_str_appendall(sql, i ? ", ?" : "?");
+  }
+
+  sqlite3_str_appendall(sql, ")");
+
+  import->sql = sqlite3_str_finish(sql);
+}
+
+static int
+sqlite3_native__import_row(sqlite3_native_import_t *import, sqlite3_stmt *stmt) {
+  int err;
+
+  if (import->format == sqlite3_native_import_csv && import->fields_len != import->columns_len) {
+    import->error = sqlite3_mprintf("Expected %d fields on record %lld, got %d", import->columns_len, import->records, import->fields_len);
+
+    return SQLITE_ERROR;
+  }
+
+  for (int i = 0; i < import->fields_len; i++) {
+    sqlite3_native_import_field_t *field = &import->fields[i];
+
+    int column = i;
+
+    if (import->format == sqlite3_native_import_ndjson) {
+      const uint8_t *key = sqlite3_native__import_text(import, field->key, field->key_offset);
+
+      column = -1;
+
+      for (int j = 0; j < import->columns_len; j++) {
+        if (import->columns_lens[j] == field->key_len && memcmp(import->columns[j], key, field->key_len) == 0) {
+          column = j;
+          break;
+        }
+      }
+
+      if (column == -1) continue; // Not imported
+    }
+
+    switch (field->type) {
+    case SQLITE_INTEGER:
+      sqlite3_bind_int64(stmt, column + 1, field->integer);
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_bind_double(stmt, column + 1, field->real);
+      break;
+    case SQLITE_TEXT:
+      sqlite3_bind_text(stmt, column + 1, (const char *) sqlite3_native__import_text(import, field->data, field->offset), (int) field->len, SQLITE_STATIC);
+      break;
+    }
+  }
+
+  err = sqlite3_step(stmt);
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  return err == SQLITE_DONE ? SQLITE_OK : err;
+}
+
+static int
+sqlite3_native__import(sqlite3_native_import_t *import, sqlite3_native_query_t **query) {
+  int err;
+
+  sqlite3 *db = import->db->handle;
+
+  sqlite3_stmt *stmt = NULL;
+
+  const uint8_t *data = import->data;
+  size_t len = import->len;
+
+  size_t i = 0;
+
+  while (i < len) {
+    if (data[i] == '\n' || data[i] == '\r') {
+      i++;
+      continue;
+    }
+
+    size_t consumed;
+
+    if (import->format == sqlite3_native_import_ndjson) {
+      err = sqlite3_native__import_ndjson(import, &data[i], len - i, import->final, &consumed);
+    } else {
+      err = sqlite3_native__import_csv(import, &data[i], len - i, import->final, &consumed);
+    }
+
+    if (err == 0) break;
+
+    import->records++;
+
+    if (err < 0) {
+      import->error = sqlite3_mprintf("Malformed %s on record %lld", import->format == sqlite3_native_import_ndjson ? "NDJSON" : "CSV", import->records);
+
+      return SQLITE_ERROR;
+    }
+
+    i += consumed;
+
+    if (import->fields_len == 0) continue;
+
+    if (import->header) {
+      import->header = false;
+
+      if (import->columns == NULL) sqlite3_native__import_columns(import);
+
+      continue;
+    }
+
+    if (import->columns == NULL) sqlite3_native__import_columns(import);
+
+    if (import->sql == NULL) sqlite3_native__import_prepare_sql(import);
+
+    if (stmt == NULL) {
+      *query = sqlite3_native__statements_get(import->db, import->sql, strlen(import->sql));
+
+      sqlite3_native_statement_t *statement;
+      err = sqlite3_native__statements_prepare(import->db, *query, 0, &statement);
+      if (err != SQLITE_OK) return err;
+
+      stmt = statement->handle;
+    }
+
+    if (!import->began && sqlite3_get_autocommit(db)) {
+      err = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+      if (err != SQLITE_OK) return err;
+
+      import->began = true;
+    }
+
+    err = sqlite3_native__import_row(import, stmt);
+    if (err != SQLITE_OK) return err;
+
+    import->rows++;
+
+    if (import->began && ++import->pending >= import->batch) {
+      err = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+      if (err != SQLITE_OK) return err;
+
+      sqlite3_native__updates_flush(import->db);
+
+      import->began = false;
+      import->pending = 0;
+    }
+  }
+
+  import->consumed = i;
+
+  if (import->final && import->began) {
+    err = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    if (err != SQLITE_OK) return err;
+
+    sqlite3_native__updates_flush(import->db);
+
+    import->began = false;
+    import->pending = 0;
+  }
+
+  return SQLITE_OK;
+}
+
+static void
+sqlite3_native__import_destroy(sqlite3_native_import_t *import) {
+  for (int i = 0; i < import->columns_len; i++) {
+    free(import->columns[i]);
+  }
+
+  free(import->columns);
+  free(import->columns_lens);
+  free(import->fields);
+  free(import->scratch);
+  free(import->table);
+
+  sqlite3_free(import->sql);
+
+  import->columns = NULL;
+  import->columns_lens = NULL;
+  import->columns_len = 0;
+  import->fields = NULL;
+  import->scratch = NULL;
+  import->table = NULL;
+  import->sql = NULL;
+
+  import->done = true;
 }
 
-static int
-sqlite3_native__on_result(void *arg, int len, char **rows, char **columns) {
+static void
+sqlite3_native__on_before_import(uv_work_t *handle) {
   int err;
 
-  sqlite3_native_exec_t *data = (sqlite3_native_exec_t *) arg;
+  sqlite3_native_import_t *import = (sqlite3_native_import_t *) handle->data;
 
-  data->len = len;
-  data->rows = rows;
-  data->columns = columns;
+  import->error = NULL;
+  import->consumed = 0;
+  import->rows = 0;
 
-  err = js_call_threadsafe_function(data->db->on_result, (void *) data, js_threadsafe_function_blocking);
-  assert(err == 0);
+  if (import->done) return;
 
-  uv_sem_wait(&data->done);
+  sqlite3 *db = import->db->handle;
 
-  return SQLITE_OK;
-}
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
 
-static js_value_t *
-sqlite3_native_init(js_env_t *env, js_callback_info_t *info) {
-  int err;
+  sqlite3_native_query_t *query = NULL;
 
-  js_value_t *handle;
+  err = import->abort ? SQLITE_OK : sqlite3_native__import(import, &query);
 
-  sqlite3_native_t *db;
-  err = js_create_arraybuffer(env, sizeof(sqlite3_native_t), (void **) &db, &handle);
-  assert(err == 0);
+  if (err != SQLITE_OK && import->error == NULL) {
+    import->error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
 
-  db->env = env;
+  if (query && import->db->statements.len > import->db->statements.capacity) {
+    sqlite3_native__statements_remove(import->db, query);
+  }
 
-  err = js_create_threadsafe_function(env, NULL, sqlite3_native__queue_limit, 1, NULL, NULL, (void *) db, sqlite3_native__on_result_call, &db->on_result);
-  assert(err == 0);
+  if ((err != SQLITE_OK || import->abort) && import->began) {
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
 
-  return handle;
+    import->began = false;
+  }
+
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+
+  if (err != SQLITE_OK || import->abort || import->final) sqlite3_native__import_destroy(import);
 }
 
 static void
-sqlite3_native__on_after_open(uv_work_t *handle, int status) {
+sqlite3_native__on_after_import(uv_work_t *handle, int status) {
   int err;
 
-  sqlite3_native_open_t *req = (sqlite3_native_open_t *) handle->data;
-
-  sqlite3_native_t *db = req->db;
+  sqlite3_native_import_t *import = (sqlite3_native_import_t *) handle->data;
 
-  js_env_t *env = db->env;
+  js_env_t *env = import->db->env;
 
   js_handle_scope_t *scope;
   err = js_open_handle_scope(env, &scope);
   assert(err == 0);
 
   js_value_t *result;
-  err = js_get_undefined(env, &result);
-  assert(err == 0);
 
-  err = js_resolve_deferred(env, req->deferred, result);
-  assert(err == 0);
+  if (import->error) {
+    js_value_t *message;
+    err = js_create_string_utf8(env, (utf8_t *) import->error, -1, &message);
+    assert(err == 0);
 
-  err = js_close_handle_scope(env, scope);
-  assert(err == 0);
+    sqlite3_free(import->error);
 
-  free(req);
-}
+    import->error = NULL;
 
-static void
-sqlite3_native__on_before_open(uv_work_t *handle) {
-  int err;
+    err = js_create_error(env, NULL, message, &result);
+    assert(err == 0);
 
-  sqlite3_native_open_t *req = (sqlite3_native_open_t *) handle->data;
+    err = js_reject_deferred(env, import->deferred, result);
+    assert(err == 0);
+  } else {
+    err = js_create_object(env, &result);
+    assert(err == 0);
 
-  err = sqlite3_open_v2((char *) req->name, &req->db->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, req->vfs->name);
+    js_value_t *consumed;
+    err = js_create_int64(env, (int64_t) import->consumed, &consumed);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "consumed", consumed);
+    assert(err == 0);
+
+    js_value_t *rows;
+    err = js_create_int64(env, import->rows, &rows);
+    assert(err == 0);
+
+    err = js_set_named_property(env, result, "rows", rows);
+    assert(err == 0);
+
+    err = js_resolve_deferred(env, import->deferred, result);
+    assert(err == 0);
+  }
+
+  if (import->buffer) {
+    err = js_delete_reference(env, import->buffer);
+    assert(err == 0);
+
+    import->buffer = NULL;
+  }
+
+  err = js_close_handle_scope(env, scope);
   assert(err == 0);
 }
 
 static js_value_t *
-sqlite3_native_open(js_env_t *env, js_callback_info_t *info) {
+sqlite3_native_import_init(js_env_t *env, js_callback_info_t *info) {
   int err;
 
-  size_t argc = 3;
-  js_value_t *argv[3];
+  size_t argc = 6;
+  js_value_t *argv[6];
 
   err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
 
-  assert(argc == 3);
-
-  uv_loop_t *loop;
-  err = js_get_env_loop(env, &loop);
-  assert(err == 0);
+  assert(argc == 6);
 
   sqlite3_native_t *db;
   err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
   assert(err == 0);
 
-  sqlite3_native_vfs_t *vfs;
-  err = js_get_arraybuffer_info(env, argv[1], (void **) &vfs, NULL);
+  size_t table_len;
+  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &table_len);
   assert(err == 0);
 
-  sqlite3_native_path_t name;
-  err = js_get_value_string_utf8(env, argv[2], name, sizeof(name), NULL);
+  char *table = malloc(table_len + 1 /* NULL */);
+
+  err = js_get_value_string_utf8(env, argv[1], (utf8_t *) table, table_len + 1, NULL);
   assert(err == 0);
 
-  sqlite3_native_open_t *req = malloc(sizeof(sqlite3_native_open_t));
+  int32_t format;
+  err = js_get_value_int32(env, argv[3], &format);
+  assert(err == 0);
 
-  req->db = db;
-  req->vfs = vfs;
+  int32_t batch;
+  err = js_get_value_int32(env, argv[4], &batch);
+  assert(err == 0);
 
-  memcpy(req->name, name, sizeof(name));
+  bool header;
+  err = js_get_value_bool(env, argv[5], &header);
+  assert(err == 0);
 
-  req->handle.data = (void *) req;
+  js_value_t *handle;
 
-  js_value_t *promise;
-  err = js_create_promise(env, &req->deferred, &promise);
+  sqlite3_native_import_t *import;
+  err = js_create_arraybuffer(env, sizeof(sqlite3_native_import_t), (void **) &import, &handle);
   assert(err == 0);
 
-  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_open, sqlite3_native__on_after_open);
+  memset(import, 0, sizeof(sqlite3_native_import_t));
+
+  import->db = db;
+  import->table = table;
+  import->format = format;
+  import->batch = batch > 0 ? batch : 1;
+  import->header = header;
+
+  bool has_columns;
+  err = js_is_array(env, argv[2], &has_columns);
   assert(err == 0);
 
-  return promise;
-}
+  if (has_columns) {
+    uint32_t len;
+    err = js_get_array_length(env, argv[2], &len);
+    assert(err == 0);
 
-static void
-sqlite3_native__on_after_close(uv_work_t *handle, int status) {
-  int err;
+    import->columns = malloc((len ? len : 1) * sizeof(char *));
+    import->columns_lens = malloc((len ? len : 1) * sizeof(size_t));
+    import->columns_len = (int) len;
 
-  sqlite3_native_close_t *req = (sqlite3_native_close_t *) handle->data;
+    for (uint32_t i = 0; i < len; i++) {
+      js_value_t *column;
+      err = js_get_element(env, argv[2], i, &column);
+      assert(err == 0);
 
-  sqlite3_native_t *db = req->db;
+      size_t column_len;
+      err = js_get_value_string_utf8(env, column, NULL, 0, &column_len);
+      assert(err == 0);
 
-  js_env_t *env = db->env;
+      import->columns[i] = malloc(column_len + 1 /* NULL */);
+      import->columns_lens[i] = column_len;
 
-  js_handle_scope_t *scope;
-  err = js_open_handle_scope(env, &scope);
+      err = js_get_value_string_utf8(env, column, (utf8_t *) import->columns[i], column_len + 1, NULL);
+      assert(err == 0);
+    }
+  }
+
+  import->handle.data = (void *) import;
+
+  return handle;
+}
+
+static js_value_t *
+sqlite3_native_import(js_env_t *env, js_callback_info_t *info) {
+  int err;
+
+  size_t argc = 3;
+  js_value_t *argv[3];
+
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
 
-  js_value_t *result;
-  err = js_get_undefined(env, &result);
+  assert(argc == 3);
+
+  uv_loop_t *loop;
+  err = js_get_env_loop(env, &loop);
   assert(err == 0);
 
-  err = js_resolve_deferred(env, req->deferred, result);
+  sqlite3_native_import_t *import;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &import, NULL);
   assert(err == 0);
 
-  err = js_close_handle_scope(env, scope);
+  void *data;
+  size_t len;
+  err = js_get_typedarray_info(env, argv[1], NULL, &data, &len, NULL, NULL);
   assert(err == 0);
 
-  err = js_release_threadsafe_function(db->on_result, js_threadsafe_function_release);
+  bool final;
+  err = js_get_value_bool(env, argv[2], &final);
   assert(err == 0);
 
-  free(req);
-}
+  import->data = (const uint8_t *) data;
+  import->len = len;
+  import->final = final;
+  import->abort = false;
 
-static void
-sqlite3_native__on_before_close(uv_work_t *handle) {
-  int err;
+  err = js_create_reference(env, argv[1], 1, &import->buffer);
+  assert(err == 0);
 
-  sqlite3_native_close_t *req = (sqlite3_native_close_t *) handle->data;
+  js_value_t *promise;
+  err = js_create_promise(env, &import->deferred, &promise);
+  assert(err == 0);
 
-  err = sqlite3_close_v2(req->db->handle);
+  err = uv_queue_work(loop, &import->handle, sqlite3_native__on_before_import, sqlite3_native__on_after_import);
   assert(err == 0);
+
+  return promise;
 }
 
 static js_value_t *
-sqlite3_native_close(js_env_t *env, js_callback_info_t *info) {
+sqlite3_native_import_abort(js_env_t *env, js_callback_info_t *info) {
   int err;
 
   size_t argc = 1;
@@ -978,141 +8186,122 @@ sqlite3_native_close(js_env_t *env, js_callback_info_t *info) {
   err = js_get_env_loop(env, &loop);
   assert(err == 0);
 
-  sqlite3_native_t *db;
-  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  sqlite3_native_import_t *import;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &import, NULL);
   assert(err == 0);
 
-  sqlite3_native_close_t *req = malloc(sizeof(sqlite3_native_close_t));
-
-  req->db = db;
-
-  req->handle.data = (void *) req;
+  import->data = NULL;
+  import->len = 0;
+  import->final = true;
+  import->abort = true;
 
   js_value_t *promise;
-  err = js_create_promise(env, &req->deferred, &promise);
+  err = js_create_promise(env, &import->deferred, &promise);
   assert(err == 0);
 
-  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_close, sqlite3_native__on_after_close);
+  err = uv_queue_work(loop, &import->handle, sqlite3_native__on_before_import, sqlite3_native__on_after_import);
   assert(err == 0);
 
   return promise;
 }
 
-static void
-sqlite3_native__on_after_exec(uv_work_t *handle, int status) {
+static js_value_t *
+sqlite3_native_watch(js_env_t *env, js_callback_info_t *info) {
   int err;
 
-  sqlite3_native_exec_t *req = (sqlite3_native_exec_t *) handle->data;
-
-  sqlite3_native_t *db = req->db;
-
-  js_env_t *env = db->env;
+  size_t argc = 3;
+  js_value_t *argv[3];
 
-  js_handle_scope_t *scope;
-  err = js_open_handle_scope(env, &scope);
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
 
-  js_value_t *result;
-
-  if (req->error) {
-    js_value_t *message;
-    err = js_create_string_utf8(env, (utf8_t *) req->error, -1, &message);
-    assert(err == 0);
-
-    sqlite3_free(req->error);
+  assert(argc == 3);
 
-    err = js_create_error(env, NULL, message, &result);
-    assert(err == 0);
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
 
-    err = js_reject_deferred(env, req->deferred, result);
-    assert(err == 0);
-  } else {
-    err = js_get_reference_value(env, req->result, &result);
-    assert(err == 0);
+  bool watching;
+  err = js_get_value_bool(env, argv[1], &watching);
+  assert(err == 0);
 
-    err = js_resolve_deferred(env, req->deferred, result);
+  // Change batches are queued without blocking the committing thread, so the
+  // queue is unbounded.
+  if (watching && db->on_change == NULL) {
+    err = js_create_threadsafe_function(env, argv[2], 0, 1, NULL, NULL, (void *) db, sqlite3_native__on_change_call, &db->on_change);
     assert(err == 0);
   }
 
-  err = js_close_handle_scope(env, scope);
-  assert(err == 0);
-
-  err = js_delete_reference(env, req->result);
-  assert(err == 0);
+  uv_mutex_lock(&db->lock);
+  db->watching = watching;
+  uv_mutex_unlock(&db->lock);
 
-  free(req);
+  return NULL;
 }
 
-static void
-sqlite3_native__on_before_exec(uv_work_t *handle) {
+static js_value_t *
+sqlite3_native_data_version(js_env_t *env, js_callback_info_t *info) {
   int err;
 
-  sqlite3_native_exec_t *req = (sqlite3_native_exec_t *) handle->data;
+  size_t argc = 1;
+  js_value_t *argv[1];
 
-  err = uv_sem_init(&req->done, 0);
+  err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
 
-  sqlite3_exec(req->db->handle, (const char *) req->query, sqlite3_native__on_result, (void *) req, &req->error);
+  assert(argc == 1);
 
-  free(req->query);
+  sqlite3_native_t *db;
+  err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
+  assert(err == 0);
 
-  uv_sem_destroy(&req->done);
+  js_value_t *result;
+  err = js_create_int64(env, (int64_t) sqlite3_native__data_version(db), &result);
+  assert(err == 0);
+
+  return result;
 }
 
 static js_value_t *
-sqlite3_native_exec(js_env_t *env, js_callback_info_t *info) {
+sqlite3_native_statement_cache_stats(js_env_t *env, js_callback_info_t *info) {
   int err;
 
-  size_t argc = 2;
-  js_value_t *argv[2];
+  size_t argc = 1;
+  js_value_t *argv[1];
 
   err = js_get_callback_info(env, info, &argc, argv, NULL, NULL);
   assert(err == 0);
 
-  assert(argc == 2);
-
-  uv_loop_t *loop;
-  err = js_get_env_loop(env, &loop);
-  assert(err == 0);
+  assert(argc == 1);
 
   sqlite3_native_t *db;
   err = js_get_arraybuffer_info(env, argv[0], (void **) &db, NULL);
   assert(err == 0);
 
-  size_t query_len;
-  err = js_get_value_string_utf8(env, argv[1], NULL, 0, &query_len);
-  assert(err == 0);
-
-  query_len += 1 /* NULL */;
-
-  utf8_t *query = (utf8_t *) malloc(query_len);
-
-  err = js_get_value_string_utf8(env, argv[1], query, query_len, NULL);
-  assert(err == 0);
-
   js_value_t *result;
-  err = js_create_array(env, &result);
+  err = js_create_object(env, &result);
   assert(err == 0);
 
-  sqlite3_native_exec_t *req = malloc(sizeof(sqlite3_native_exec_t));
-
-  req->db = db;
-  req->query = query;
-  req->i = 0;
-
-  req->handle.data = (void *) req;
+  uv_mutex_lock(&db->lock);
 
-  err = js_create_reference(env, result, 1, &req->result);
-  assert(err == 0);
+#define V(name, value) \
+  { \
+    js_value_t *val; \
+    err = js_create_int64(env, (int64_t) (value), &val); \
+    assert(err == 0); \
+    err = js_set_named_property(env, result, name, val); \
+    assert(err == 0); \
+  }
 
-  js_value_t *promise;
-  err = js_create_promise(env, &req->deferred, &promise);
-  assert(err == 0);
+  V("capacity", db->statements.capacity)
+  V("size", db->statements.len)
+  V("hits", db->statements.hits)
+  V("misses", db->statements.misses)
+#undef V
 
-  err = uv_queue_work(loop, &req->handle, sqlite3_native__on_before_exec, sqlite3_native__on_after_exec);
-  assert(err == 0);
+  uv_mutex_unlock(&db->lock);
 
-  return promise;
+  return result;
 }
 
 static js_value_t *
@@ -1128,13 +8317,33 @@ sqlite3_native_exports(js_env_t *env, js_value_t *exports) {
     assert(err == 0); \
   }
 
+  V("dispatcherInit", sqlite3_native_dispatcher_init)
   V("vfsInit", sqlite3_native_vfs_init)
   V("vfsDestroy", sqlite3_native_vfs_destroy)
+  V("vfsChangedPagesSince", sqlite3_native_vfs_changed_pages_since)
+  V("vfsCompressionStats", sqlite3_native_vfs_compression_stats)
+
+  V("configurePageCache", sqlite3_native_configure_page_cache)
+  V("pageCacheStats", sqlite3_native_page_cache_stats)
 
   V("init", sqlite3_native_init)
   V("open", sqlite3_native_open)
   V("close", sqlite3_native_close)
   V("exec", sqlite3_native_exec)
+  V("parallel", sqlite3_native_parallel)
+  V("statementCacheStats", sqlite3_native_statement_cache_stats)
+  V("dataVersion", sqlite3_native_data_version)
+  V("watch", sqlite3_native_watch)
+  V("serialize", sqlite3_native_serialize)
+  V("deserialize", sqlite3_native_deserialize)
+  V("backupInit", sqlite3_native_backup_init)
+  V("backupStep", sqlite3_native_backup_step)
+  V("backupFinish", sqlite3_native_backup_finish)
+  V("importInit", sqlite3_native_import_init)
+  V("import", sqlite3_native_import)
+  V("importAbort", sqlite3_native_import_abort)
+  V("createFunction", sqlite3_native_create_function)
+  V("registerTable", sqlite3_native_register_table)
 #undef V
 
   return exports;
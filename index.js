@@ -2,36 +2,413 @@ const ReadyResource = require('ready-resource')
 const binding = require('./binding')
 const VFS = require('./lib/vfs')
 const MemoryVFS = require('./lib/memory-vfs')
+const PackedResult = require('./lib/packed-result')
+const ResultCache = require('./lib/result-cache')
+const Transaction = require('./lib/transaction')
+
+const MERGE_MODES = ['concat', 'sum', 'orderBy']
+const TRANSACTION_MODES = ['deferred', 'immediate', 'exclusive']
 
 module.exports = exports = class SQLite3 extends ReadyResource {
   constructor(opts = {}) {
-    const { name = 'sqlite3.db', vfs = new MemoryVFS() } = opts
+    const {
+      name = 'sqlite3.db',
+      vfs = new MemoryVFS(),
+      statementCacheSize = 100,
+      resultCacheSize = 0,
+      busyTimeout = 5000,
+      preload = false
+    } = opts
 
     super()
 
     this.name = name
 
     this._vfs = vfs
+    this._snapshot = null
+    this._results = resultCacheSize > 0 ? new ResultCache(resultCacheSize) : null
+    this._busyTimeout = busyTimeout
+    this._preload = preload === true ? -1 : preload || 0
+    this._claim = null
+
+    this._handle = binding.init(this, statementCacheSize)
+
+    this._vfs._ref()
+
+    // Only collect row changes while someone is listening for them.
+    this.on('newListener', (name) => {
+      if (name === 'change' && this.listenerCount('change') === 0) {
+        binding.watch(this._handle, true, this._onchange)
+      }
+    })
+
+    this.on('removeListener', (name) => {
+      if (name === 'change' && this.listenerCount('change') === 0) {
+        binding.watch(this._handle, false, null)
+      }
+    })
+  }
+
+  _onchange(changes) {
+    this.emit('change', changes)
+  }
+
+  async exec(query, params = null, opts = {}) {
+    while (this._claim !== null) await this._claim
+
+    return this._exec(query, params, opts, null)
+  }
+
+  async transaction(fn, opts = {}) {
+    const { mode = 'deferred', retries = Infinity, backoff = 10, maxBackoff = 1000 } = opts
+
+    if (TRANSACTION_MODES.includes(mode) === false) {
+      throw new Error(`Unknown transaction mode '${mode}'`)
+    }
+
+    if (this.opened === false) await this.ready()
+
+    const release = await this._acquire()
+
+    const deadline = Date.now() + this._busyTimeout
+
+    try {
+      for (let attempt = 0; ; attempt++) {
+        try {
+          return await new Transaction(this, null, mode)._run(fn)
+        } catch (err) {
+          if (err.code !== 'SQLITE_BUSY' || attempt >= retries || Date.now() >= deadline) throw err
+        }
+
+        await sleep(Math.min(maxBackoff, backoff * 2 ** attempt))
+      }
+    } finally {
+      release()
+    }
+  }
+
+  // Claim the connection for an operation spanning several requests, which
+  // anything else issued in the meantime waits for.
+  async _acquire() {
+    while (this._claim !== null) await this._claim
+
+    let release
+    this._claim = new Promise((resolve) => {
+      release = resolve
+    })
+
+    return () => {
+      this._claim = null
+      release()
+    }
+  }
+
+  async _exec(query, params, opts, begin) {
+    const { packed = false } = opts
+
+    if (this.opened === false) await this.ready()
+
+    // Results can't be served from the cache when the transaction they belong
+    // to must be opened first.
+    const cacheable = this._results !== null && begin === null
+
+    const key = cacheable ? ResultCache.key(query, params, packed) : null
+
+    if (cacheable) {
+      const cached = this._results.get(key, binding.dataVersion(this._handle))
+      if (cached !== undefined) return cached
+    }
+
+    const info = { readonly: false, version: 0, busy: false }
+
+    let result = await this._retry(
+      () => binding.exec(this._handle, query, params, packed, info, begin),
+      () => info.busy
+    )
+
+    if (packed) result = new PackedResult(result)
+
+    if (cacheable && info.readonly) this._results.set(key, result, info.version)
+
+    return result
+  }
+
+  // Locks held by other connections are waited for here, between attempts,
+  // rather than by SQLite on a thread of the shared pool.
+  async _retry(fn, retryable) {
+    const deadline = Date.now() + this._busyTimeout
+
+    for (let attempt = 0; ; attempt++) {
+      try {
+        return await fn()
+      } catch (err) {
+        if (err.code !== 'SQLITE_BUSY' || !retryable() || Date.now() >= deadline) throw err
+      }
+
+      await sleep(Math.min(100, 2 ** attempt))
+    }
+  }
+
+  statementCacheStats() {
+    return binding.statementCacheStats(this._handle)
+  }
+
+  resultCacheStats() {
+    const results = this._results
+
+    if (results === null) return { capacity: 0, size: 0, entries: 0, hits: 0, misses: 0 }
+
+    return {
+      capacity: results.capacity,
+      size: results.size,
+      entries: results.entries,
+      hits: results.hits,
+      misses: results.misses
+    }
+  }
+
+  async function(name, fn, opts = {}) {
+    const { deterministic = false, vectorized = false, batchSize = 256 } = opts
+
+    if (this.opened === false) await this.ready()
+
+    while (this._claim !== null) await this._claim
+
+    const aggregate = typeof fn !== 'function'
+
+    await binding.createFunction(
+      this._handle,
+      name,
+      fn,
+      aggregate,
+      deterministic,
+      vectorized,
+      aggregate ? batchSize : 1
+    )
+  }
+
+  async registerTable(name, opts = {}) {
+    const { columns = {} } = opts
+
+    const names = Object.keys(columns)
+    const arrays = names.map((name) => columns[name])
+
+    if (names.length === 0) throw new Error('At least one column must be provided')
+
+    for (const array of arrays) {
+      if (!ArrayBuffer.isView(array) || array instanceof DataView) {
+        throw new TypeError('Columns must be typed arrays')
+      }
+
+      if (array.length !== arrays[0].length) {
+        throw new RangeError('Columns must have the same length')
+      }
+    }
+
+    if (this.opened === false) await this.ready()
 
-    this._handle = binding.init(this)
+    while (this._claim !== null) await this._claim
+
+    await binding.registerTable(this._handle, name, names, arrays)
+  }
+
+  async serialize() {
+    if (this.opened === false) await this.ready()
+
+    while (this._claim !== null) await this._claim
+
+    return Buffer.from(await binding.serialize(this._handle))
+  }
+
+  async import(table, source, opts = {}) {
+    const { format = 'csv', columns = null, batchSize = 10000 } = opts
+    const { header = format === 'csv' && columns === null } = opts
+
+    if (format !== 'csv' && format !== 'ndjson') throw new Error(`Unknown format '${format}'`)
+
+    // Otherwise the first record would name the columns and be inserted too.
+    if (format === 'csv' && header === false && columns === null) {
+      throw new Error('CSV imports without a header must provide columns')
+    }
+
+    if (this.opened === false) await this.ready()
+
+    const handle = binding.importInit(
+      this._handle,
+      table,
+      columns,
+      format === 'ndjson' ? 1 : 0,
+      batchSize,
+      format === 'csv' && header
+    )
+
+    if (typeof source === 'string') source = Buffer.from(source)
+
+    // Batches are committed across several requests, so hold the connection
+    // until the last of them is done.
+    const release = await this._acquire()
+
+    let rows = 0
+    let done = false
+
+    try {
+      if (ArrayBuffer.isView(source)) {
+        rows += (await binding.import(handle, source, true)).rows
+      } else {
+        // Records may be split across chunks, so carry over whatever was not
+        // consumed and prepend it to the next chunk.
+        let remainder = null
+
+        for await (let chunk of source) {
+          if (typeof chunk === 'string') chunk = Buffer.from(chunk)
+          if (remainder !== null) chunk = Buffer.concat([remainder, chunk])
+
+          const result = await binding.import(handle, chunk, false)
+
+          rows += result.rows
+
+          remainder = result.consumed < chunk.byteLength ? chunk.subarray(result.consumed) : null
+        }
+
+        rows += (await binding.import(handle, remainder || Buffer.alloc(0), true)).rows
+      }
+
+      done = true
+    } finally {
+      // Roll back the open batch however the import ended early.
+      if (done === false) await binding.importAbort(handle)
+
+      release()
+    }
+
+    return rows
   }
 
-  async exec(query) {
+  async backup(dest, opts = {}) {
+    const { pagesPerStep = 64, pauseMs = 0 } = opts
+
     if (this.opened === false) await this.ready()
+    if (dest.opened === false) await dest.ready()
+
+    const handle = binding.backupInit(this._handle, dest._handle)
+
+    try {
+      while (true) {
+        // Other queries may run between steps, but not in the middle of a
+        // transaction on either connection.
+        while (this._claim !== null || dest._claim !== null) {
+          await (this._claim || dest._claim)
+        }
+
+        const { done, busy, remaining, total } = await binding.backupStep(handle, pagesPerStep)
+
+        this.emit('backup', { remaining, total })
 
-    return binding.exec(this._handle, query)
+        if (done) return
+
+        // Give the connection holding the lock a chance to release it before
+        // trying again.
+        if (busy || pauseMs > 0) await new Promise((resolve) => setTimeout(resolve, pauseMs))
+      }
+    } finally {
+      // Release the source and destination however the backup ended, such as
+      // when a listener throws.
+      await binding.backupFinish(handle)
+    }
+  }
+
+  static deserialize(buffer, opts = {}) {
+    const { copy = true, readonly = false } = opts
+
+    const db = new SQLite3(opts)
+
+    db._snapshot = { buffer, copy, readonly }
+
+    return db
+  }
+
+  static async parallel(dbs, query, opts = {}) {
+    const {
+      params = null,
+      merge = 'concat',
+      orderBy = 0,
+      descending = false,
+      keys = 0
+    } = opts
+
+    const mode = MERGE_MODES.indexOf(merge)
+
+    if (mode === -1) throw new Error(`Unknown merge mode '${merge}'`)
+
+    if (dbs.some((db) => db.closing !== null)) throw new Error('Database is closed')
+
+    for (const db of dbs) {
+      if (db.opened === false) await db.ready()
+    }
+
+    // The shards run as a single request, so only issue it once none of the
+    // connections is claimed.
+    let claimed
+    while ((claimed = dbs.find((db) => db._claim !== null)) !== undefined) await claimed._claim
+
+    if (dbs.some((db) => db.closing !== null)) throw new Error('Database is closed')
+
+    // Then claim all of them at once, which also keeps them from closing until
+    // every shard is done.
+    const releases = await Promise.all([...new Set(dbs)].map((db) => db._acquire()))
+
+    try {
+      const handles = dbs.map((db) => db._handle)
+
+      const result = await binding.parallel(handles, query, params, mode, orderBy, descending, keys)
+
+      return new PackedResult(result)
+    } finally {
+      for (const release of releases) release()
+    }
+  }
+
+  static configurePageCache(opts = {}) {
+    const { budget } = opts
+
+    if (!Number.isSafeInteger(budget) || budget < 0) {
+      throw new TypeError('Page cache budget must be a number of bytes')
+    }
+
+    binding.configurePageCache(budget)
+  }
+
+  static pageCacheStats() {
+    return binding.pageCacheStats()
   }
 
   async _open() {
-    await binding.open(this._handle, this._vfs._handle, this.name)
+    await binding.open(this._handle, this._vfs._handle, this.name, this._preload)
+
+    if (this._snapshot !== null) {
+      const { buffer, copy, readonly } = this._snapshot
+
+      this._snapshot = null
+
+      await binding.deserialize(this._handle, buffer, copy, readonly)
+    }
   }
 
   async _close() {
+    while (this._claim !== null) await this._claim
+
     if (this.opened) await binding.close(this._handle)
 
-    this._vfs.destroy()
+    this._vfs._unref()
   }
 }
 
 exports.VFS = VFS
 exports.MemoryVFS = MemoryVFS
+exports.PackedResult = PackedResult
+
+// Back off with jitter so that competing connections don't keep retrying in
+// lockstep.
+function sleep(delay) {
+  return new Promise((resolve) => setTimeout(resolve, delay / 2 + (Math.random() * delay) / 2))
+}
@@ -1,55 +1,151 @@
 const VFS = require('./vfs')
 
-const EMPTY = Buffer.alloc(0)
-
 module.exports = class MemoryVFS extends VFS {
-  _open() {
-    return new MemoryVFSFile()
+  constructor(opts = {}) {
+    const { pageSize = 4096 } = opts
+
+    // Memory files have nothing to sync.
+    super({ sync: false, ...opts })
+
+    this._pageSize = pageSize
+  }
+
+  _open(type) {
+    return new MemoryVFSFile({ pageSize: this._pageSize, main: type === 0 })
   }
 }
 
 class MemoryVFSFile {
-  constructor() {
-    this.buffer = EMPTY
+  constructor(opts = {}) {
+    const { pageSize = 4096, main = false } = opts
+
+    this.pageSize = pageSize
+    this.main = main
+    this.chunks = []
     this.size = 0
   }
 
+  // The page size of the database stored in the file, as recorded in its
+  // header, or 0 if there's no header yet.
+  get databasePageSize() {
+    const header = this.chunks[0]
+    if (header === undefined || header.byteLength < 18) return 0
+
+    const size = header.readUInt16BE(16)
+
+    return size === 1 ? 65536 : size
+  }
+
   pages({ copy = true } = {}) {
     const all = []
-    for (let i = 0; i < this.buffer.byteLength; i += 4096) {
-      const value = this.buffer.subarray(i, i + 4096)
+    for (let i = 0; i < this.chunks.length; i++) {
+      const value = this.chunks[i]
+      if (value === undefined) continue
       all.push({
-        index: i / 4096,
-        value: copy ? Buffer.concat([value]) : value
+        index: i,
+        value: copy ? Buffer.from(value) : value
       })
     }
     return all
   }
 
   read(start, end) {
-    return this.buffer.subarray(start, end)
+    if (end > this.size) end = this.size
+    if (start >= end) return Buffer.alloc(0)
+
+    const i = Math.floor(start / this.pageSize)
+    const offset = i * this.pageSize
+
+    if (end - offset <= this.pageSize) {
+      const chunk = this.chunks[i]
+      if (chunk === undefined) return Buffer.alloc(end - start)
+      if (chunk.byteLength >= end - offset) return chunk.subarray(start - offset, end - offset)
+    }
+
+    const buffer = Buffer.alloc(end - start)
+
+    for (let j = i; j * this.pageSize < end; j++) {
+      const chunk = this.chunks[j]
+      if (chunk === undefined) continue
+
+      const from = Math.max(start - j * this.pageSize, 0)
+      const to = Math.min(end - j * this.pageSize, this.pageSize)
+
+      buffer.set(chunk.subarray(from, to), j * this.pageSize + from - start)
+    }
+
+    return buffer
+  }
+
+  readInto(start, target) {
+    const end = Math.min(start + target.byteLength, this.size)
+    if (start >= end) return 0
+
+    for (let i = Math.floor(start / this.pageSize); i * this.pageSize < end; i++) {
+      const from = Math.max(start - i * this.pageSize, 0)
+      const to = Math.min(end - i * this.pageSize, this.pageSize)
+      const at = i * this.pageSize + from - start
+
+      const chunk = this.chunks[i]
+      const stored = chunk === undefined ? 0 : Math.max(Math.min(chunk.byteLength, to) - from, 0)
+
+      if (stored > 0) target.set(chunk.subarray(from, from + stored), at)
+      if (stored < to - from) target.fill(0, at + stored, at + to - from)
+    }
+
+    return end - start
   }
 
   write(start, buffer) {
     const end = start + buffer.byteLength
 
-    let size = this.buffer.byteLength || 4096
-    while (size < end) size *= 2
+    // Pages of the main database are always written whole, or compressed from
+    // their start, so when they line up with the chunks whatever a write leaves
+    // past its end is stale.
+    const whole = this.main && this.databasePageSize === this.pageSize
+
+    for (let i = Math.floor(start / this.pageSize); i * this.pageSize < end; i++) {
+      const from = Math.max(start - i * this.pageSize, 0)
+      const to = Math.min(end - i * this.pageSize, this.pageSize)
 
-    if (size > this.buffer.byteLength) {
-      const buf = Buffer.alloc(size)
-      buf.set(this.buffer, 0)
-      this.buffer = buf
+      let chunk = this.chunks[i]
+
+      // Chunks only extend as far as the last byte written to them, which
+      // keeps pages stored compressed from taking up a full page.
+      if (chunk === undefined || chunk.byteLength < to) {
+        const grown = Buffer.alloc(to)
+        if (chunk !== undefined) grown.set(chunk)
+        chunk = this.chunks[i] = grown
+      } else if (whole && from === 0 && to < chunk.byteLength) {
+        // A page rewritten compressed to fewer bytes than before shrinks.
+        chunk = this.chunks[i] = Buffer.alloc(to)
+      }
+
+      chunk.set(buffer.subarray(i * this.pageSize + from - start, i * this.pageSize + to - start), from)
     }
+
     if (end > this.size) {
       this.size = end
     }
+  }
+
+  truncate(size) {
+    if (size >= this.size) return
+
+    const last = Math.ceil(size / this.pageSize)
+
+    if (this.chunks.length > last) this.chunks.length = last
+
+    const chunk = this.chunks[last - 1]
+    const from = size - (last - 1) * this.pageSize
+
+    if (chunk !== undefined && from < chunk.byteLength) chunk.fill(0, from)
 
-    this.buffer.set(buffer, start)
+    this.size = size
   }
 
   unlink() {
-    this.buffer = EMPTY
+    this.chunks = []
     this.size = 0
   }
 }
@@ -0,0 +1,136 @@
+const NULL = 0
+const INTEGER = 1
+const FLOAT = 2
+const TEXT = 3
+const BLOB = 4
+
+module.exports = class PackedResult {
+  constructor(buffer) {
+    this.buffer = buffer
+
+    this._view = new DataView(buffer)
+    this._columns = new Map()
+
+    this.length = this._view.getUint32(buffer.byteLength - 4, true)
+
+    this._index = buffer.byteLength - 4 - this.length * 4
+  }
+
+  at(i) {
+    if (i < 0) i += this.length
+    if (i < 0 || i >= this.length) return undefined
+
+    return new PackedRow(this, this._view.getUint32(this._index + i * 4, true))
+  }
+
+  toArray() {
+    const rows = new Array(this.length)
+    for (let i = 0; i < this.length; i++) rows[i] = this.at(i).toObject()
+    return rows
+  }
+
+  *[Symbol.iterator]() {
+    for (let i = 0; i < this.length; i++) yield this.at(i)
+  }
+
+  _columnsAt(start) {
+    let columns = this._columns.get(start)
+    if (columns !== undefined) return columns
+
+    const n = this._view.getUint32(start, true)
+
+    columns = new Array(n)
+
+    let offset = start + 4
+
+    for (let i = 0; i < n; i++) {
+      const len = this._view.getUint32(offset, true)
+      columns[i] = Buffer.from(this.buffer, offset + 4, len).toString()
+      offset += 4 + len
+    }
+
+    this._columns.set(start, columns)
+
+    return columns
+  }
+}
+
+class PackedRow {
+  constructor(result, offset) {
+    this._result = result
+    this._offset = offset
+    this._cells = null
+
+    this.columns = result._columnsAt(result._view.getUint32(offset, true))
+  }
+
+  get length() {
+    return this.columns.length
+  }
+
+  get(i) {
+    if (typeof i === 'string') i = this.columns.indexOf(i)
+    if (i < 0 || i >= this.columns.length) return undefined
+
+    const view = this._result._view
+    const offset = this._cellAt(i)
+
+    switch (view.getUint8(offset)) {
+      case NULL:
+        return null
+      case INTEGER: {
+        const value = view.getBigInt64(offset + 1, true)
+        return value >= Number.MIN_SAFE_INTEGER && value <= Number.MAX_SAFE_INTEGER
+          ? Number(value)
+          : value
+      }
+      case FLOAT:
+        return view.getFloat64(offset + 1, true)
+      case TEXT:
+        return Buffer.from(
+          this._result.buffer,
+          offset + 5,
+          view.getUint32(offset + 1, true)
+        ).toString()
+      case BLOB:
+        return new Uint8Array(this._result.buffer, offset + 5, view.getUint32(offset + 1, true))
+    }
+  }
+
+  toObject() {
+    const row = {}
+    for (let i = 0; i < this.columns.length; i++) row[this.columns[i]] = this.get(i)
+    return row
+  }
+
+  _cellAt(i) {
+    // Cell offsets are only known by walking the preceding cells, so record
+    // them on first access.
+    if (this._cells === null) {
+      const view = this._result._view
+      const cells = new Array(this.columns.length)
+
+      let offset = this._offset + 4
+
+      for (let j = 0; j < cells.length; j++) {
+        cells[j] = offset
+
+        switch (view.getUint8(offset)) {
+          case NULL:
+            offset += 1
+            break
+          case INTEGER:
+          case FLOAT:
+            offset += 9
+            break
+          default:
+            offset += 5 + view.getUint32(offset + 1, true)
+        }
+      }
+
+      this._cells = cells
+    }
+
+    return this._cells[i]
+  }
+}
@@ -0,0 +1,117 @@
+const PackedResult = require('./packed-result')
+
+module.exports = class ResultCache {
+  constructor(capacity) {
+    this.capacity = capacity
+    this.size = 0
+    this.version = -1
+    this.hits = 0
+    this.misses = 0
+
+    this._entries = new Map()
+  }
+
+  get entries() {
+    return this._entries.size
+  }
+
+  get(key, version) {
+    if (version !== this.version) {
+      this.clear()
+      this.version = version
+    }
+
+    const entry = this._entries.get(key)
+
+    if (entry === undefined) {
+      this.misses++
+      return undefined
+    }
+
+    this._entries.delete(key)
+    this._entries.set(key, entry)
+
+    this.hits++
+
+    return entry.result
+  }
+
+  set(key, result, version) {
+    // Results computed against an older version are already stale.
+    if (version !== this.version) return
+
+    const size = sizeOf(result)
+    if (size > this.capacity) return
+
+    const existing = this._entries.get(key)
+
+    if (existing !== undefined) {
+      this._entries.delete(key)
+      this.size -= existing.size
+    }
+
+    while (this.size + size > this.capacity) {
+      const [oldest, entry] = this._entries.entries().next().value
+
+      this._entries.delete(oldest)
+      this.size -= entry.size
+    }
+
+    this._entries.set(key, { result, size })
+    this.size += size
+  }
+
+  clear() {
+    this._entries.clear()
+    this.size = 0
+  }
+
+  static key(query, params, packed) {
+    let key = (packed ? 'p' : 'r') + query.length + ':' + query
+
+    if (params !== null) {
+      for (const param of params) key += ';' + encode(param)
+    }
+
+    return key
+  }
+}
+
+function encode(value) {
+  if (value === null || value === undefined) return 'n'
+
+  switch (typeof value) {
+    case 'number':
+      return 'd' + value
+    case 'bigint':
+      return 'i' + value
+    case 'boolean':
+      return value ? 't' : 'f'
+    case 'string':
+      return 's' + value.length + ':' + value
+  }
+
+  if (ArrayBuffer.isView(value)) {
+    return 'x' + Buffer.from(value.buffer, value.byteOffset, value.byteLength).toString('hex')
+  }
+
+  return 'o' + String(value)
+}
+
+// Estimate the memory held by a result, counting each value as at least the
+// size of a pointer.
+function sizeOf(result) {
+  if (result instanceof PackedResult) return result.buffer.byteLength
+
+  let size = 0
+
+  for (const entry of result) {
+    size += 64
+
+    for (const value of entry.rows) {
+      size += value === null ? 8 : 8 + value.length * 2
+    }
+  }
+
+  return size
+}
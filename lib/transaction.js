@@ -0,0 +1,116 @@
+module.exports = class Transaction {
+  constructor(db, parent = null, mode = 'deferred') {
+    this.db = db
+    this.parent = parent
+    this.root = parent === null ? this : parent.root
+    this.depth = parent === null ? 0 : parent.depth + 1
+    this.mode = mode
+    this.ended = false
+
+    this._begun = false
+    this._opening = null
+  }
+
+  get _savepoint() {
+    return 'tx' + this.depth
+  }
+
+  async exec(query, params = null, opts = {}) {
+    if (this.ended) throw new Error('Transaction has already ended')
+
+    const root = this.root
+
+    // Statements issued before the transaction is open might otherwise run
+    // outside of it, so hold them back until the first one completes.
+    while (root._opening !== null) await root._opening
+
+    const begin = this._begin()
+
+    const result = this.db._exec(query, params, opts, begin)
+
+    if (begin !== null) {
+      root._opening = result.then(noop, noop).then(() => {
+        root._opening = null
+      })
+    }
+
+    return result
+  }
+
+  async transaction(fn) {
+    if (this.ended) throw new Error('Transaction has already ended')
+
+    return new Transaction(this.db, this)._run(fn)
+  }
+
+  async _run(fn) {
+    let result
+
+    try {
+      result = await fn(this)
+    } catch (err) {
+      await this._end()
+      await this._rollback()
+      throw err
+    }
+
+    await this._end()
+
+    if (this._begun) {
+      const commit = this.parent === null ? 'COMMIT;' : `RELEASE ${this._savepoint};`
+
+      try {
+        // Committing may have to wait for readers on other connections, and
+        // is retried as the transaction stays open when it can't go through.
+        await this.db._retry(
+          () => this.db._exec(commit, null, {}, null),
+          () => this.parent === null
+        )
+      } catch (err) {
+        await this._rollback()
+        throw err
+      }
+    }
+
+    return result
+  }
+
+  async _end() {
+    this.ended = true
+
+    while (this.root._opening !== null) await this.root._opening
+  }
+
+  // The statements opening the transaction, and any enclosing ones not yet
+  // open, which are run together with the first query issued through it.
+  _begin() {
+    if (this._begun) return null
+
+    this._begun = true
+
+    const begin =
+      this.parent === null ? `BEGIN ${this.mode.toUpperCase()};` : `SAVEPOINT ${this._savepoint};`
+
+    const outer = this.parent === null ? null : this.parent._begin()
+
+    return outer === null ? begin : outer + begin
+  }
+
+  async _rollback() {
+    if (this._begun === false) return
+
+    const rollback =
+      this.parent === null
+        ? 'ROLLBACK;'
+        : `ROLLBACK TO ${this._savepoint}; RELEASE ${this._savepoint};`
+
+    try {
+      await this.db._exec(rollback, null, {}, null)
+    } catch {
+      // SQLite may already have rolled back the transaction on its own, such
+      // as after running out of memory or disk space.
+    }
+  }
+}
+
+function noop() {}
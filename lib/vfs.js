@@ -1,12 +1,17 @@
 const binding = require('../binding')
 
+// Shared by every VFS, so that however many there are, a single function
+// hands their requests to JavaScript.
+const dispatcher = binding.dispatcherInit()
+
 module.exports = class VFS {
   constructor(opts = {}) {
-    const { open } = opts
+    const { open, readAhead = 0, compress = false, sync = true, truncate = true } = opts
 
     if (open) this._open = open
 
     this._files = [null, null, null]
+    this._refs = 0
 
     this._handle = binding.vfsInit(
       this,
@@ -14,16 +19,41 @@ module.exports = class VFS {
       this._size,
       this._read,
       this._write,
-      this._delete
+      this._delete,
+      this._truncate,
+      this._sync,
+      readAhead,
+      compress,
+      sync,
+      truncate,
+      dispatcher
     )
   }
 
+  // Connections sharing the VFS hold a reference to it, so that it's only
+  // destroyed once the last of them is closed.
+  _ref() {
+    this._refs++
+  }
+
+  _unref() {
+    if (--this._refs === 0) this.destroy()
+  }
+
   destroy() {
     if (this._handle === null) return
     binding.vfsDestroy(this._handle)
     this._handle = null
   }
 
+  changedPagesSince(token = 0) {
+    return binding.vfsChangedPagesSince(this._handle, token)
+  }
+
+  compressionStats() {
+    return binding.vfsCompressionStats(this._handle)
+  }
+
   async _open(type) {}
 
   async _access(type, cb) {
@@ -42,13 +72,13 @@ module.exports = class VFS {
     let file = this._files[type]
     if (file === null) file = this._files[type] = await this._open(type)
 
-    let stored = await file.read(offset, offset + buffer.byteLength)
-    if (stored < buffer.byteLength)
-      stored = Buffer.concat([stored, Buffer.alloc(buffer.byteLength - stored.byteLength)])
+    if (file.readInto) return cb(null, await file.readInto(offset, buffer))
 
-    buffer.set(stored, 0)
+    const stored = await file.read(offset, offset + buffer.byteLength)
 
-    cb(null)
+    buffer.set(stored.subarray(0, buffer.byteLength), 0)
+
+    cb(null, Math.min(stored.byteLength, buffer.byteLength))
   }
 
   async _write(type, arrayBuffer, offset, cb) {
@@ -70,4 +100,18 @@ module.exports = class VFS {
 
     cb(null)
   }
+
+  async _truncate(type, size, cb) {
+    const file = this._files[type]
+    if (file && file.truncate) await file.truncate(size)
+
+    cb(null)
+  }
+
+  async _sync(type, flags, cb) {
+    const file = this._files[type]
+    if (file && file.sync) await file.sync(flags)
+
+    cb(null)
+  }
 }
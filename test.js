@@ -1,5 +1,59 @@
 const test = require('brittle')
-const { create } = require('./test/helpers')
+const SQLite3 = require('.')
+const { create, CountingVFS } = require('./test/helpers')
+
+// Must run before any other test opens a database as the page cache is
+// installed process wide.
+test('shared page cache', async (t) => {
+  await t.exception.all(() => SQLite3.configurePageCache(), TypeError, 'budget is required')
+
+  SQLite3.configurePageCache({ budget: 8 * 1024 * 1024 })
+
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+  await sql.exec("INSERT INTO records (NAME) values ('mathias'), ('andrew');")
+  await sql.exec('SELECT ID, NAME FROM records;')
+
+  const stats = SQLite3.pageCacheStats()
+  t.is(stats.budget, 8 * 1024 * 1024)
+  t.ok(stats.hits > 0)
+  t.ok(stats.used <= stats.budget)
+
+  // A budget of some 150 pages only holds one of two databases of 100 pages
+  // each, so the one in use keeps its pages while the idle one gives them up.
+  SQLite3.configurePageCache({ budget: 640 * 1024 })
+
+  const hot = create(t)
+  const idle = create(t)
+
+  for (const db of [hot, idle]) {
+    await db.exec('CREATE TABLE records (NAME TEXT NOT NULL);')
+    await db.exec(
+      "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) INSERT INTO records (NAME) SELECT printf('%.3000c', 'a') FROM n;"
+    )
+  }
+
+  const scan = async (db) => {
+    const { misses } = SQLite3.pageCacheStats()
+    await db.exec('SELECT SUM(LENGTH(NAME)) FROM records;')
+    return SQLite3.pageCacheStats().misses - misses
+  }
+
+  await scan(idle)
+  await scan(hot)
+
+  const { evictions } = SQLite3.pageCacheStats()
+  t.ok(evictions > 0, 'pages were evicted')
+
+  t.is(await scan(hot), 0, 'the hot database keeps its pages')
+  t.ok((await scan(idle)) >= 50, 'the idle database gave up its pages')
+
+  t.ok(SQLite3.pageCacheStats().evictions > evictions)
+  t.ok(SQLite3.pageCacheStats().used <= 640 * 1024)
+
+  SQLite3.configurePageCache({ budget: 4 * 1024 * 1024 })
+  t.is(SQLite3.pageCacheStats().budget, 4 * 1024 * 1024, 'budget can be updated')
+})
 
 test('can open a db', async (t) => {
   const sql = create(t)
@@ -69,3 +123,1082 @@ test('bigger index', async (t) => {
   t.alike(result[0].columns, ['NAME'])
   t.alike(result[0].rows, ['mr-10'])
 })
+
+test('serialize and deserialize', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+  await sql.exec("INSERT INTO records (NAME) values ('mathias'), ('andrew');")
+
+  const snapshot = await sql.serialize()
+  t.ok(snapshot.byteLength > 0)
+
+  const copy = SQLite3.deserialize(snapshot)
+  t.teardown(() => copy.close())
+
+  await copy.exec("INSERT INTO records (NAME) values ('kasper');")
+  const result = await copy.exec('SELECT NAME FROM records;')
+  t.is(result.length, 3)
+
+  const view = SQLite3.deserialize(snapshot, { copy: false, readonly: true })
+  t.teardown(() => view.close())
+
+  t.is((await view.exec('SELECT NAME FROM records;')).length, 2)
+  await t.exception(view.exec("INSERT INTO records (NAME) values ('kasper');"))
+})
+
+test('backup in steps', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 100; i++) {
+    await sql.exec(`INSERT INTO records (NAME) values ('${Buffer.alloc(512).fill('a')}');`)
+  }
+
+  const dest = create(t)
+
+  let steps = 0
+  sql.on('backup', ({ remaining, total }) => {
+    steps++
+    t.ok(remaining <= total)
+  })
+
+  await sql.backup(dest, { pagesPerStep: 4 })
+  t.ok(steps > 1, 'copied in several steps')
+
+  const result = await dest.exec('SELECT COUNT(*) FROM records;')
+  t.alike(result[0].rows, ['100'])
+})
+
+test('abandoned backup', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 100; i++) {
+    await sql.exec(`INSERT INTO records (NAME) values ('${Buffer.alloc(512).fill('a')}');`)
+  }
+
+  const dest = create(t)
+
+  sql.once('backup', () => {
+    throw new Error('abandoned')
+  })
+
+  await t.exception(sql.backup(dest, { pagesPerStep: 4 }), /abandoned/)
+
+  await sql.exec("INSERT INTO records (NAME) values ('mathias');")
+  await dest.exec('CREATE TABLE others (NAME TEXT);')
+
+  const result = await dest.exec('SELECT name FROM sqlite_schema WHERE name = ?;', ['others'])
+  t.is(result.length, 1, 'destination is usable again')
+})
+
+test('sync is only called when files implement it', async (t) => {
+  const vfs = new CountingVFS({ sync: true })
+
+  const synced = new SQLite3({ vfs })
+  t.teardown(() => synced.close())
+
+  await synced.exec('CREATE TABLE records (NAME TEXT NOT NULL);')
+  t.ok(vfs.syncs > 0, 'synced')
+
+  const unsynced = new CountingVFS()
+
+  const skipped = new SQLite3({ vfs: unsynced })
+  t.teardown(() => skipped.close())
+
+  await skipped.exec('CREATE TABLE records (NAME TEXT NOT NULL);')
+  t.is(unsynced.syncs, 0, 'skipped without a round trip')
+})
+
+test('changed pages since last commit', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 100; i++) {
+    await sql.exec(`INSERT INTO records (NAME) values ('${Buffer.alloc(512).fill('a')}');`)
+  }
+
+  const all = vfs.changedPagesSince(0)
+  t.ok(all.pages.length > 10)
+  t.is(all.pageSize, 4096)
+
+  await sql.exec("INSERT INTO records (NAME) values ('short');")
+
+  const changed = vfs.changedPagesSince(all.token)
+  t.ok(changed.token > all.token)
+  t.ok(changed.pages.length > 0)
+  t.ok(changed.pages.length < all.pages.length, 'only the pages of the last commit')
+
+  t.is(vfs.changedPagesSince(changed.token).pages.length, 0)
+})
+
+test('scalar function', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+  await sql.exec("INSERT INTO records (NAME) values ('mathias'), ('andrew'), ('mathias');")
+
+  let calls = 0
+
+  await sql.function(
+    'shout',
+    (name) => {
+      calls++
+      return name.toUpperCase()
+    },
+    { deterministic: true }
+  )
+
+  const result = await sql.exec('SELECT shout(NAME) FROM records;')
+  t.alike(
+    result.map((entry) => entry.rows[0]),
+    ['MATHIAS', 'ANDREW', 'MATHIAS']
+  )
+  t.is(calls, 2, 'deterministic results are reused')
+
+  await sql.function('fail', () => {
+    throw new Error('boom')
+  })
+
+  await t.exception(sql.exec('SELECT fail();'), /boom/)
+})
+
+test('aggregate function', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, SCORE REAL NOT NULL);')
+
+  for (let i = 1; i <= 1000; i++) {
+    await sql.exec(`INSERT INTO records (SCORE) values (${i});`)
+  }
+
+  await sql.function('sum_scores', {
+    start: 0,
+    step: (sum, score) => sum + score
+  })
+
+  let batches = 0
+
+  await sql.function(
+    'vtotal',
+    {
+      start: () => 0,
+      step(sum, rows) {
+        batches++
+        for (const [score] of rows) sum += score
+        return sum
+      },
+      result: (sum) => sum * 2
+    },
+    { vectorized: true, batchSize: 100 }
+  )
+
+  const result = await sql.exec('SELECT sum_scores(SCORE), vtotal(SCORE) FROM records;')
+  t.alike(result[0].rows, ['500500', '1001000'])
+  t.is(batches, 10)
+})
+
+test('typed array table', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+  await sql.exec("INSERT INTO records (ID, NAME) values (2, 'mathias'), (4, 'andrew');")
+
+  const id = new BigInt64Array(1000)
+  const score = new Float64Array(1000)
+
+  for (let i = 0; i < 1000; i++) {
+    id[i] = BigInt(i)
+    score[i] = i / 2
+  }
+
+  await sql.registerTable('scores', { columns: { id, score } })
+
+  let result = await sql.exec(
+    'SELECT records.NAME, scores.score FROM records JOIN scores ON scores.id = records.ID;'
+  )
+  t.alike(
+    result.map((entry) => entry.rows),
+    [
+      ['mathias', '1.0'],
+      ['andrew', '2.0']
+    ]
+  )
+
+  result = await sql.exec('SELECT COUNT(*) FROM scores WHERE id >= 10 AND id < 20;')
+  t.alike(result[0].rows, ['10'])
+
+  // Modified arrays are picked up by registering them again, which no longer
+  // treats the reversed column as sorted.
+  id.reverse()
+
+  await sql.registerTable('scores', { columns: { id, score } })
+
+  result = await sql.exec('SELECT COUNT(*) FROM scores WHERE id >= 10 AND id < 20;')
+  t.alike(result[0].rows, ['10'])
+
+  result = await sql.exec('SELECT score FROM scores WHERE id = 0;')
+  t.alike(result[0].rows, ['499.5'])
+
+  await t.exception(sql.registerTable('bad', { columns: { id, short: new Int32Array(1) } }))
+})
+
+test('cached statements with parameters', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (const name of ['mathias', 'andrew', 'kasper']) {
+    await sql.exec('INSERT INTO records (NAME) values (?);', [name])
+  }
+
+  const result = await sql.exec('SELECT NAME FROM records WHERE ID > ?;', [1])
+  t.alike(
+    result.map((entry) => entry.rows[0]),
+    ['andrew', 'kasper']
+  )
+
+  const stats = sql.statementCacheStats()
+  t.is(stats.hits, 2, 'insert statement was reused')
+  t.is(stats.size, 3)
+
+  await sql.exec('ALTER TABLE records ADD COLUMN AGE INTEGER;')
+  await sql.exec('INSERT INTO records (NAME) values (?);', ['mafintosh'])
+
+  t.is((await sql.exec('SELECT * FROM records;')).length, 4, 'survives schema changes')
+})
+
+test('packed results', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER, NAME TEXT, SCORE REAL, DATA BLOB);')
+  await sql.exec('INSERT INTO records VALUES (?, ?, ?, ?), (?, ?, ?, ?);', [
+    1,
+    'mathias',
+    1.5,
+    Buffer.from('hello'),
+    2n ** 60n,
+    null,
+    null,
+    null
+  ])
+
+  const result = await sql.exec('SELECT * FROM records; SELECT COUNT(*) AS N FROM records;', null, {
+    packed: true
+  })
+
+  t.is(result.length, 3)
+
+  const row = result.at(0)
+  t.alike(row.columns, ['ID', 'NAME', 'SCORE', 'DATA'])
+  t.is(row.get('NAME'), 'mathias')
+  t.is(row.get(2), 1.5)
+  t.alike(Buffer.from(row.get('DATA')), Buffer.from('hello'))
+
+  t.alike(result.at(1).toObject(), { ID: 2n ** 60n, NAME: null, SCORE: null, DATA: null })
+  t.alike(result.at(-1).toObject(), { N: 2 })
+})
+
+test('parallel queries across shards', async (t) => {
+  const shards = []
+
+  for (let i = 0; i < 3; i++) {
+    const sql = create(t)
+    await sql.exec('CREATE TABLE records (ID INTEGER, KIND TEXT);')
+
+    for (let j = 0; j < 4; j++) {
+      await sql.exec('INSERT INTO records VALUES (?, ?);', [j * 3 + i, j % 2 ? 'odd' : 'even'])
+    }
+
+    shards.push(sql)
+  }
+
+  const all = await SQLite3.parallel(shards, 'SELECT ID FROM records;')
+  t.is(all.length, 12)
+
+  const ordered = await SQLite3.parallel(shards, 'SELECT ID FROM records ORDER BY ID DESC;', {
+    merge: 'orderBy',
+    orderBy: 'ID',
+    descending: true
+  })
+
+  t.alike(ordered.toArray().map((row) => row.ID), [11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0])
+
+  const counts = await SQLite3.parallel(
+    shards,
+    'SELECT KIND, COUNT(*) AS N, SUM(ID) AS TOTAL FROM records WHERE ID > ? GROUP BY KIND;',
+    { params: [0], merge: 'sum', keys: 1 }
+  )
+
+  t.alike(counts.toArray(), [
+    { KIND: 'even', N: 5, TOTAL: 1 + 2 + 6 + 7 + 8 },
+    { KIND: 'odd', N: 6, TOTAL: 3 + 4 + 5 + 9 + 10 + 11 }
+  ])
+  await t.exception(
+    SQLite3.parallel(shards, 'SELECT * FROM missing;'),
+    (err) => err.code === 'SQLITE_ERROR'
+  )
+
+  const closing = shards.pop()
+  const closed = closing.close()
+
+  await t.exception(SQLite3.parallel([...shards, closing], 'SELECT 1;'), /closed/)
+  await closed
+})
+
+test('import csv and ndjson', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER, NAME TEXT, TAGS TEXT);')
+
+  async function* chunks() {
+    yield 'ID,NAME,TAGS\n1,mathias,\n2,"andrew, ""the"" '
+    yield 'maintainer",\n'
+    yield '3,kasper,x'
+  }
+
+  t.is(await sql.import('records', chunks(), { batchSize: 2 }), 3)
+
+  t.is(
+    await sql.import('records', '{"ID": 4, "NAME": "mafintosh", "TAGS": ["a"], "EXTRA": true}\n', {
+      format: 'ndjson'
+    }),
+    1
+  )
+
+  const result = await sql.exec('SELECT ID, NAME, TAGS, typeof(ID) AS T FROM records;')
+  t.alike(
+    result.map((entry) => entry.rows),
+    [
+      ['1', 'mathias', null, 'integer'],
+      ['2', 'andrew, "the" maintainer', null, 'integer'],
+      ['3', 'kasper', 'x', 'integer'],
+      ['4', 'mafintosh', '["a"]', 'integer']
+    ]
+  )
+
+  await t.exception(sql.import('records', 'ID,NAME\n5,a,b\n'), /Expected 2 fields/)
+  t.alike((await sql.exec('SELECT COUNT(*) FROM records;'))[0].rows, ['4'], 'rolled back')
+
+  await t.exception(sql.import('records', '5,andrew\n', { header: false }), /must provide columns/)
+})
+
+test('import holds the connection until it ends', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER, NAME TEXT);')
+
+  const order = []
+
+  async function* chunks() {
+    yield 'ID,NAME\n1,mathias\n'
+    await new Promise((resolve) => setTimeout(resolve, 10))
+    order.push('chunk')
+    yield '2,andrew\n'
+    throw new Error('source failed')
+  }
+
+  await Promise.all([
+    t.exception(sql.import('records', chunks(), { batchSize: 10 }), /source failed/),
+    sql.exec('SELECT COUNT(*) FROM records;').then(([{ rows }]) => order.push('exec ' + rows[0]))
+  ])
+
+  t.alike(order, ['chunk', 'exec 0'], 'exec waited for the import to roll back')
+
+  await sql.exec('BEGIN; ROLLBACK;')
+})
+
+test('cached results', async (t) => {
+  const sql = new SQLite3({ resultCacheSize: 1024 * 1024 })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (NAME TEXT NOT NULL);')
+  await sql.exec('INSERT INTO records (NAME) values (?);', ['mathias'])
+
+  const first = await sql.exec('SELECT NAME FROM records WHERE NAME = ?;', ['mathias'])
+  const second = await sql.exec('SELECT NAME FROM records WHERE NAME = ?;', ['mathias'])
+
+  t.is(first, second, 'served from the cache')
+
+  await sql.exec('INSERT INTO records (NAME) values (?);', ['mathias'])
+
+  const third = await sql.exec('SELECT NAME FROM records WHERE NAME = ?;', ['mathias'])
+  t.is(third.length, 2, 'invalidated by commits')
+
+  await sql.exec('BEGIN;')
+  await sql.exec('ROLLBACK;')
+  await sql.exec('BEGIN;')
+  await sql.exec('ROLLBACK;')
+
+  const stats = sql.resultCacheStats()
+  t.is(stats.hits, 1)
+  t.is(stats.entries, 1)
+})
+
+test('cached results within a transaction', async (t) => {
+  const sql = new SQLite3({ resultCacheSize: 1024 * 1024 })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (NAME TEXT NOT NULL);')
+
+  const count = async () => (await sql.exec('SELECT COUNT(*) FROM records;'))[0].rows[0]
+  const tables = async () => (await sql.exec('SELECT name FROM sqlite_schema;')).length
+
+  await sql.exec('BEGIN;')
+
+  t.is(await count(), '0')
+  t.is(await tables(), 1)
+
+  await sql.exec('CREATE TABLE others (NAME TEXT);')
+  t.is(await tables(), 2, 'uncommitted tables are seen')
+
+  await sql.exec("INSERT INTO records (NAME) values ('mathias');")
+  t.is(await count(), '1', 'uncommitted rows are seen')
+
+  await sql.exec('ROLLBACK;')
+
+  t.is(await count(), '0', 'rolled back rows are gone')
+  t.is(await tables(), 1, 'rolled back tables are gone')
+})
+
+test('cached results after registering tables and functions', async (t) => {
+  const sql = new SQLite3({ resultCacheSize: 1024 * 1024 })
+  t.teardown(() => sql.close())
+
+  await sql.registerTable('scores', { columns: { score: new Float64Array([1, 2]) } })
+
+  const total = async () => (await sql.exec('SELECT SUM(score) FROM scores;'))[0].rows[0]
+
+  t.is(await total(), '3.0')
+
+  await sql.registerTable('scores', { columns: { score: new Float64Array([3, 4]) } })
+  t.is(await total(), '7.0', 'invalidated by registering the table again')
+
+  await sql.function('greet', () => 'hello')
+
+  const greet = async () => (await sql.exec('SELECT greet();'))[0].rows[0]
+
+  t.is(await greet(), 'hello')
+
+  await sql.function('greet', () => 'hi')
+  t.is(await greet(), 'hi', 'invalidated by defining the function again')
+})
+
+test('transactions', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  const result = await sql.transaction(async (tx) => {
+    await tx.exec("INSERT INTO records (ID, NAME) values (1, 'mathias');")
+
+    await tx.transaction(async (tx) => {
+      await tx.exec("INSERT INTO records (ID, NAME) values (2, 'andrew');")
+    })
+
+    await t.exception(
+      tx.transaction(async (tx) => {
+        await tx.exec("INSERT INTO records (ID, NAME) values (3, 'kasper');")
+        throw new Error('rolled back')
+      }),
+      /rolled back/
+    )
+
+    return 'done'
+  })
+
+  t.is(result, 'done')
+
+  await t.exception(
+    sql.transaction(async (tx) => {
+      await tx.exec("INSERT INTO records (ID, NAME) values (4, 'mafintosh');")
+      await tx.exec("INSERT INTO records (ID, NAME) values (1, 'mathias');")
+    }),
+    (err) => err.code === 'SQLITE_CONSTRAINT'
+  )
+
+  const rows = await sql.exec('SELECT ID FROM records;')
+  t.alike(
+    rows.map((row) => row.rows[0]),
+    ['1', '2']
+  )
+
+  // Queries outside of a transaction wait for it to end.
+  const order = []
+
+  await Promise.all([
+    sql.transaction(async (tx) => {
+      await tx.exec("INSERT INTO records (ID, NAME) values (5, 'andrew');")
+      await new Promise((resolve) => setTimeout(resolve, 10))
+      order.push('transaction')
+    }),
+    sql.exec('SELECT ID FROM records;').then(() => order.push('exec'))
+  ])
+
+  t.alike(order, ['transaction', 'exec'])
+
+  // As do other operations on the connection.
+  order.length = 0
+
+  await Promise.all([
+    sql.transaction(async (tx) => {
+      await tx.exec("INSERT INTO records (ID, NAME) values (6, 'kasper');")
+      await new Promise((resolve) => setTimeout(resolve, 10))
+      order.push('transaction')
+    }),
+    sql.serialize().then(() => order.push('serialize')),
+    sql.function('double', (n) => n * 2).then(() => order.push('function'))
+  ])
+
+  t.alike(order, ['transaction', 'serialize', 'function'])
+})
+
+test('transactions across connections sharing a vfs', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const a = new SQLite3({ vfs })
+  t.teardown(() => a.close())
+
+  const b = new SQLite3({ vfs })
+  t.teardown(() => b.close())
+
+  await a.exec('CREATE TABLE counter (N INTEGER NOT NULL); INSERT INTO counter (N) values (0);')
+
+  const increment = (sql) =>
+    sql.transaction(
+      async (tx) => {
+        const [{ rows }] = await tx.exec('SELECT N FROM counter;')
+        await tx.exec('UPDATE counter SET N = ?;', [Number(rows[0]) + 1])
+      },
+      { mode: 'immediate' }
+    )
+
+  const writes = []
+
+  for (let i = 0; i < 10; i++) writes.push(increment(a), increment(b))
+
+  await Promise.all(writes)
+
+  const [{ rows }] = await b.exec('SELECT N FROM counter;')
+  t.is(rows[0], '20')
+})
+
+test('transactions across more connections than pool threads', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const dbs = []
+
+  for (let i = 0; i < 16; i++) {
+    const sql = new SQLite3({ vfs, busyTimeout: 2000 })
+    t.teardown(() => sql.close())
+    dbs.push(sql)
+  }
+
+  await dbs[0].exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  // Waiting for the lock mustn't take up the threads that the connection
+  // holding it needs to finish its transaction, or the transactions would
+  // stall until the busy timeout rejects them.
+  await Promise.all(
+    dbs.map((sql, i) =>
+      sql.transaction(
+        async (tx) => {
+          await tx.exec('INSERT INTO records (ID, NAME) values (?, ?);', [i, 'record'])
+          await new Promise((resolve) => setTimeout(resolve, 5))
+        },
+        { mode: 'immediate' }
+      )
+    )
+  )
+
+  const [{ rows }] = await dbs[15].exec('SELECT COUNT(*) FROM records;')
+  t.is(rows[0], '16')
+})
+
+test('change notifications', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  const batches = []
+  sql.on('change', (changes) => batches.push(changes))
+
+  await sql.exec("INSERT INTO records (ID, NAME) values (1, 'mathias'), (2, 'andrew');")
+
+  await sql.exec('BEGIN;')
+  await sql.exec("UPDATE records SET NAME = 'kasper' WHERE ID = 2;")
+  await sql.exec('DELETE FROM records WHERE ID = 1;')
+  await sql.exec('COMMIT;')
+
+  await sql.exec('BEGIN;')
+  await sql.exec("INSERT INTO records (ID, NAME) values (3, 'mafintosh');")
+  await sql.exec('ROLLBACK;')
+
+  await new Promise((resolve) => setImmediate(resolve))
+
+  t.alike(batches, [
+    [
+      { table: 'records', op: 'insert', rowid: 1 },
+      { table: 'records', op: 'insert', rowid: 2 }
+    ],
+    [
+      { table: 'records', op: 'update', rowid: 2 },
+      { table: 'records', op: 'delete', rowid: 1 }
+    ]
+  ])
+})
+
+test('change notifications leave out changes rolled back to a savepoint', async (t) => {
+  const sql = create(t)
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  const batches = []
+  sql.on('change', (changes) => batches.push(changes))
+
+  await sql.transaction(async (tx) => {
+    await tx.exec("INSERT INTO records (ID, NAME) values (1, 'mathias');")
+
+    await t.exception(
+      tx.transaction(async (tx) => {
+        await tx.exec("INSERT INTO records (ID, NAME) values (2, 'andrew');")
+        throw new Error('rolled back')
+      }),
+      /rolled back/
+    )
+
+    await tx.transaction(async (tx) => {
+      await tx.exec("INSERT INTO records (ID, NAME) values (3, 'kasper');")
+    })
+  })
+
+  await sql.exec(
+    "SAVEPOINT a; INSERT INTO records (ID, NAME) values (4, 'mafintosh'); ROLLBACK TO a; RELEASE a;"
+  )
+
+  await new Promise((resolve) => setImmediate(resolve))
+
+  t.alike(batches, [
+    [
+      { table: 'records', op: 'insert', rowid: 1 },
+      { table: 'records', op: 'insert', rowid: 3 }
+    ]
+  ])
+})
+
+test('change notifications wait for the commit to go through', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const a = new SQLite3({ vfs })
+  t.teardown(() => a.close())
+
+  const b = new SQLite3({ vfs })
+  t.teardown(() => b.close())
+
+  await a.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  const batches = []
+  b.on('change', (changes) => batches.push(changes))
+
+  // Keep a reader on the database so that the commit can't go through.
+  await a.exec('BEGIN; SELECT * FROM records;')
+
+  await b.exec('BEGIN;')
+  await b.exec("INSERT INTO records (ID, NAME) values (1, 'mathias');")
+
+  await t.exception(b.exec('COMMIT;'), (err) => err.code === 'SQLITE_BUSY')
+
+  await new Promise((resolve) => setImmediate(resolve))
+
+  t.alike(batches, [])
+
+  await a.exec('COMMIT;')
+  await b.exec('COMMIT;')
+
+  await new Promise((resolve) => setImmediate(resolve))
+
+  t.alike(batches, [[{ table: 'records', op: 'insert', rowid: 1 }]])
+})
+
+test('concurrent connections sharing a vfs', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const a = new SQLite3({ vfs })
+  t.teardown(() => a.close())
+
+  await a.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 100; i++) {
+    await a.exec('INSERT INTO records (NAME) values (?);', ['record ' + i])
+  }
+
+  const b = new SQLite3({ vfs })
+  t.teardown(() => b.close())
+
+  const queries = []
+
+  for (let i = 0; i < 20; i++) {
+    queries.push(a.exec('SELECT NAME FROM records WHERE ID = ?;', [i + 1]))
+    queries.push(b.exec('SELECT NAME FROM records WHERE ID = ?;', [i + 1]))
+  }
+
+  const results = await Promise.all(queries)
+
+  t.alike(
+    results.map((result) => result[0].rows[0]),
+    queries.map((_, i) => 'record ' + Math.floor(i / 2))
+  )
+})
+
+test('closing one connection keeps a shared vfs usable', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const a = new SQLite3({ vfs })
+  const b = new SQLite3({ vfs })
+  t.teardown(() => b.close())
+
+  await a.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+  await b.exec("INSERT INTO records (ID, NAME) values (1, 'mathias');")
+
+  await a.close()
+
+  await b.exec("INSERT INTO records (ID, NAME) values (2, 'andrew');")
+  await b.exec('PRAGMA shrink_memory;')
+
+  const result = await b.exec('SELECT NAME FROM records ORDER BY ID;')
+  t.alike(result.map(({ rows }) => rows[0]), ['mathias', 'andrew'])
+})
+
+test('read ahead on sequential reads', async (t) => {
+  async function scan(readAhead) {
+    const vfs = new CountingVFS({ readAhead })
+
+    const sql = new SQLite3({ vfs })
+    t.teardown(() => sql.close())
+
+    await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+    for (let i = 0; i < 200; i++) {
+      await sql.exec('INSERT INTO records (NAME) values (?);', [Buffer.alloc(512).fill('a').toString()])
+    }
+
+    await sql.exec('PRAGMA shrink_memory;')
+
+    vfs.reads = 0
+
+    const result = await sql.exec('SELECT COUNT(*) FROM records WHERE NAME IS NOT NULL;')
+    t.alike(result[0].rows, ['200'])
+
+    return vfs.reads
+  }
+
+  const slow = await scan(0)
+  const fast = await scan(16)
+
+  t.ok(fast < slow, `${fast} reads with read ahead, ${slow} without`)
+})
+
+test('preload the database on open', async (t) => {
+  const vfs = new CountingVFS()
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 200; i++) {
+    await sql.exec('INSERT INTO records (NAME) values (?);', [Buffer.alloc(512).fill('a').toString()])
+  }
+
+  vfs.reads = 0
+
+  const preloaded = new SQLite3({ vfs, preload: true })
+  t.teardown(() => preloaded.close())
+
+  const result = await preloaded.exec('SELECT COUNT(*) FROM records WHERE NAME IS NOT NULL;')
+  t.alike(result[0].rows, ['200'])
+
+  t.is(vfs.reads, 1, 'read in a single request')
+
+  await sql.exec('DELETE FROM records WHERE ID > 100;')
+
+  const changed = await preloaded.exec('SELECT COUNT(*) FROM records;')
+  t.alike(changed[0].rows, ['100'], 'sees changes made after the preload')
+})
+
+test('preload fails to open an unreadable database', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const file = (vfs._files[0] = vfs._open(0))
+  file.write(0, Buffer.alloc(4096).fill('not a database'))
+
+  // The connection never opens, so only the VFS is left to clean up.
+  t.teardown(() => vfs.destroy())
+
+  const sql = new SQLite3({ vfs, preload: true })
+
+  await t.exception(sql.ready(), (err) => err.code === 'SQLITE_NOTADB')
+})
+
+test('preload opens a database locked by another connection', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+  await sql.exec('BEGIN EXCLUSIVE;')
+  await sql.exec("INSERT INTO records (ID, NAME) values (1, 'mathias');")
+
+  const preloaded = new SQLite3({ vfs, preload: true })
+  t.teardown(() => preloaded.close())
+
+  await preloaded.ready()
+
+  await sql.exec('COMMIT;')
+
+  const result = await preloaded.exec('SELECT NAME FROM records;')
+  t.alike(result[0].rows, ['mathias'])
+})
+
+test('vfs reads into sqlite buffers', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  let reads = 0
+
+  const open = vfs._open
+  vfs._open = function (type) {
+    const file = open.call(this, type)
+    const readInto = file.readInto
+
+    file.read = () => t.fail('read() should not be called')
+    file.readInto = function (start, buffer) {
+      reads++
+      return readInto.call(this, start, buffer)
+    }
+
+    return file
+  }
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (NAME TEXT NOT NULL);')
+  await sql.exec('INSERT INTO records (NAME) values (?);', ['mathias'])
+  await sql.exec('PRAGMA shrink_memory;')
+
+  const result = await sql.exec('SELECT NAME FROM records;')
+  t.alike(result[0].rows, ['mathias'])
+  t.ok(reads > 0)
+})
+
+test('memory vfs stores pages in chunks', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+  await sql.exec("INSERT INTO records (NAME) values ('mathias'), ('andrew');")
+
+  const file = vfs._files[0]
+  const pages = file.pages({ copy: false })
+
+  t.is(pages.length, file.size / 4096)
+  t.is(pages[0].value.byteLength, 4096)
+  t.is(pages[0].value.subarray(0, 15).toString(), 'SQLite format 3')
+  t.is(pages[0].value.buffer, file.chunks[0].buffer, 'no copy')
+})
+
+test('compressed pages', async (t) => {
+  const vfs = new SQLite3.MemoryVFS({ compress: true })
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 100; i++) {
+    await sql.exec(`INSERT INTO records (NAME) values ('${Buffer.alloc(512).fill('a' + i)}');`)
+  }
+
+  const stats = vfs.compressionStats()
+  t.is(stats.pageSize, 4096)
+  t.ok(stats.compressed > 0)
+  t.ok(stats.stored < stats.bytes / 2)
+
+  const file = vfs._files[0]
+  const stored = file.chunks.reduce((size, chunk) => size + chunk.byteLength, 0)
+  t.ok(stored < file.size / 2, 'chunks only hold the compressed pages')
+
+  const other = new SQLite3({ vfs })
+  t.teardown(() => other.close())
+
+  const result = await other.exec('SELECT COUNT(*), SUM(LENGTH(NAME)) FROM records;')
+  t.alike(result[0].rows, ['100', String(100 * 512)])
+})
+
+test('compressed pages shrink when rewritten', async (t) => {
+  const vfs = new SQLite3.MemoryVFS({ compress: true })
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  // Random names hardly compress, so their pages take up most of a chunk.
+  for (let i = 0; i < 100; i++) {
+    await sql.exec('INSERT INTO records (NAME) values (hex(randomblob(256)));')
+  }
+
+  const file = vfs._files[0]
+  const footprint = () => file.chunks.reduce((size, chunk) => size + chunk.byteLength, 0)
+
+  const before = footprint()
+
+  await sql.exec("UPDATE records SET NAME = printf('%.512c', 'a');")
+
+  t.ok(footprint() < before / 2, 'chunks shrink with their pages')
+
+  const result = await sql.exec('SELECT COUNT(*), SUM(LENGTH(NAME)) FROM records;')
+  t.alike(result[0].rows, ['100', String(100 * 512)])
+})
+
+test('compressed pages through files that never shrink', async (t) => {
+  const files = new Map()
+
+  // Writes land in place without truncating anything past them, so the tails
+  // of pages that compressed worse before are left behind.
+  const open = (type) => {
+    if (!files.has(type)) files.set(type, new BufferFile())
+    return files.get(type)
+  }
+
+  const vfs = new SQLite3.VFS({ open, compress: true })
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+
+  // Names made of pseudo random characters hardly compress.
+  let seed = 1
+  const noise = (n) => {
+    let result = ''
+    for (let i = 0; i < n; i++) {
+      seed = (Math.imul(seed, 1103515245) + 12345) >>> 0
+      result += String.fromCharCode(33 + ((seed >>> 16) % 94))
+    }
+    return result
+  }
+
+  const names = []
+
+  for (let i = 0; i < 200; i++) {
+    const name =
+      i % 3 === 0 ? 'a'.repeat(300) : i % 3 === 1 ? noise(300) : 'x'.repeat(i) + noise(20)
+
+    names.push(name)
+
+    await sql.exec('INSERT INTO records (ID, NAME) values (?, ?);', [i, name])
+  }
+
+  for (let i = 1; i < 200; i += 3) {
+    names[i] = 'y'.repeat(300)
+
+    await sql.exec('UPDATE records SET NAME = ? WHERE ID = ?;', [names[i], i])
+  }
+
+  // A new VFS knows nothing about how the pages were stored, and so reads
+  // each of them in full.
+  const other = new SQLite3({ vfs: new SQLite3.VFS({ open, compress: true }) })
+  t.teardown(() => other.close())
+
+  const result = await other.exec('SELECT NAME FROM records ORDER BY ID;')
+  t.alike(result.map(({ rows }) => rows[0]), names)
+
+  t.ok(vfs.compressionStats().compressed > 0)
+})
+
+test('malformed compressed pages are reported as corrupt', async (t) => {
+  const magic = Buffer.from([0xff, 0x4c, 0x5a, 0x34])
+
+  const corruptions = [
+    (page) => page.writeUInt32LE(page.byteLength, 4), // Longer than the page
+    (page) => page.writeUInt32LE(page.readUInt32LE(4) >> 1, 4), // Cut short
+    (page) => page.fill(0xff, 8, 24), // Garbled sequences
+    (page) => page.fill(0, 8) // Zero offsets
+  ]
+
+  for (const corrupt of corruptions) {
+    const files = new Map()
+
+    const open = (type) => {
+      if (!files.has(type)) files.set(type, new BufferFile())
+      return files.get(type)
+    }
+
+    const sql = new SQLite3({ vfs: new SQLite3.VFS({ open, compress: true }) })
+    t.teardown(() => sql.close())
+
+    await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY, NAME TEXT NOT NULL);')
+    await sql.exec("INSERT INTO records (ID, NAME) values (1, printf('%.512c', 'a'));")
+
+    const page = files.get(0).buffer.subarray(4096, 8192)
+    t.alike(page.subarray(0, 4), magic, 'stored compressed')
+
+    corrupt(page)
+
+    const other = new SQLite3({ vfs: new SQLite3.VFS({ open, compress: true }) })
+    t.teardown(() => other.close())
+
+    await t.exception(
+      other.exec('SELECT NAME FROM records;'),
+      (err) => err.code === 'SQLITE_CORRUPT'
+    )
+  }
+})
+
+test('vacuum truncates the file', async (t) => {
+  const vfs = new SQLite3.MemoryVFS()
+
+  const sql = new SQLite3({ vfs })
+  t.teardown(() => sql.close())
+
+  await sql.exec('CREATE TABLE records (ID INTEGER PRIMARY KEY AUTOINCREMENT, NAME TEXT NOT NULL);')
+
+  for (let i = 0; i < 100; i++) {
+    await sql.exec('INSERT INTO records (NAME) values (?);', [Buffer.alloc(4096).fill('a').toString()])
+  }
+
+  const file = vfs._files[0]
+  const size = file.size
+
+  await sql.exec('DELETE FROM records;')
+  await sql.exec('VACUUM;')
+
+  t.ok(file.size < size / 10, 'file shrunk')
+  t.is(file.chunks.length, file.size / 4096, 'chunks were freed')
+})
+
+class BufferFile {
+  constructor() {
+    this.buffer = Buffer.alloc(0)
+  }
+
+  get size() {
+    return this.buffer.byteLength
+  }
+
+  read(start, end) {
+    return this.buffer.subarray(start, end)
+  }
+
+  write(start, buffer) {
+    if (start + buffer.byteLength > this.buffer.byteLength) {
+      const grown = Buffer.alloc(start + buffer.byteLength)
+      grown.set(this.buffer)
+      this.buffer = grown
+    }
+
+    this.buffer.set(buffer, start)
+  }
+
+  truncate(size) {
+    this.buffer = this.buffer.subarray(0, size)
+  }
+}
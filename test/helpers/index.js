@@ -5,3 +5,26 @@ exports.create = function create(t) {
   t.teardown(() => db.close())
   return db
 }
+
+// A MemoryVFS whose files implement `sync()`, counting the reads and syncs
+// requested through it.
+exports.CountingVFS = class CountingVFS extends SQLite3.MemoryVFS {
+  constructor(opts) {
+    super(opts)
+    this.reads = 0
+    this.syncs = 0
+  }
+
+  _open(type) {
+    const file = super._open(type)
+    file.sync = () => {
+      this.syncs++
+    }
+    return file
+  }
+
+  _read(...args) {
+    this.reads++
+    return super._read(...args)
+  }
+}